@@ -0,0 +1,53 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package bs3
+
+import (
+	"github.com/asch/bs3/internal/bs3/mapproxy"
+	"github.com/asch/bs3/internal/config"
+)
+
+// One read of a batch passed to ReadvBatch.
+type VectoredRead struct {
+	Sector   int64
+	Length   int64
+	Segments [][]byte
+}
+
+// Like Readv but for multiple reads at once. All reads are looked up in the
+// extent map in one request and nearby object parts in the same object are
+// downloaded by one request, even when they belong to different reads. Since
+// a request can serve multiple reads, an error fails the whole batch.
+func (b *Bs3) ReadvBatch(reads []VectoredRead) error {
+	if len(reads) == 0 {
+		return nil
+	}
+
+	extents := make([]mapproxy.Extent, len(reads))
+	for i, r := range reads {
+		extents[i] = mapproxy.Extent{Sector: r.Sector, Length: r.Length}
+		b.readahead.access(r.Sector, r.Length)
+	}
+
+	r := b.gcData.readers.enter(reads[0].Sector)
+	defer r.leave()
+
+	pieces := b.extentMapProxy.LookupBatch(extents)
+
+	blockSize := int64(config.Cfg.BlockSize)
+	parts := make([]readPart, 0, len(reads))
+	for i, r := range reads {
+		var offset int64
+		for _, op := range pieces[i] {
+			size := op.Length * blockSize
+			if op.Key != mapproxy.NotMappedKey {
+				parts = append(parts, readPart{op, sliceSegments(r.Segments, offset, size)})
+			} else {
+				zeroSegments(sliceSegments(r.Segments, offset, size))
+			}
+			offset += size
+		}
+	}
+
+	return b.downloadParts(parts)
+}
@@ -5,14 +5,18 @@ package bs3
 import (
 	"encoding/binary"
 	"sync"
+	"sync/atomic"
 	"time"
 
 	"github.com/rs/zerolog/log"
 
+	"github.com/asch/bs3/internal/bs3/cache"
 	"github.com/asch/bs3/internal/bs3/key"
 	"github.com/asch/bs3/internal/bs3/mapproxy"
+	"github.com/asch/bs3/internal/bs3/mapproxy/extenttree"
 	"github.com/asch/bs3/internal/bs3/mapproxy/sectormap"
 	"github.com/asch/bs3/internal/bs3/objproxy"
+	"github.com/asch/bs3/internal/bs3/objproxy/diskcache"
 	"github.com/asch/bs3/internal/bs3/objproxy/s3"
 	"github.com/asch/bs3/internal/config"
 )
@@ -22,10 +26,6 @@ const (
 	// kernel.
 	WRITE_ITEM_SIZE = 32
 
-	// Key representing the object where serialized version of map is
-	// stored.
-	checkpointKey = -1
-
 	// Typical number of extents per object for precise memory allocation
 	// for return values. In the worst case reallocation happens.
 	typicalExtentsPerObject = 128
@@ -33,6 +33,11 @@ const (
 	// Sector is a linux constant, which is always 512, no matter how big your sectors or blocks
 	// are. Please be careful since the terminology is ambiguous.
 	sectorUnit = 512
+
+	// Pause between attempts to store a tombstone. Every attempt is
+	// already retried by the proxy, the pause matters when the circuit is
+	// open and the upload fails immediately.
+	tombstoneRetryDelay = time.Second
 )
 
 // Bs3 implements BuseReadWriter interface which can be passed to the buse
@@ -42,8 +47,8 @@ const (
 // Bs3 uses s3 protocol to communicate with the storage backend (most probably
 // aws s3) but it can be anything else. It manages the mapping between local
 // device and remote backend and performs all the operations for correct
-// functionality. The default structure is sectormap but it can be changed
-// trivially.
+// functionality. The default structure is sectormap, extenttree is selected
+// by the configuration, see extentMapper().
 type Bs3 struct {
 	// Proxy struct for the operations on objects like uploads, downloads
 	// etc. Proxy structs are used for serialization and prioritization of
@@ -51,18 +56,49 @@ type Bs3 struct {
 	objectStoreProxy objproxy.ObjectProxy
 
 	// Proxy struct for the operations on extent map like updates, lookups
-	// etc. Proxy structs are used for serialization and prioritization of
-	// requests.
-	extentMapProxy mapproxy.ExtentMapProxy
+	// etc. It shards the map, so the operations run in parallel.
+	extentMapProxy *mapproxy.ExtentMapProxy
 
 	// Data private to the garbage collection process.
 	gcData struct {
-		// Reference counter of objects which are actually downloaded
-		// and hence cannot be deleted from the storage backend.
-		refcounter map[int64]int64
+		// Requests which looked up objects and may still download
+		// them, hence the objects cannot be deleted from the storage
+		// backend.
+		readers readers
+
+		// Objects with discard or zero extents. They must not be
+		// garbage collected until a checkpoint contains the discards. Otherwise
+		// the recovery from an older checkpoint would replay the
+		// discarded writes without the discards.
+		pinned map[int64]struct{}
+
+		// Lock guarding pinned. It is held while the object is pinned
+		// and applied to the map, hence every pinned object observed
+		// under the lock is already in the map.
+		pinlock sync.Mutex
+	}
 
-		// Lock guarding the refcounter.
-		reflock sync.Mutex
+	// Data private to the checkpointing.
+	checkpointData struct {
+		// Serializes checkpoints.
+		mutex sync.Mutex
+
+		// Keys of the full checkpoint and the deltas referenced by the
+		// manifest on the backend.
+		parts []int64
+
+		// Whether the previous checkpoint failed. The map forgot its
+		// changes, hence the next checkpoint has to be full.
+		failed bool
+
+		// Keys of the parts of failed checkpoints since the last stored
+		// manifest. The manifest upload may fail after it was stored,
+		// hence the manifest on the backend can reference them.
+		unsure []int64
+
+		// Settled key and time of the previous checkpoint.
+		settled int64
+		last    time.Time
 	}
 
 	// Size of the metadata for one write in the write chunk read from the
@@ -73,49 +109,240 @@ type Bs3 struct {
 	// chunk from the kernel. After this metadata_size offset real data are
 	// stored.
 	metadata_size int
+
+	// Buffer coalescing single writes into chunk-sized objects.
+	writes *writeBuffer
+
+	// Counter of object keys of this volume.
+	keys key.Counter
+
+	// Name of the volume used in log messages.
+	name string
+
+	// Object proxy workers owned by this instance. Nil when the workers
+	// are shared with other volumes.
+	workers *objproxy.Workers
+
+	// Closed when background go routines should exit.
+	stop chan struct{}
+
+	// Cache of object blocks, possibly shared with other volumes. Nil when
+	// caching is disabled.
+	cache *cache.Cache
+
+	// Identification of the volume in the cache. Unique in the process.
+	volume uint64
+
+	// Detector of sequential reads prefetching into the cache. Nil when
+	// readahead or the cache is disabled.
+	readahead *readahead
+}
+
+// Last volume identification assigned in the process.
+var lastVolume uint64
+
+// Backend shared by multiple volumes. All volumes are stored in one bucket,
+// every volume under its own prefix, and they share one pool of object proxy
+// workers and one http connection pool.
+type Backend struct {
+	store   *s3.S3
+	workers *objproxy.Workers
+	cache   *cache.Cache
+
+	// Persistent cache under the object proxies of all volumes. Nil when
+	// it is disabled.
+	disk *diskcache.Cache
+}
+
+// Returns constructor of the configured extent map of length blocks.
+// Sectormap is the fastest but takes memory for every block of the device,
+// extenttree takes memory just for the written extents. Other names are
+// rejected by config.Configure.
+func extentMapper() func(length int64) mapproxy.ExtentMapper {
+	if config.Cfg.ExtentMap == "tree" {
+		return func(length int64) mapproxy.ExtentMapper {
+			return extenttree.New(length)
+		}
+	}
+
+	return func(length int64) mapproxy.ExtentMapper {
+		return sectormap.New(length)
+	}
 }
 
 // Returns bs3 with default configuration, i.e. with s3 as a communication
-// protocol and sectormap as an extent map.
+// protocol and the configured extent map.
 func NewWithDefaults() (*Bs3, error) {
-	s3Handler, err := s3.New(s3.Options{
+	s3Handler, err := s3.New(s3Options())
+
+	if err != nil {
+		return nil, err
+	}
+
+	disk, err := openDiskCache()
+	if err != nil {
+		return nil, err
+	}
+
+	var store objproxy.ObjectUploadDownloaderAt = s3Handler
+	if disk != nil {
+		store = disk.Volume("", s3Handler)
+	}
+
+	bs3 := New(store, extentMapper())
+	bs3.name = config.Cfg.S3.Bucket
+
+	return bs3, nil
+}
+
+// Returns backend with default configuration, i.e. with s3 as a communication
+// protocol. Volumes are opened by Open().
+func NewBackend() (*Backend, error) {
+	s3Handler, err := s3.New(s3Options())
+
+	if err != nil {
+		return nil, err
+	}
+
+	disk, err := openDiskCache()
+	if err != nil {
+		return nil, err
+	}
+
+	be := &Backend{
+		store: s3Handler,
+		workers: objproxy.NewWorkers(config.Cfg.S3.Uploaders, config.Cfg.S3.Downloaders,
+			time.Duration(config.Cfg.GC.IdleTimeoutMs)*time.Millisecond, retryPolicy(), limitPolicy()),
+		cache: cache.New(config.Cfg.Read.CacheSize, config.Cfg.BlockSize),
+		disk:  disk,
+	}
+
+	return be, nil
+}
+
+// Returns options of the s3 backend from the configuration.
+func s3Options() s3.Options {
+	return s3.Options{
 		Remote:    config.Cfg.S3.Remote,
 		Region:    config.Cfg.S3.Region,
 		AccessKey: config.Cfg.S3.AccessKey,
 		SecretKey: config.Cfg.S3.SecretKey,
 		Bucket:    config.Cfg.S3.Bucket,
-	})
 
-	if err != nil {
-		return nil, err
+		HedgePercentile: config.Cfg.S3.HedgePercentile,
+		HedgeBudget:     config.Cfg.S3.HedgeBudget,
+		HedgeMinDelay:   time.Duration(config.Cfg.S3.HedgeMinDelayMs) * time.Millisecond,
 	}
+}
 
-	mapSize := config.Cfg.Size / int64(config.Cfg.BlockSize)
-	bs3 := New(s3Handler, sectormap.New(mapSize))
+// Returns policy for retrying failed requests from the configuration.
+func retryPolicy() objproxy.RetryPolicy {
+	ms := func(v int64) time.Duration { return time.Duration(v) * time.Millisecond }
+
+	return objproxy.RetryPolicy{
+		BaseDelay:        ms(config.Cfg.S3.RetryBaseDelayMs),
+		MaxDelay:         ms(config.Cfg.S3.RetryMaxDelayMs),
+		Deadline:         ms(config.Cfg.S3.RetryDeadlineMs),
+		Budget:           config.Cfg.S3.RetryBudget,
+		BreakerThreshold: config.Cfg.S3.BreakerThreshold,
+		BreakerCooldown:  ms(config.Cfg.S3.BreakerCooldownMs),
+	}
+}
 
-	return bs3, nil
+// Returns policy of the adaptive concurrency from the configuration.
+func limitPolicy() objproxy.LimitPolicy {
+	return objproxy.LimitPolicy{
+		Min:       config.Cfg.S3.MinConcurrency,
+		Tolerance: config.Cfg.S3.LatencyTolerance,
+	}
+}
+
+// Opens the persistent cache if it is configured. Returns nil cache when it is
+// disabled.
+func openDiskCache() (*diskcache.Cache, error) {
+	if config.Cfg.Read.DiskCachePath == "" {
+		return nil, nil
+	}
+
+	return diskcache.Open(config.Cfg.Read.DiskCachePath, config.Cfg.Read.DiskCacheSize,
+		config.Cfg.BlockSize, config.Cfg.S3.Remote+"/"+config.Cfg.S3.Bucket)
+}
+
+// Returns statistics of the block cache shared by all volumes.
+func (be *Backend) CacheStats() cache.Stats {
+	return be.cache.Stats()
+}
+
+// Returns current concurrency of uploads and downloads to the backend.
+func (be *Backend) Concurrency() (uploads, downloads objproxy.Concurrency) {
+	return be.workers.Concurrency()
+}
+
+// Returns bs3 for volume with name stored in the backend with the configured
+// extent map. Empty name means that the volume owns the whole bucket, which is
+// the layout used by NewWithDefaults(). The volume is not restored yet, see
+// BusePreRun().
+func (be *Backend) Open(name string) *Bs3 {
+	prefix := ""
+	if name != "" {
+		prefix = name + "/"
+	}
+
+	var store objproxy.ObjectUploadDownloaderAt = be.store.WithPrefix(prefix)
+	if be.disk != nil {
+		store = be.disk.Volume(name, store)
+	}
+
+	bs3 := newBs3(be.workers.Proxy(store), extentMapper(), be.cache)
+	bs3.name = config.Cfg.S3.Bucket + "/" + name
+
+	return bs3
 }
 
 // Returns bs3 with provided protocol for communication with backend storage
-// and extentMap for keeping the mapping between local device and remote
-// backend.
-func New(objectStore objproxy.ObjectUploadDownloaderAt, extentMap mapproxy.ExtentMapper) *Bs3 {
-	bs3 := Bs3{
-		objectStoreProxy: objproxy.New(
-			objectStore, config.Cfg.S3.Uploaders, config.Cfg.S3.Downloaders,
-			time.Duration(config.Cfg.GC.IdleTimeoutMs)*time.Millisecond),
+// and extentMapper for creating the shards of the mapping between local device
+// and remote backend.
+func New(objectStore objproxy.ObjectUploadDownloaderAt, extentMapper func(length int64) mapproxy.ExtentMapper) *Bs3 {
+	objectStoreProxy := objproxy.New(
+		objectStore, config.Cfg.S3.Uploaders, config.Cfg.S3.Downloaders,
+		time.Duration(config.Cfg.GC.IdleTimeoutMs)*time.Millisecond, retryPolicy(), limitPolicy())
+
+	bs3 := newBs3(objectStoreProxy, extentMapper, cache.New(config.Cfg.Read.CacheSize, config.Cfg.BlockSize))
+	bs3.workers = objectStoreProxy.Workers()
 
-		extentMapProxy: mapproxy.New(
-			extentMap, time.Duration(config.Cfg.GC.IdleTimeoutMs)*time.Millisecond),
+	return bs3
+}
+
+// Returns bs3 using objectStoreProxy for communication with backend storage,
+// extentMapper for creating the shards of the mapping and blockCache for
+// caching of blocks. Shards are striped by collision domains.
+func newBs3(objectStoreProxy objproxy.ObjectProxy, extentMapper func(length int64) mapproxy.ExtentMapper, blockCache *cache.Cache) *Bs3 {
+	mapSize := config.Cfg.Size / int64(config.Cfg.BlockSize)
+	stripe := int64(config.Cfg.Write.CollisionSize / config.Cfg.BlockSize)
+	if stripe == 0 {
+		stripe = 1
+	}
+
+	bs3 := &Bs3{
+		objectStoreProxy: objectStoreProxy,
+
+		extentMapProxy: mapproxy.New(extentMapper, mapSize, stripe),
 
 		metadata_size: config.Cfg.Write.ChunkSize / config.Cfg.BlockSize * WRITE_ITEM_SIZE,
 
 		write_item_size: WRITE_ITEM_SIZE,
+
+		stop: make(chan struct{}),
+
+		cache:  blockCache,
+		volume: atomic.AddUint64(&lastVolume, 1),
 	}
 
-	bs3.gcData.refcounter = make(map[int64]int64)
+	bs3.gcData.pinned = make(map[int64]struct{})
+	bs3.writes = newWriteBuffer(bs3)
+	bs3.readahead = newReadahead(bs3)
 
-	return &bs3
+	return bs3
 }
 
 // Handle writes comming from the buse library. writes contain number write
@@ -128,7 +355,8 @@ func New(objectStore objproxy.ObjectUploadDownloaderAt, extentMap mapproxy.Exten
 // chunk us uploaded with generated key, which is just one more than the
 // previous one.
 func (b *Bs3) BuseWrite(writes int64, chunk []byte) error {
-	key := key.Next()
+	key := b.keys.Next()
+	defer b.keys.Done(key)
 
 	metadata := chunk[:b.metadata_size]
 	extents := make([]mapproxy.Extent, writes)
@@ -152,107 +380,222 @@ func (b *Bs3) BuseWrite(writes int64, chunk []byte) error {
 	object := chunk[:uint64(b.metadata_size)+dataSize]
 
 	// Some s3 backends, like minio just drops connection when they are
-	// under load. Hence the loop with exponential backoff till the
-	// operation succeeds. There is no point to return error, since the
-	// best thing we can do is to try infinitely and print a message to
-	// log.
-	for i := 1; ; i *= 2 {
-		err := b.objectStoreProxy.Upload(key, object, true)
+	// under load. The proxy retries the upload, when it gives up, the
+	// chunk fails and the key is filled by a tombstone.
+	err := b.objectStoreProxy.Upload(key, object, objproxy.ClassWrite)
+	if err != nil {
+		log.Error().Err(err).Int64("key", key).Msg("Upload failed.")
+		b.storeTombstone(key)
+		return err
+	}
+
+	b.cacheObject(extents, key, object)
+	b.applyObject(extents, key)
+
+	return nil
+}
+
+// Uploads empty object under the key of a failed upload. Recovery treats it
+// like a garbage collected object, hence objects with higher keys are not
+// removed because of a hole in the key sequence. It has to succeed before any
+// object with higher key is applied, so it is retried until the backend
+// recovers.
+func (b *Bs3) storeTombstone(key int64) {
+	for {
+		err := b.objectStoreProxy.Upload(key, []byte{}, objproxy.ClassWrite)
 		if err == nil {
-			break
+			return
 		}
-		log.Info().Err(err).Send()
-		time.Sleep(time.Duration(i) * time.Second)
+		log.Error().Err(err).Int64("key", key).Msg("Storing tombstone failed.")
+		time.Sleep(tombstoneRetryDelay)
 	}
+}
 
-	b.extentMapProxy.Update(extents, int64(b.metadata_size/config.Cfg.BlockSize), key)
+// Writes length blocks from data starting at sector. Unlike BuseWrite, which
+// receives whole chunks from the kernel, this is a single write coming from the
+// librbd interface. It is packed together with other concurrent writes into one
+// object by the write buffer. The call returns when the write is durable and
+// visible in the extent map. Returns error when the upload failed, the write
+// is not applied then.
+func (b *Bs3) Write(sector, length int64, data []byte) error {
+	return b.writes.write(sector, length, [][]byte{data})
+}
+
+// Writes length blocks from segments starting at sector. Segments are treated
+// as one continuous buffer and their data are copied directly into the
+// coalesced object.
+func (b *Bs3) Writev(sector, length int64, segments [][]byte) error {
+	return b.writes.write(sector, length, segments)
+}
+
+// Discards length blocks starting at sector. The sectors are unmapped and read
+// as zeros afterwards. The discard is logged in the object metadata like a
+// write without data, hence it survives recovery. The call returns when the
+// discard is durable and visible in the extent map.
+func (b *Bs3) Discard(sector, length int64) error {
+	if sectors := config.Cfg.Size / int64(config.Cfg.BlockSize); sector+length > sectors {
+		length = sectors - sector
+	}
+
+	if length > 0 {
+		return b.writes.discard(sector, length)
+	}
 
 	return nil
 }
 
-//Like BuseWrite for just 1 write but with metadata separate from data
-func (b *Bs3) WriteSingle(Sector, Length int64, data []byte) {
-	key := key.Next()
+// Zeroes length blocks starting at sector. Unlike a write of zeros, no data are
+// uploaded and the sectors are just unmapped, hence they are read as zeros
+// without touching the backend. The call returns when the zeroing is durable
+// and visible in the extent map.
+func (b *Bs3) WriteZeroes(sector, length int64) error {
+	if sectors := config.Cfg.Size / int64(config.Cfg.BlockSize); sector+length > sectors {
+		length = sectors - sector
+	}
 
-	extents := [1]mapproxy.Extent{}
-	extents[0].Sector = Sector
-	extents[0].Length = Length
-	extents[0].SeqNo = key //We dont keep track of SeqNo anywhere so we will simply use object sequence numbers
-	extents[0].Flag = 0
+	if length > 0 {
+		return b.writes.zero(sector, length)
+	}
 
-	blockSize := uint64(config.Cfg.BlockSize)
-	dataSize := uint64(Length) * blockSize
-	metadataSize := uint64(b.metadata_size)
+	return nil
+}
 
-	object := make([]byte, metadataSize+dataSize)
-	//write extent to metadata section
-	binary.LittleEndian.PutUint64(object[:8], uint64(extents[0].Sector))
-	binary.LittleEndian.PutUint64(object[8:16], uint64(extents[0].Length))
-	binary.LittleEndian.PutUint64(object[16:24], uint64(extents[0].SeqNo))
-	//copy data to object's data portion
-	copy(object[metadataSize:], data)
+// Applies extents of the object with key to the extent map. Objects with
+// discard or zero extents are pinned before, see gcData.pinned.
+func (b *Bs3) applyObject(extents []mapproxy.Extent, key int64) {
+	b.gcData.pinlock.Lock()
+	defer b.gcData.pinlock.Unlock()
 
-	// Some s3 backends, like minio just drops connection when they are
-	// under load. Hence the loop with exponential backoff till the
-	// operation succeeds. There is no point to return error, since the
-	// best thing we can do is to try infinitely and print a message to
-	// log.
-	for i := 1; ; i *= 2 {
-		err := b.objectStoreProxy.Upload(key, object, true)
-		if err == nil {
+	for _, e := range extents {
+		if !e.HasData() {
+			b.gcData.pinned[key] = struct{}{}
 			break
 		}
-		log.Info().Err(err).Send()
-		time.Sleep(time.Duration(i) * time.Second)
 	}
 
-	b.extentMapProxy.Update(extents[:], int64(b.metadata_size/config.Cfg.BlockSize), key)
-
+	b.extentMapProxy.Update(extents, int64(b.metadata_size/config.Cfg.BlockSize), key)
 }
 
-// Download part of the object to the memory buffer chunk. The part is
-// specified by part and it is necessary to call wg.Done() when the upload is
-// finished.
-func (b *Bs3) downloadObjectPart(part mapproxy.ObjectPart, chunk []byte, wg *sync.WaitGroup) {
-	defer wg.Done()
+// Inserts data of the uploaded object with key into the cache. Freshly written
+// data are likely to be read soon and the cache policy evicts them quickly if
+// they are not.
+func (b *Bs3) cacheObject(extents []mapproxy.Extent, key int64, object []byte) {
+	if b.cache == nil {
+		return
+	}
+
+	blockSize := int64(config.Cfg.BlockSize)
+	sector := int64(b.metadata_size) / blockSize
+	for _, e := range extents {
+		if !e.HasData() {
+			continue
+		}
 
-	// Some s3 backends, like minio just drops connection when they are
-	// under load. Hence the loop with exponential backoff till the
-	// operation succeeds. There is no point to return error, since the
-	// best thing we can do is to try infinitely and print a message to
-	// log.
-	for i := 1; ; i *= 2 {
-		err := b.objectStoreProxy.Download(part.Key, chunk, part.Sector*int64(config.Cfg.BlockSize), true)
-		if err == nil {
-			break
+		for i := int64(0); i < e.Length; i++ {
+			offset := (sector + i) * blockSize
+			b.cache.Put(b.cacheKey(key, sector+i), [][]byte{object[offset : offset+blockSize]})
 		}
-		log.Info().Err(err).Send()
-		time.Sleep(time.Duration(i) * time.Second)
+		sector += e.Length
 	}
 }
 
+// Download part of the object to the memory segments. The part is specified by
+// part. Cached blocks at both ends of the part are taken from the cache and the
+// rest is downloaded by one request and cached. Cached blocks in the middle are
+// downloaded again, since one request is cheaper than splitting the part.
+func (b *Bs3) downloadObjectPart(part mapproxy.ObjectPart, segments [][]byte) error {
+	if b.cache == nil {
+		return b.download(part, segments)
+	}
+
+	blockSize := int64(config.Cfg.BlockSize)
+	block := func(i int64) [][]byte {
+		return sliceSegments(segments, i*blockSize, blockSize)
+	}
+
+	first, end := int64(0), part.Length
+	for first < end && b.cache.Get(b.cacheKey(part.Key, part.Sector+first), block(first)) {
+		first++
+	}
+	for end-1 > first && b.cache.Get(b.cacheKey(part.Key, part.Sector+end-1), block(end-1)) {
+		end--
+	}
+
+	if first == end {
+		return nil
+	}
+
+	missing := mapproxy.ObjectPart{Key: part.Key, Sector: part.Sector + first, Length: end - first}
+	err := b.download(missing, sliceSegments(segments, first*blockSize, (end-first)*blockSize))
+	if err != nil {
+		return err
+	}
+
+	for i := first; i < end; i++ {
+		b.cacheBlock(part.Key, part.Sector+i, block(i))
+	}
+
+	return nil
+}
+
+// Returns cache key of block at sector in object with key.
+func (b *Bs3) cacheKey(key, sector int64) cache.Key {
+	return cache.Key{Volume: b.volume, Object: key, Block: sector}
+}
+
+// Inserts block at sector in object with key into the cache. Partial blocks,
+// i.e. tails of requests not aligned to the block size, are not cached.
+func (b *Bs3) cacheBlock(key, sector int64, segments [][]byte) {
+	if segmentsSize(segments) == int64(config.Cfg.BlockSize) {
+		b.cache.Put(b.cacheKey(key, sector), segments)
+	}
+}
+
+// Downloads part of the object to the memory segments. Some s3 backends, like
+// minio just drops connection when they are under load, hence the proxy retries
+// failed downloads. The error is returned when it gives up and the read fails.
+func (b *Bs3) download(part mapproxy.ObjectPart, segments [][]byte) error {
+	err := b.objectStoreProxy.DownloadV(part.Key, segments, part.Sector*int64(config.Cfg.BlockSize), objproxy.ClassRead)
+	if err != nil {
+		log.Error().Err(err).Int64("key", part.Key).Msg("Download failed.")
+	}
+
+	return err
+}
+
 // Read extent starting at sector with length length to the buffer chunk.
 // Length of the chunk is the same as length variable. This function consults
 // the extent map and asynchronously downloads all needed pieces to reconstruct
 // the logical extent.
 func (b *Bs3) BuseRead(sector, length int64, chunk []byte) error {
-	objectPieces := b.getObjectPiecesRefCounterInc(sector, length)
+	return b.Readv(sector, length, [][]byte{chunk})
+}
+
+// Like BuseRead but the destination is scattered into segments which are
+// treated as one continuous buffer. Every object part is downloaded directly
+// into the segments it covers. Nearby parts of one object are downloaded by
+// one request, see planReads.
+func (b *Bs3) Readv(sector, length int64, segments [][]byte) error {
+	b.readahead.access(sector, length)
 
-	var wg sync.WaitGroup
+	r := b.gcData.readers.enter(sector)
+	defer r.leave()
+
+	objectPieces := b.extentMapProxy.Lookup(sector, length)
+
+	parts := make([]readPart, 0, len(objectPieces))
+	var offset int64
 	for _, op := range objectPieces {
 		size := op.Length * int64(config.Cfg.BlockSize)
 		if op.Key != mapproxy.NotMappedKey {
-			wg.Add(1)
-			go b.downloadObjectPart(op, chunk[:size], &wg)
+			parts = append(parts, readPart{op, sliceSegments(segments, offset, size)})
+		} else {
+			zeroSegments(sliceSegments(segments, offset, size))
 		}
-		chunk = chunk[size:]
+		offset += size
 	}
 
-	wg.Wait()
-
-	b.objectPiecesRefCounterDec(objectPieces)
-
-	return nil
+	return b.downloadParts(parts)
 }
 
 // Before buse library communicating with the kernel starts, we restore map
@@ -260,10 +603,16 @@ func (b *Bs3) BuseRead(sector, length int64, chunk []byte) error {
 // for threshold garbage collection. Then we run infinite loop with garbage
 // collection deleting just completely dead objects withou any data. It is very
 // fast and efficiet and has a huge impact on the backend space utilization.
-// Hence we run it continuously.
+// Hence we run it continuously. Checkpoints are taken in the background too,
+// so the recovery after a crash does not replay all objects written since the
+// start.
 func (b *Bs3) BusePreRun() {
 	if !config.Cfg.SkipCheckpoint {
 		b.restore()
+
+		if config.Cfg.Checkpoint.Interval > 0 {
+			go b.checkpointer()
+		}
 	}
 
 	// b.registerSigUSR1Handler() //not good to have in a library
@@ -273,54 +622,25 @@ func (b *Bs3) BusePreRun() {
 
 // After disconnecting from the kernel module and just before shuting the
 // daemon down we save the map to the backend so it can be restored during next
-// start and mapping is not lost.
+// start without replaying any object. Sequential numbers are zeroed, since the
+// kernel starts from zero again after the restart.
 func (b *Bs3) BusePostRemove() {
-	if !config.Cfg.SkipCheckpoint {
-		b.checkpoint()
-	}
-}
-
-// Returns object pieces for reconstructing logical extent but before that
-// safely increments the refcounter for the objects. Objects in refcounter are
-// excluded from garbage collection.
-func (b *Bs3) getObjectPiecesRefCounterInc(sector, length int64) []mapproxy.ObjectPart {
-	b.gcData.reflock.Lock()
-	defer b.gcData.reflock.Unlock()
+	b.writes.flush()
 
-	objectPieces := b.extentMapProxy.Lookup(int64(sector), int64(length))
-
-	for _, op := range objectPieces {
-		b.gcData.refcounter[op.Key]++
-	}
-
-	return objectPieces
-}
-
-// Decrements the refcounter for the object pieces. Objects in refcounter are
-// excluded from garbage collection.
-func (b *Bs3) objectPiecesRefCounterDec(objectPieces []mapproxy.ObjectPart) {
-	b.gcData.reflock.Lock()
-
-	for _, op := range objectPieces {
-		b.gcData.refcounter[op.Key]--
+	if !config.Cfg.SkipCheckpoint {
+		b.extentMapProxy.ResetSeqNos()
+		b.checkpoint(true, true)
 	}
-
-	b.gcData.reflock.Unlock()
 }
 
-// Restores the map from the checkpoint saved on the backend and updates the
-// current object key accordingly. If it exists.
-func (b *Bs3) restoreFromCheckpoint() {
-	mapSize, err := b.objectStoreProxy.Instance.GetObjectSize(checkpointKey)
-	if err == nil {
-		log.Info().Msg("->Checkpoint found. Checkpoint recovery started.")
-
-		compressedMap := make([]byte, mapSize)
-		b.objectStoreProxy.Download(checkpointKey, compressedMap, 0, false)
-		newKey := b.extentMapProxy.Instance.DeserializeAndReturnNextKey(compressedMap)
-		key.Replace(newKey)
+// Stops all background go routines of the volume. It has to be called after
+// BusePostRemove() when the volume is not used anymore, but the process
+// continues, e.g. when the volume is closed through librbd.
+func (b *Bs3) Close() {
+	close(b.stop)
 
-		log.Info().Msgf("->Checkpoint recovery process finished. Last object from checkpoint is %d.", newKey)
+	if b.workers != nil {
+		b.workers.Close()
 	}
 }
 
@@ -331,10 +651,10 @@ func (b *Bs3) restoreFromCheckpoint() {
 func (b *Bs3) restoreFromObjects() {
 	log.Info().Msg("->Looking for objects to do roll forward recovery.")
 
-	keyBefore := key.Current()
-	for ; ; key.Next() {
+	keyBefore := b.keys.Current()
+	for ; ; b.keys.Done(b.keys.Next()) {
 		header := make([]byte, b.metadata_size)
-		size, err := b.objectStoreProxy.Instance.GetObjectSize(key.Current())
+		size, err := b.objectStoreProxy.Instance.GetObjectSize(b.keys.Current())
 		if err != nil {
 			// Prefix consistency broken.
 			break
@@ -346,7 +666,7 @@ func (b *Bs3) restoreFromObjects() {
 		}
 
 		// Get writes metadata for object.
-		err = b.objectStoreProxy.Instance.DownloadAt(key.Current(), header, 0)
+		err = b.objectStoreProxy.Instance.DownloadAt(b.keys.Current(), header, 0)
 		if err != nil {
 			break
 		}
@@ -365,51 +685,17 @@ func (b *Bs3) restoreFromObjects() {
 			extents = append(extents, e)
 			header = header[b.write_item_size:]
 		}
-		//NOTE: This line forces us to keep metadata size to atleast 1 BlockSize
-		dataBegin := int64(b.metadata_size / config.Cfg.BlockSize)
-		b.extentMapProxy.Update(extents, dataBegin, key.Current())
+		//NOTE: applyObject forces us to keep metadata size to atleast 1 BlockSize
+		b.applyObject(extents, b.keys.Current())
 	}
 
-	if keyBefore == key.Current() {
+	if keyBefore == b.keys.Current() {
 		log.Info().Msg("->No extra objects found for roll forward recovery.")
 	} else {
-		log.Info().Msgf("->Extra %d objects for roll forward recovery found.", key.Current()-keyBefore)
+		log.Info().Msgf("->Extra %d objects for roll forward recovery found.", b.keys.Current()-keyBefore)
 	}
 }
 
-// Restores map from saved checkpoint and then continuous in restoration from
-// individual objects. E.g. when crash happens, checkpoint is not uploaded
-// hence the old checkpoint is read. However there can already be uploaded new
-// set of objects fulfilling prefix consistency.
-func (b *Bs3) restore() {
-	log.Info().Msgf("Checking for old volume in bucket %s.", config.Cfg.S3.Bucket)
-
-	b.restoreFromCheckpoint()
-	b.restoreFromObjects()
-	b.objectStoreProxy.Instance.DeleteKeyAndSuccessors(key.Current())
-
-	if key.Current() == 0 {
-		log.Info().Msgf("No volume found. Bucket %s is used for new volume.", config.Cfg.S3.Bucket)
-	} else {
-		log.Info().Msgf("Volume found in bucket %s. The last object is %d.", config.Cfg.S3.Bucket, key.Current())
-	}
-}
-
-// Serializes extent map and upload it to the backend.
-func (b *Bs3) checkpoint() {
-	log.Info().Msg("Checkpointing started.")
-
-	log.Info().Msg("->Serialization of extent map started.")
-	dump := b.extentMapProxy.Instance.Serialize()
-	log.Info().Msg("->Serialization of extent map finished.")
-
-	log.Info().Msg("->Upload of extent map started.")
-	b.objectStoreProxy.Upload(checkpointKey, dump, false)
-	log.Info().Msg("->Upload of extent map finished.")
-
-	log.Info().Msgf("Checkpointing finished. Last checkpointed object is %d.", key.Current())
-}
-
 // Parses write extent information from 32 bytes of raw memory. The memory is
 // one write in metadata section of the object.
 func parseExtent(b []byte) mapproxy.Extent {
@@ -0,0 +1,369 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+// Package cache provides memory bounded cache of blocks stored in objects.
+// Objects are immutable once written, hence the cache never needs to be
+// invalidated. It just has to forget blocks of objects which are not used
+// anymore, which happens naturally by eviction.
+//
+// The replacement policy is S3-FIFO. New blocks enter a small FIFO queue and
+// only blocks accessed again while there are promoted to the main FIFO queue.
+// Blocks accessed just once, e.g. by a sequential scan or by our own uploads,
+// are evicted from the small queue quickly without disturbing the hot set in
+// the main queue. Keys of blocks evicted from the small queue are remembered
+// in a ghost queue and blocks found there are inserted directly into the main
+// queue.
+package cache
+
+import (
+	"sync"
+)
+
+const (
+	// Number of independent shards. Every shard has its own lock.
+	shards = 64
+
+	// Maximal value of the access counter of the block.
+	maxFreq = 3
+
+	// Part of the shard capacity dedicated to the small queue, in percent.
+	smallPercent = 10
+)
+
+// Identification of the cached block.
+type Key struct {
+	// Volume owning the object. Different volumes have independent spaces
+	// of object keys.
+	Volume uint64
+
+	// Key of the object.
+	Object int64
+
+	// Block in the object.
+	Block int64
+}
+
+// Cache of blocks. It is safe for concurrent use. Nil Cache is a valid cache
+// which never contains anything.
+type Cache struct {
+	blockSize int
+	shards    [shards]shard
+}
+
+// Cache statistics.
+type Stats struct {
+	// Number of cached blocks.
+	Blocks int64
+
+	// Maximal number of cached blocks.
+	Capacity int64
+
+	Hits      uint64
+	Misses    uint64
+	Evictions uint64
+}
+
+// One cached block.
+type entry struct {
+	key  Key
+	data []byte
+	freq int
+}
+
+// Independent part of the cache with its own lock, queues and statistics.
+type shard struct {
+	mutex sync.Mutex
+
+	entries map[Key]*entry
+	small   queue
+	main    queue
+
+	// Keys recently evicted from the small queue.
+	ghost      map[Key]struct{}
+	ghostQueue keyQueue
+
+	// Capacities in blocks.
+	capacity      int
+	smallCapacity int
+
+	hits      uint64
+	misses    uint64
+	evictions uint64
+
+	// Avoid false sharing of the neighbouring shards.
+	_ [64]byte
+}
+
+// Returns cache of blocks of blockSize bytes using at most size bytes of
+// memory for the data. Returns nil when size is too small for a single block
+// per shard, i.e. the cache is disabled.
+func New(size int64, blockSize int) *Cache {
+	capacity := int(size / int64(blockSize) / shards)
+	if capacity < 1 {
+		return nil
+	}
+
+	smallCapacity := capacity * smallPercent / 100
+	if smallCapacity < 1 {
+		smallCapacity = 1
+	}
+
+	c := &Cache{blockSize: blockSize}
+	for i := range c.shards {
+		s := &c.shards[i]
+		s.entries = make(map[Key]*entry)
+		s.ghost = make(map[Key]struct{})
+		s.capacity = capacity
+		s.smallCapacity = smallCapacity
+	}
+
+	return c
+}
+
+// Returns shard responsible for key.
+func (c *Cache) shard(key Key) *shard {
+	h := uint64(key.Object)*0x9e3779b97f4a7c15 ^ uint64(key.Block)*0xc2b2ae3d27d4eb4f ^ key.Volume
+	h ^= h >> 29
+
+	return &c.shards[h%shards]
+}
+
+// Copies the block identified by key into dst, which are treated as one
+// continuous buffer of the block size. Returns false when the block is not
+// cached.
+func (c *Cache) Get(key Key, dst [][]byte) bool {
+	if c == nil {
+		return false
+	}
+
+	s := c.shard(key)
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+
+	e, ok := s.entries[key]
+	if !ok {
+		s.misses++
+		return false
+	}
+
+	s.hits++
+	if e.freq < maxFreq {
+		e.freq++
+	}
+
+	data := e.data
+	for _, d := range dst {
+		data = data[copy(d, data):]
+	}
+
+	return true
+}
+
+// Returns whether the block identified by key is cached. Unlike Get, it does
+// not count as an access.
+func (c *Cache) Contains(key Key) bool {
+	if c == nil {
+		return false
+	}
+
+	s := c.shard(key)
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+
+	_, ok := s.entries[key]
+
+	return ok
+}
+
+// Inserts the block identified by key with data from src, which are treated
+// as one continuous buffer of the block size. The data are copied.
+func (c *Cache) Put(key Key, src [][]byte) {
+	if c == nil {
+		return
+	}
+
+	s := c.shard(key)
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+
+	if _, ok := s.entries[key]; ok {
+		return
+	}
+
+	// Reuse memory of the evicted block if there is any.
+	var data []byte
+	for len(s.entries) >= s.capacity {
+		data = s.evict()
+	}
+	if data == nil {
+		data = make([]byte, c.blockSize)
+	}
+
+	n := 0
+	for _, b := range src {
+		n += copy(data[n:], b)
+	}
+
+	e := &entry{key: key, data: data}
+	if _, ok := s.ghost[key]; ok {
+		delete(s.ghost, key)
+		s.main.push(e)
+	} else {
+		s.small.push(e)
+	}
+
+	s.entries[key] = e
+}
+
+// Returns statistics summed over all shards.
+func (c *Cache) Stats() Stats {
+	var st Stats
+	if c == nil {
+		return st
+	}
+
+	for i := range c.shards {
+		s := &c.shards[i]
+		s.mutex.Lock()
+		st.Blocks += int64(len(s.entries))
+		st.Capacity += int64(s.capacity)
+		st.Hits += s.hits
+		st.Misses += s.misses
+		st.Evictions += s.evictions
+		s.mutex.Unlock()
+	}
+
+	return st
+}
+
+// Evicts one block and returns its memory. Has to be called with the shard
+// lock held and with at least one block in the shard.
+func (s *shard) evict() []byte {
+	for {
+		if s.small.len() > s.smallCapacity || s.main.len() == 0 {
+			if data := s.evictSmall(); data != nil {
+				return data
+			}
+		} else {
+			if data := s.evictMain(); data != nil {
+				return data
+			}
+		}
+	}
+}
+
+// Takes the oldest block of the small queue. Blocks accessed again are moved
+// to the main queue, others are evicted and their keys remembered in the
+// ghost queue. Returns memory of the evicted block or nil when the block was
+// moved.
+func (s *shard) evictSmall() []byte {
+	e := s.small.pop()
+	if e.freq > 1 {
+		e.freq = 0
+		s.main.push(e)
+		return nil
+	}
+
+	s.rememberGhost(e.key)
+
+	return s.drop(e)
+}
+
+// Takes the oldest block of the main queue. Blocks accessed since the last
+// pass get another round with decremented counter, others are evicted. Returns
+// memory of the evicted block or nil when the block got another round.
+func (s *shard) evictMain() []byte {
+	e := s.main.pop()
+	if e.freq > 0 {
+		e.freq--
+		s.main.push(e)
+		return nil
+	}
+
+	return s.drop(e)
+}
+
+// Removes the entry from the shard and returns its memory.
+func (s *shard) drop(e *entry) []byte {
+	delete(s.entries, e.key)
+	s.evictions++
+
+	return e.data
+}
+
+// Remembers key in the ghost queue, which is as long as the main queue
+// capacity, but at least one key.
+func (s *shard) rememberGhost(key Key) {
+	if n := s.ghostQueue.len(); n > 0 && n >= s.capacity-s.smallCapacity {
+		delete(s.ghost, s.ghostQueue.pop())
+	}
+
+	s.ghost[key] = struct{}{}
+	s.ghostQueue.push(key)
+}
+
+// FIFO queue of entries implemented as a growing ring buffer.
+type queue struct {
+	items []*entry
+	head  int
+	size  int
+}
+
+func (q *queue) len() int {
+	return q.size
+}
+
+func (q *queue) push(e *entry) {
+	if q.size == len(q.items) {
+		items := make([]*entry, 2*len(q.items)+1)
+		for i := 0; i < q.size; i++ {
+			items[i] = q.items[(q.head+i)%len(q.items)]
+		}
+		q.items = items
+		q.head = 0
+	}
+
+	q.items[(q.head+q.size)%len(q.items)] = e
+	q.size++
+}
+
+func (q *queue) pop() *entry {
+	e := q.items[q.head]
+	q.items[q.head] = nil
+	q.head = (q.head + 1) % len(q.items)
+	q.size--
+
+	return e
+}
+
+// FIFO queue of keys implemented as a growing ring buffer.
+type keyQueue struct {
+	items []Key
+	head  int
+	size  int
+}
+
+func (q *keyQueue) len() int {
+	return q.size
+}
+
+func (q *keyQueue) push(k Key) {
+	if q.size == len(q.items) {
+		items := make([]Key, 2*len(q.items)+1)
+		for i := 0; i < q.size; i++ {
+			items[i] = q.items[(q.head+i)%len(q.items)]
+		}
+		q.items = items
+		q.head = 0
+	}
+
+	q.items[(q.head+q.size)%len(q.items)] = k
+	q.size++
+}
+
+func (q *keyQueue) pop() Key {
+	k := q.items[q.head]
+	q.head = (q.head + 1) % len(q.items)
+	q.size--
+
+	return k
+}
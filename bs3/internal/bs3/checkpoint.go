@@ -0,0 +1,357 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package bs3
+
+import (
+	"encoding/binary"
+	"errors"
+	"hash/crc32"
+	"time"
+
+	"github.com/rs/zerolog/log"
+
+	"github.com/asch/bs3/internal/bs3/objproxy"
+	"github.com/asch/bs3/internal/config"
+)
+
+// Checkpoints are taken in the background while the volume is used. The full
+// checkpoint is the serialized extent map, the delta checkpoint contains only
+// the parts of the map changed since the previous checkpoint. Parts of the
+// checkpoint, i.e. the full checkpoint followed by deltas, are stored under
+// keys below checkpointKey and the manifest under checkpointKey references
+// them. The manifest is uploaded after the parts, so it always references a
+// complete chain and the previous chain stays valid until it is replaced.
+//
+// Checkpoints are fuzzy, writes are applied to the map while it is serialized.
+// All objects with keys below the settled key read before the serialization
+// are in the checkpoint, objects above it may be there too. The restore
+// replays objects from the settled key and the sequential numbers stored in
+// the checkpoint keep the newer writes. Sequential numbers of the kernel
+// start from zero after the restart, hence they are zeroed in the map once the
+// replay finishes and a full checkpoint replaces the one with old numbers
+// unless the volume was shut down cleanly.
+//
+// The manifest is little-endian.
+//
+//	0   manifestMagic, version byte, zero padding
+//	16  settled key, objects from it on are replayed
+//	24  flags, see manifestClean
+//	32  number of parts n
+//	40  n keys of the parts, the full checkpoint first
+//	    crc32c of all the bytes before
+const (
+	// Key representing the object where the manifest of the checkpoint is
+	// stored. Checkpoints without the manifest, i.e. stored before
+	// incremental checkpoints, are stored under it directly.
+	checkpointKey = -1
+
+	manifestMagic      = "\x00bs3mfst"
+	manifestVersion    = 1
+	manifestHeaderSize = 40
+
+	// Flag of the checkpoint taken at the shutdown after all writes were
+	// applied and sequential numbers were zeroed.
+	manifestClean = 1 << 0
+
+	// How often the background checkpointer checks whether the checkpoint
+	// is due.
+	checkpointPoll = time.Second
+)
+
+var (
+	castagnoli = crc32.MakeTable(crc32.Castagnoli)
+
+	errCorruptedManifest = errors.New("bs3: corrupted checkpoint manifest")
+)
+
+// Content of the manifest.
+type manifest struct {
+	// Objects with lower keys are in the checkpoint.
+	settled int64
+
+	// Combination of manifest* flags.
+	flags int64
+
+	// Keys of the full checkpoint followed by keys of the deltas.
+	parts []int64
+}
+
+// Returns the serialized manifest.
+func (m manifest) encode() []byte {
+	buf := make([]byte, manifestHeaderSize, manifestHeaderSize+8*len(m.parts)+4)
+	copy(buf, manifestMagic)
+	buf[len(manifestMagic)] = manifestVersion
+	binary.LittleEndian.PutUint64(buf[16:], uint64(m.settled))
+	binary.LittleEndian.PutUint64(buf[24:], uint64(m.flags))
+	binary.LittleEndian.PutUint64(buf[32:], uint64(len(m.parts)))
+
+	var b [8]byte
+	for _, k := range m.parts {
+		binary.LittleEndian.PutUint64(b[:], uint64(k))
+		buf = append(buf, b[:]...)
+	}
+
+	binary.LittleEndian.PutUint32(b[:], crc32.Checksum(buf, castagnoli))
+
+	return append(buf, b[:4]...)
+}
+
+// Returns the manifest serialized in buf. The second value is false when buf
+// is not a manifest, but the checkpoint stored before incremental checkpoints.
+func decodeManifest(buf []byte) (manifest, bool, error) {
+	if len(buf) < len(manifestMagic) || string(buf[:len(manifestMagic)]) != manifestMagic {
+		return manifest{}, false, nil
+	}
+
+	if len(buf) < manifestHeaderSize || buf[len(manifestMagic)] != manifestVersion {
+		return manifest{}, true, errCorruptedManifest
+	}
+
+	n := binary.LittleEndian.Uint64(buf[32:])
+	if n == 0 || n > uint64(len(buf)/8) || uint64(len(buf)) != manifestHeaderSize+8*n+4 {
+		return manifest{}, true, errCorruptedManifest
+	}
+
+	end := len(buf) - 4
+	if crc32.Checksum(buf[:end], castagnoli) != binary.LittleEndian.Uint32(buf[end:]) {
+		return manifest{}, true, errCorruptedManifest
+	}
+
+	m := manifest{
+		settled: int64(binary.LittleEndian.Uint64(buf[16:])),
+		flags:   int64(binary.LittleEndian.Uint64(buf[24:])),
+		parts:   make([]int64, n),
+	}
+	for i := range m.parts {
+		m.parts[i] = int64(binary.LittleEndian.Uint64(buf[manifestHeaderSize+8*i:]))
+	}
+
+	return m, true, nil
+}
+
+// Returns the highest key below checkpointKey which is not in any of the
+// chains. Keys of the parts are reused, so there are never more than two
+// chains on the backend, plus parts of checkpoints failed since the last
+// stored manifest.
+func partKey(chains ...[]int64) int64 {
+	for key := int64(checkpointKey - 1); ; key-- {
+		used := false
+		for _, c := range chains {
+			for _, k := range c {
+				used = used || k == key
+			}
+		}
+
+		if !used {
+			return key
+		}
+	}
+}
+
+// Returns the whole object with key.
+func (b *Bs3) downloadObject(key int64) ([]byte, error) {
+	size, err := b.objectStoreProxy.Instance.GetObjectSize(key)
+	if err != nil {
+		return nil, err
+	}
+
+	buf := make([]byte, size)
+	err = b.objectStoreProxy.Download(key, buf, 0, objproxy.ClassCheckpoint)
+
+	return buf, err
+}
+
+// Restores the map from the checkpoint saved on the backend and updates the
+// current object key accordingly. If it exists. Returns whether the map has
+// sequential numbers of the previous run, which were not zeroed by a clean
+// shutdown.
+func (b *Bs3) restoreFromCheckpoint() bool {
+	buf, err := b.downloadObject(checkpointKey)
+	if err != nil {
+		return false
+	}
+
+	log.Info().Msg("->Checkpoint found. Checkpoint recovery started.")
+
+	m, ok, err := decodeManifest(buf)
+	if err != nil {
+		// All objects are replayed instead.
+		log.Info().Err(err).Msg("->Checkpoint skipped.")
+		return false
+	}
+
+	if !ok {
+		newKey, err := b.extentMapProxy.DeserializeAndReturnNextKey(buf)
+		if err != nil {
+			log.Info().Err(err).Msg("->Checkpoint skipped.")
+			return false
+		}
+		b.keys.Replace(newKey)
+
+		log.Info().Msgf("->Checkpoint recovery process finished. Last object from checkpoint is %d.", newKey)
+
+		return true
+	}
+
+	parts := make([][]byte, len(m.parts))
+	for i, k := range m.parts {
+		if parts[i], err = b.downloadObject(k); err != nil {
+			log.Info().Err(err).Msg("->Checkpoint skipped.")
+			return false
+		}
+	}
+
+	if _, err := b.extentMapProxy.DeserializeAndReturnNextKey(parts[0], parts[1:]...); err != nil {
+		log.Info().Err(err).Msg("->Checkpoint skipped.")
+		return false
+	}
+	b.keys.Replace(m.settled)
+
+	c := &b.checkpointData
+	c.parts = m.parts
+	c.settled = m.settled
+	c.last = time.Now()
+
+	log.Info().Msgf("->Checkpoint recovery process finished. %d deltas applied, objects from %d are replayed.", len(m.parts)-1, m.settled)
+
+	return m.flags&manifestClean == 0
+}
+
+// Restores map from saved checkpoint and then continuous in restoration from
+// individual objects. E.g. when crash happens, the latest checkpoint is read.
+// However there can already be uploaded new set of objects fulfilling prefix
+// consistency.
+func (b *Bs3) restore() {
+	log.Info().Msgf("Checking for old volume %s.", b.name)
+
+	stale := b.restoreFromCheckpoint()
+	keyBefore := b.keys.Current()
+	b.restoreFromObjects()
+	b.objectStoreProxy.Instance.DeleteKeyAndSuccessors(b.keys.Current())
+
+	// New writes of the kernel have lower sequential numbers than the
+	// writes of the previous run. The checkpoint with the old numbers
+	// would hide them during the next restore, hence it is replaced before
+	// any new write is applied.
+	b.extentMapProxy.ResetSeqNos()
+	if stale || keyBefore != b.keys.Current() {
+		for {
+			err := b.checkpoint(true, false)
+			if err == nil {
+				break
+			}
+			log.Error().Err(err).Msg("Checkpoint after recovery failed.")
+			time.Sleep(tombstoneRetryDelay)
+		}
+	}
+
+	if b.keys.Current() == 0 {
+		log.Info().Msgf("No volume found. %s is used for new volume.", b.name)
+	} else {
+		log.Info().Msgf("Volume %s found. The last object is %d.", b.name, b.keys.Current())
+	}
+}
+
+// Serializes extent map and uploads it to the backend. The full checkpoint
+// starts a new chain, otherwise only changes since the previous checkpoint are
+// uploaded as a delta appended to the chain. The checkpoint is full anyway when
+// there is no chain, the previous checkpoint failed or the chain has MaxDeltas
+// deltas already. Clean marks the checkpoint taken at the shutdown, see
+// manifestClean. Returns error when the checkpoint was not stored, the previous
+// one stays valid then.
+func (b *Bs3) checkpoint(full, clean bool) error {
+	c := &b.checkpointData
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+
+	full = full || c.failed || len(c.parts) == 0 || len(c.parts) > config.Cfg.Checkpoint.MaxDeltas
+	log.Info().Bool("full", full).Msg("Checkpointing started.")
+
+	// Objects pinned so far are already applied to the map, hence the
+	// checkpoint contains their discards.
+	b.gcData.pinlock.Lock()
+	pinned := b.gcData.pinned
+	b.gcData.pinned = make(map[int64]struct{})
+	b.gcData.pinlock.Unlock()
+
+	// Objects below the settled key are applied to the map, hence they are
+	// in the checkpoint.
+	settled := b.keys.Settled()
+
+	log.Info().Msg("->Serialization of extent map started.")
+	var dump []byte
+	var parts []int64
+	if full {
+		dump = b.extentMapProxy.Serialize()
+	} else {
+		dump = b.extentMapProxy.SerializeDelta()
+		parts = append(parts, c.parts...)
+	}
+	parts = append(parts, partKey(c.parts, c.unsure, parts))
+	log.Info().Msg("->Serialization of extent map finished.")
+
+	log.Info().Msg("->Upload of extent map started.")
+	err := b.objectStoreProxy.Upload(parts[len(parts)-1], dump, objproxy.ClassCheckpoint)
+	if err == nil {
+		m := manifest{settled: settled, parts: parts}
+		if clean {
+			m.flags |= manifestClean
+		}
+		err = b.objectStoreProxy.Upload(checkpointKey, m.encode(), objproxy.ClassCheckpoint)
+	}
+	log.Info().Msg("->Upload of extent map finished.")
+
+	if err != nil {
+		log.Info().Err(err).Send()
+
+		// Discards are not in any checkpoint, keep them pinned.
+		b.gcData.pinlock.Lock()
+		for k := range pinned {
+			b.gcData.pinned[k] = struct{}{}
+		}
+		b.gcData.pinlock.Unlock()
+
+		// Changes since the previous checkpoint were forgotten by the
+		// map.
+		c.failed = true
+		c.unsure = append(c.unsure, parts...)
+
+		return err
+	}
+
+	c.parts = parts
+	c.failed = false
+	c.unsure = nil
+	c.settled = settled
+	c.last = time.Now()
+
+	log.Info().Msgf("Checkpointing finished. Objects from %d are replayed.", settled)
+
+	return nil
+}
+
+// Takes checkpoints in the background, so the restore after a crash replays
+// at most about MaxReplay objects. The checkpoint is taken also when Interval
+// elapsed since the previous one and new objects were applied. It runs until
+// the volume is closed.
+func (b *Bs3) checkpointer() {
+	interval := time.Duration(config.Cfg.Checkpoint.Interval) * time.Second
+
+	for {
+		select {
+		case <-time.After(checkpointPoll):
+		case <-b.stop:
+			return
+		}
+
+		c := &b.checkpointData
+		c.mutex.Lock()
+		backlog := b.keys.Settled() - c.settled
+		due := backlog >= config.Cfg.Checkpoint.MaxReplay || (backlog > 0 && time.Since(c.last) >= interval)
+		c.mutex.Unlock()
+
+		if due {
+			b.checkpoint(false, false)
+		}
+	}
+}
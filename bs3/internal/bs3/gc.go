@@ -10,8 +10,8 @@ import (
 	"syscall"
 	"time"
 
-	"github.com/asch/bs3/internal/bs3/key"
 	"github.com/asch/bs3/internal/bs3/mapproxy"
+	"github.com/asch/bs3/internal/bs3/objproxy"
 	"github.com/asch/bs3/internal/config"
 
 	"github.com/rs/zerolog/log"
@@ -75,20 +75,14 @@ func (b *Bs3) getCompleteWriteList(keys map[int64]struct{}, stepSize int64) []ma
 	return completeWriteList
 }
 
-// Removes currently downloaded objects from the list of dead objects.
-func (b *Bs3) filterDownloadingObjects(deadObjects map[int64]struct{}) {
-	b.gcData.reflock.Lock()
-	defer b.gcData.reflock.Unlock()
-
-	for k, v := range b.gcData.refcounter {
-		if v == 0 {
-			delete(b.gcData.refcounter, k)
-		} else {
-			_, ok := deadObjects[k]
-			if ok {
-				delete(deadObjects, k)
-			}
-		}
+// Removes pinned objects from the list of dead objects. They stay dead in the
+// map and are collected in some later round after they are unpinned.
+func (b *Bs3) filterPinnedObjects(deadObjects map[int64]struct{}) {
+	b.gcData.pinlock.Lock()
+	defer b.gcData.pinlock.Unlock()
+
+	for k := range b.gcData.pinned {
+		delete(deadObjects, k)
 	}
 }
 
@@ -99,29 +93,40 @@ func (b *Bs3) gcThreshold(stepSize int64, threshHold float64) {
 	liveObjects := b.extentMapProxy.ObjectsUtilization()
 	keysToCollect := b.filterKeysToCollect(liveObjects, threshHold)
 	completeWritelist := b.getCompleteWriteList(keysToCollect, stepSize)
-	objects, extents := b.composeObjects(completeWritelist)
+	objects, extents, err := b.composeObjects(completeWritelist)
+	if err != nil {
+		// Live data stay in the old objects, the next run tries again.
+		log.Info().Err(err).Msg("Threshold GC skipped.")
+		return
+	}
 
 	for i := range objects {
-		key := key.Next()
+		key := b.keys.Next()
 
-		err := b.objectStoreProxy.Upload(key, objects[i], false)
+		err := b.objectStoreProxy.Upload(key, objects[i], objproxy.ClassGC)
 		if err != nil {
 			log.Info().Err(err).Send()
+			b.storeTombstone(key)
+			b.keys.Done(key)
+			continue
 		}
 
 		b.extentMapProxy.Update(extents[i], int64(b.metadata_size/config.Cfg.BlockSize), key)
+		b.keys.Done(key)
 	}
 }
 
 // Removes unneeded dead objects from the map and upload empty object instead.
 // The object cannot be deleted on the backend, because the sequence number
 // would be missing in the recovery process where we need continuous range of
-// keys.
+// keys. Dead objects are not in the map, but readers which looked them up
+// before they died may still download them, so we wait for such readers.
 func (b *Bs3) removeNonReferencedDeadObjects() {
 	deadObjects := b.extentMapProxy.DeadObjects()
-	b.filterDownloadingObjects(deadObjects)
+	b.filterPinnedObjects(deadObjects)
+	b.gcData.readers.synchronize()
 	for k := range deadObjects {
-		err := b.objectStoreProxy.Upload(k, []byte{}, false)
+		err := b.objectStoreProxy.Upload(k, []byte{}, objproxy.ClassGC)
 		if err != nil {
 			log.Info().Err(err).Send()
 		}
@@ -143,10 +148,15 @@ func (b *Bs3) registerSigUSR1Handler() {
 	}()
 }
 
-// Dead GC infinite loop. Highly efficient hence running regularly.
+// Dead GC loop running until the volume is closed. Highly efficient hence
+// running regularly.
 func (b *Bs3) gcDead() {
 	for {
-		time.Sleep(time.Duration(config.Cfg.GC.Wait) * time.Second)
+		select {
+		case <-time.After(time.Duration(config.Cfg.GC.Wait) * time.Second):
+		case <-b.stop:
+			return
+		}
 
 		log.Trace().Msg("Dead GC started.")
 		b.removeNonReferencedDeadObjects()
@@ -171,9 +181,12 @@ func writeHeader(metadataFrontier int, g mapproxy.ExtentWithObjectPart, object [
 
 // Traverse the list of all extents which are going to be copied into new fresh
 // object(s). It downloads necessary parts and constructs new objects for the
-// complete list. All objects are then uploaded and map updated.
-func (b *Bs3) composeObjects(writeList []mapproxy.ExtentWithObjectPart) ([][]byte, [][]mapproxy.Extent) {
+// complete list. All objects are then uploaded and map updated. Returns error
+// of the first failed download, the objects are incomplete then.
+func (b *Bs3) composeObjects(writeList []mapproxy.ExtentWithObjectPart) ([][]byte, [][]mapproxy.Extent, error) {
 	var wg sync.WaitGroup
+	var errOnce sync.Once
+	var firstErr error
 
 	metadataFrontier := 0
 	dataFrontier := b.metadata_size
@@ -203,9 +216,9 @@ func (b *Bs3) composeObjects(writeList []mapproxy.ExtentWithObjectPart) ([][]byt
 		wg.Add(1)
 		go func(g mapproxy.ExtentWithObjectPart) {
 			defer wg.Done()
-			err := b.objectStoreProxy.Download(g.ObjectPart.Key, data, g.Extent.Sector*int64(config.Cfg.BlockSize), true)
+			err := b.objectStoreProxy.Download(g.ObjectPart.Key, data, g.Extent.Sector*int64(config.Cfg.BlockSize), objproxy.ClassGC)
 			if err != nil {
-				log.Info().Err(err).Send()
+				errOnce.Do(func() { firstErr = err })
 			}
 		}(g)
 
@@ -227,5 +240,5 @@ func (b *Bs3) composeObjects(writeList []mapproxy.ExtentWithObjectPart) ([][]byt
 
 	wg.Wait()
 
-	return objects, extents
+	return objects, extents, firstErr
 }
@@ -7,38 +7,79 @@ import (
 	"sync"
 )
 
-var (
+// Object key counter. Every volume has its own counter, since every volume
+// has its own continuous space of keys. The zero value is a counter starting
+// from key 0.
+//
+// Besides assigning keys it tracks which objects are done, i.e. applied to
+// the extent map or replaced by a tombstone. Objects are done out of order,
+// since their uploads run in parallel.
+type Counter struct {
 	key   int64
 	mutex sync.Mutex
-)
+
+	// The lowest key which is not done and keys above it which are done.
+	settled int64
+	done    map[int64]struct{}
+}
 
 // Returns value of currently unassigned key. It is forbidden to use this key
 // for creating a new object withou calling Next() function. I.e. this key can
 // be used for the next object.
-func Current() int64 {
-	mutex.Lock()
-	defer mutex.Unlock()
+func (c *Counter) Current() int64 {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
 
-	return key
+	return c.key
 }
 
 // Returns value of currently unassigned key and increments, hence the key
 // variable contains unassigned key again.. I.e. this key can be used for the
 // next object.
-func Next() int64 {
-	mutex.Lock()
-	defer mutex.Unlock()
+func (c *Counter) Next() int64 {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
 
-	tmp := key
-	key++
+	tmp := c.key
+	c.key++
 
 	return tmp
 }
 
-// Replaces the value of the next unassigned key.
-func Replace(newKey int64) {
-	mutex.Lock()
-	defer mutex.Unlock()
+// Replaces the value of the next unassigned key. All keys below are done.
+func (c *Counter) Replace(newKey int64) {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+
+	c.key = newKey
+	c.settled = newKey
+	c.done = nil
+}
+
+// Marks the object with key returned by Next() as done.
+func (c *Counter) Done(key int64) {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+
+	if c.done == nil {
+		c.done = make(map[int64]struct{})
+	}
+	c.done[key] = struct{}{}
+
+	for {
+		if _, ok := c.done[c.settled]; !ok {
+			break
+		}
+		delete(c.done, c.settled)
+		c.settled++
+	}
+}
+
+// Returns the lowest key which is not done. All objects with lower keys are
+// done.
+func (c *Counter) Settled() int64 {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
 
-	key = newKey
+	return c.settled
 }
@@ -0,0 +1,197 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package mapproxy
+
+import (
+	"encoding/binary"
+	"errors"
+	"hash/crc32"
+	"sync"
+	"sync/atomic"
+)
+
+// Binary checkpoint of the sharded map. All numbers are little-endian.
+//
+//	0   checkpointMagic, version byte, kind byte, zero padding
+//	16  length of the device in sectors
+//	24  stripe in sectors
+//	32  number of sections n
+//	40  n times offset, size and crc32c of the section, padding
+//	    crc32c of all the bytes before
+//	    sections, every one aligned to sectionAlign
+//
+// Section i is the checkpoint of the ExtentMapper of the shard i. Sections are
+// aligned, so the mappers can use arrays of numbers in them in place, and they
+// have their own checksums, so they are encoded and verified in parallel.
+//
+// The delta checkpoint has one more section with the objects dead at the time
+// of the checkpoint, see SerializeDelta().
+const (
+	binaryCheckpointVersion = 2
+
+	fullCheckpoint  = 0
+	deltaCheckpoint = 1
+
+	headerSize     = 40
+	tableEntrySize = 24
+	sectionAlign   = 8
+)
+
+var (
+	castagnoli = crc32.MakeTable(crc32.Castagnoli)
+
+	ErrCorruptedCheckpoint = errors.New("mapproxy: corrupted checkpoint")
+)
+
+// Returns the binary checkpoint of the given kind of the map with sections.
+func encodeSections(kind byte, length, stripe int64, sections [][]byte) []byte {
+	tableEnd := headerSize + len(sections)*tableEntrySize
+	offsets := make([]int, len(sections))
+	size := align(tableEnd + 4)
+	for i, s := range sections {
+		offsets[i] = size
+		size = align(size + len(s))
+	}
+
+	buf := make([]byte, size)
+	copy(buf, checkpointMagic)
+	buf[len(checkpointMagic)] = binaryCheckpointVersion
+	buf[len(checkpointMagic)+1] = kind
+	binary.LittleEndian.PutUint64(buf[16:], uint64(length))
+	binary.LittleEndian.PutUint64(buf[24:], uint64(stripe))
+	binary.LittleEndian.PutUint64(buf[32:], uint64(len(sections)))
+
+	parallel(len(sections), func(i int) {
+		copy(buf[offsets[i]:], sections[i])
+
+		e := buf[headerSize+i*tableEntrySize:]
+		binary.LittleEndian.PutUint64(e, uint64(offsets[i]))
+		binary.LittleEndian.PutUint64(e[8:], uint64(len(sections[i])))
+		binary.LittleEndian.PutUint32(e[16:], crc32.Checksum(sections[i], castagnoli))
+	})
+
+	binary.LittleEndian.PutUint32(buf[tableEnd:], crc32.Checksum(buf[:tableEnd], castagnoli))
+
+	return buf
+}
+
+// Returns checkpoint with sections of the binary checkpoint in buf. Sections
+// are slices of buf, nothing is copied. All checksums are verified.
+func decodeSections(buf []byte) (checkpoint, error) {
+	if len(buf) < headerSize {
+		return checkpoint{}, ErrCorruptedCheckpoint
+	}
+
+	n := binary.LittleEndian.Uint64(buf[32:])
+	if n > uint64(len(buf)/tableEntrySize) {
+		return checkpoint{}, ErrCorruptedCheckpoint
+	}
+
+	tableEnd := headerSize + int(n)*tableEntrySize
+	if len(buf) < tableEnd+4 || crc32.Checksum(buf[:tableEnd], castagnoli) != binary.LittleEndian.Uint32(buf[tableEnd:]) {
+		return checkpoint{}, ErrCorruptedCheckpoint
+	}
+
+	c := checkpoint{
+		Length: int64(binary.LittleEndian.Uint64(buf[16:])),
+		Stripe: int64(binary.LittleEndian.Uint64(buf[24:])),
+		Shards: make([][]byte, n),
+		Delta:  buf[len(checkpointMagic)+1] == deltaCheckpoint,
+	}
+	if c.Length < 0 || c.Stripe <= 0 {
+		return checkpoint{}, ErrCorruptedCheckpoint
+	}
+
+	for i := range c.Shards {
+		e := buf[headerSize+i*tableEntrySize:]
+		offset := binary.LittleEndian.Uint64(e)
+		size := binary.LittleEndian.Uint64(e[8:])
+		if offset > uint64(len(buf)) || size > uint64(len(buf))-offset {
+			return checkpoint{}, ErrCorruptedCheckpoint
+		}
+		c.Shards[i] = buf[offset : offset+size : offset+size]
+	}
+
+	var corrupted int32
+	parallel(len(c.Shards), func(i int) {
+		sum := binary.LittleEndian.Uint32(buf[headerSize+i*tableEntrySize+16:])
+		if crc32.Checksum(c.Shards[i], castagnoli) != sum {
+			atomic.StoreInt32(&corrupted, 1)
+		}
+	})
+	if corrupted != 0 {
+		return checkpoint{}, ErrCorruptedCheckpoint
+	}
+
+	return c, nil
+}
+
+// Returns n rounded up to sectionAlign.
+func align(n int) int {
+	return (n + sectionAlign - 1) / sectionAlign * sectionAlign
+}
+
+// Calls fn for 0 to n-1, every call on its own go routine, and waits for all
+// of them.
+func parallel(n int, fn func(i int)) {
+	var wg sync.WaitGroup
+	wg.Add(n)
+	for i := 0; i < n; i++ {
+		go func(i int) {
+			fn(i)
+			wg.Done()
+		}(i)
+	}
+	wg.Wait()
+}
+
+// Appends object utilizations and dead objects to the binary checkpoint of an
+// ExtentMapper. It is the number of utilizations followed by the key and the
+// utilization of every object, then the number of dead objects followed by
+// their keys.
+func AppendObjects(buf []byte, utilizations map[int64]int64, dead map[int64]struct{}) []byte {
+	buf = AppendUint64(buf, uint64(len(utilizations)))
+	for k, v := range utilizations {
+		buf = AppendUint64(buf, uint64(k))
+		buf = AppendUint64(buf, uint64(v))
+	}
+
+	buf = AppendUint64(buf, uint64(len(dead)))
+	for k := range dead {
+		buf = AppendUint64(buf, uint64(k))
+	}
+
+	return buf
+}
+
+// Returns object utilizations and dead objects stored by AppendObjects() at
+// the beginning of buf.
+func ReadObjects(buf []byte) (map[int64]int64, map[int64]struct{}) {
+	n := binary.LittleEndian.Uint64(buf)
+	buf = buf[8:]
+
+	utilizations := make(map[int64]int64, n)
+	for ; n > 0; n-- {
+		utilizations[int64(binary.LittleEndian.Uint64(buf))] = int64(binary.LittleEndian.Uint64(buf[8:]))
+		buf = buf[16:]
+	}
+
+	n = binary.LittleEndian.Uint64(buf)
+	buf = buf[8:]
+
+	dead := make(map[int64]struct{}, n)
+	for ; n > 0; n-- {
+		dead[int64(binary.LittleEndian.Uint64(buf))] = struct{}{}
+		buf = buf[8:]
+	}
+
+	return utilizations, dead
+}
+
+// Appends v in little-endian to buf.
+func AppendUint64(buf []byte, v uint64) []byte {
+	var b [8]byte
+	binary.LittleEndian.PutUint64(b[:], v)
+
+	return append(buf, b[:]...)
+}
@@ -0,0 +1,340 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package extenttree
+
+const (
+	// Maximal number of extents in a leaf and of children of an inner node.
+	// All nodes except the root have at least half of it.
+	nodeSize    = 64
+	minNodeSize = nodeSize / 2
+)
+
+// Logical extent mapped to the continuous part of one object. Extents with
+// notMappedKey record just the sequential number and the flag of the write
+// which unmapped the sectors.
+type extent struct {
+	sector       int64
+	length       int64
+	key          int64
+	objectSector int64
+	seqNo        int64
+	flag         int64
+}
+
+// Returns the first sector after the extent.
+func (e *extent) end() int64 {
+	return e.sector + e.length
+}
+
+// Returns part of the extent between sectors from and to.
+func (e extent) slice(from, to int64) extent {
+	if e.key != notMappedKey {
+		e.objectSector += from - e.sector
+	}
+	e.sector = from
+	e.length = to - from
+
+	return e
+}
+
+// Returns whether extent b directly follows extent a and both can be stored as
+// one extent.
+func mergeable(a, b *extent) bool {
+	return a.end() == b.sector &&
+		a.key == b.key &&
+		a.seqNo == b.seqNo &&
+		a.flag == b.flag &&
+		(a.key == notMappedKey || a.objectSector+a.length == b.objectSector)
+}
+
+// B+tree of non-overlapping extents ordered by their first sector. Leaves are
+// linked, so ranges are traversed without going through the inner nodes.
+type btree struct {
+	root *node
+}
+
+// Node of the btree. Leaves have extents, inner nodes have children and the
+// lowest sector of every child in firsts. All sectors of the child i are
+// smaller than firsts[i+1].
+type node struct {
+	extents  []extent
+	children []*node
+	firsts   []int64
+
+	// Next leaf.
+	next *node
+}
+
+// Position of an extent in the btree.
+type iterator struct {
+	n *node
+	i int
+}
+
+func newBtree() btree {
+	return btree{root: &node{}}
+}
+
+func (n *node) leaf() bool {
+	return n.children == nil
+}
+
+// Returns number of extents or children of the node.
+func (n *node) size() int {
+	if n.leaf() {
+		return len(n.extents)
+	}
+
+	return len(n.children)
+}
+
+// Returns the lowest sector in the subtree.
+func (n *node) first() int64 {
+	if n.leaf() {
+		return n.extents[0].sector
+	}
+
+	return n.firsts[0]
+}
+
+// Returns index of the child which can contain sector.
+func (n *node) child(sector int64) int {
+	lo, hi := 1, len(n.firsts)
+	for lo < hi {
+		mid := int(uint(lo+hi) >> 1)
+		if n.firsts[mid] <= sector {
+			lo = mid + 1
+		} else {
+			hi = mid
+		}
+	}
+
+	return lo - 1
+}
+
+// Returns index of the first extent of the leaf starting after sector.
+func (n *node) after(sector int64) int {
+	lo, hi := 0, len(n.extents)
+	for lo < hi {
+		mid := int(uint(lo+hi) >> 1)
+		if n.extents[mid].sector <= sector {
+			lo = mid + 1
+		} else {
+			hi = mid
+		}
+	}
+
+	return lo
+}
+
+// Returns iterator at the first extent ending after sector.
+func (t *btree) seek(sector int64) iterator {
+	n := t.root
+	for !n.leaf() {
+		n = n.children[n.child(sector)]
+	}
+
+	i := n.after(sector)
+	if i > 0 && n.extents[i-1].end() > sector {
+		i--
+	}
+
+	it := iterator{n, i}
+	it.skipEmpty()
+
+	return it
+}
+
+// Returns whether the iterator points to an extent.
+func (it *iterator) valid() bool {
+	return it.n != nil
+}
+
+// Returns the extent the iterator points to.
+func (it *iterator) extent() *extent {
+	return &it.n.extents[it.i]
+}
+
+// Moves the iterator to the next extent.
+func (it *iterator) advance() {
+	it.i++
+	it.skipEmpty()
+}
+
+// Moves the iterator past the end of the leaf to the next leaf.
+func (it *iterator) skipEmpty() {
+	if it.i >= len(it.n.extents) {
+		it.n = it.n.next
+		it.i = 0
+	}
+}
+
+// Inserts e, which must not overlap with any extent in the tree.
+func (t *btree) insert(e extent) {
+	if split := t.root.insert(e); split != nil {
+		t.root = &node{
+			children: []*node{t.root, split},
+			firsts:   []int64{t.root.first(), split.first()},
+		}
+	}
+}
+
+// Inserts e into the subtree. Returns the new right sibling when the node was
+// split.
+func (n *node) insert(e extent) *node {
+	if n.leaf() {
+		i := n.after(e.sector)
+		n.extents = append(n.extents, extent{})
+		copy(n.extents[i+1:], n.extents[i:])
+		n.extents[i] = e
+
+		if len(n.extents) <= nodeSize {
+			return nil
+		}
+
+		right := &node{
+			extents: append(make([]extent, 0, nodeSize+1), n.extents[minNodeSize:]...),
+			next:    n.next,
+		}
+		n.extents = n.extents[:minNodeSize]
+		n.next = right
+
+		return right
+	}
+
+	i := n.child(e.sector)
+	if e.sector < n.firsts[i] {
+		n.firsts[i] = e.sector
+	}
+
+	split := n.children[i].insert(e)
+	if split == nil {
+		return nil
+	}
+
+	n.children = append(n.children, nil)
+	copy(n.children[i+2:], n.children[i+1:])
+	n.children[i+1] = split
+
+	n.firsts = append(n.firsts, 0)
+	copy(n.firsts[i+2:], n.firsts[i+1:])
+	n.firsts[i+1] = split.first()
+
+	if len(n.children) <= nodeSize {
+		return nil
+	}
+
+	right := &node{
+		children: append(make([]*node, 0, nodeSize+1), n.children[minNodeSize:]...),
+		firsts:   append(make([]int64, 0, nodeSize+1), n.firsts[minNodeSize:]...),
+	}
+	for j := minNodeSize; j < len(n.children); j++ {
+		n.children[j] = nil
+	}
+	n.children = n.children[:minNodeSize]
+	n.firsts = n.firsts[:minNodeSize]
+
+	return right
+}
+
+// Deletes extent starting at sector, which must be in the tree.
+func (t *btree) delete(sector int64) {
+	t.root.delete(sector)
+
+	for !t.root.leaf() && len(t.root.children) == 1 {
+		t.root = t.root.children[0]
+	}
+}
+
+// Deletes extent starting at sector from the subtree. Children which get
+// under minNodeSize borrow from or merge with their sibling.
+func (n *node) delete(sector int64) {
+	if n.leaf() {
+		i := n.after(sector) - 1
+		copy(n.extents[i:], n.extents[i+1:])
+		n.extents = n.extents[:len(n.extents)-1]
+
+		return
+	}
+
+	i := n.child(sector)
+	c := n.children[i]
+	c.delete(sector)
+
+	if c.size() >= minNodeSize {
+		n.firsts[i] = c.first()
+		return
+	}
+
+	n.rebalance(i)
+}
+
+// Fixes the child i which has less than minNodeSize entries.
+func (n *node) rebalance(i int) {
+	l := i - 1
+	if i == 0 {
+		l = 0
+	}
+	left, right := n.children[l], n.children[l+1]
+
+	if left.size()+right.size() <= nodeSize {
+		left.extents = append(left.extents, right.extents...)
+		left.children = append(left.children, right.children...)
+		left.firsts = append(left.firsts, right.firsts...)
+		left.next = right.next
+
+		copy(n.children[l+1:], n.children[l+2:])
+		n.children[len(n.children)-1] = nil
+		n.children = n.children[:len(n.children)-1]
+		copy(n.firsts[l+1:], n.firsts[l+2:])
+		n.firsts = n.firsts[:len(n.firsts)-1]
+		n.firsts[l] = left.first()
+
+		return
+	}
+
+	if left.size() < right.size() {
+		if left.leaf() {
+			left.extents = append(left.extents, right.extents[0])
+			right.extents = append(right.extents[:0], right.extents[1:]...)
+		} else {
+			left.children = append(left.children, right.children[0])
+			left.firsts = append(left.firsts, right.firsts[0])
+			right.children[0] = nil
+			right.children = append(right.children[:0], right.children[1:]...)
+			right.firsts = append(right.firsts[:0], right.firsts[1:]...)
+		}
+	} else {
+		if left.leaf() {
+			last := left.extents[len(left.extents)-1]
+			left.extents = left.extents[:len(left.extents)-1]
+			right.extents = append([]extent{last}, right.extents...)
+		} else {
+			last := len(left.children) - 1
+			right.children = append([]*node{left.children[last]}, right.children...)
+			right.firsts = append([]int64{left.firsts[last]}, right.firsts...)
+			left.children[last] = nil
+			left.children = left.children[:last]
+			left.firsts = left.firsts[:last]
+		}
+	}
+
+	n.firsts[l] = left.first()
+	n.firsts[l+1] = right.first()
+}
+
+func min64(a, b int64) int64 {
+	if a < b {
+		return a
+	}
+
+	return b
+}
+
+func max64(a, b int64) int64 {
+	if a > b {
+		return a
+	}
+
+	return b
+}
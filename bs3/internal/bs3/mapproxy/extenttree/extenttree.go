@@ -0,0 +1,605 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+// Extenttree package provides implementation of ExtentMapper interface for
+// sparse and very large devices. It stores just the written extents in the
+// B+tree. More details are in the ExtentTree struct description.
+package extenttree
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/gob"
+
+	"github.com/asch/bs3/internal/bs3/mapproxy"
+	"github.com/asch/bs3/internal/bs3/mapproxy/sectormap"
+)
+
+const (
+	// How many objects parts is the typical result for one extent lookup.
+	// This is just for initial allocation of the returned array. In the
+	// worst case reallocation happens.
+	typicalObjectPartsPerLookup = 64
+
+	notMappedKey = mapproxy.NotMappedKey
+
+	// Checkpoints start with the magic followed by the version. Anything
+	// else is a checkpoint of the sectormap. Version 1 is the gob of
+	// checkpoint.
+	checkpointMagic      = "\x00bs3tree"
+	gobCheckpointVersion = 1
+
+	// Binary checkpoint. After the magic, the version and the padding it
+	// has the number of extents, then all extents, see appendExtent(), and
+	// the objects, see mapproxy.AppendObjects(). All numbers are
+	// little-endian.
+	binaryCheckpointVersion = 3
+	binaryHeaderSize        = 24
+
+	// Size of the extent in the binary checkpoint.
+	extentSize = 48
+
+	// Binary checkpoint version 2 had the number of extents at the offset
+	// of the version, so it overwrote it. It is recognized by its size,
+	// see binaryObjects(). Extents are sector, length, key and sector
+	// in the object of extents with data.
+	unversionedHeaderSize = 16
+	unversionedExtentSize = 32
+)
+
+// Implementation of the ExtentMapper interface hence serving as an extent map.
+// Unlike the SectorMap, which has an entry for every sector of the device, the
+// map is B+tree of extents. Neighbouring sectors written by one write to one
+// object are one extent, so the memory is proportional to the number of
+// written extents and not to the size of the device. Sectors never written are
+// not in the tree at all. This makes thin provisioned devices of tens of
+// terabytes possible. The price is O(log n) lookup instead of direct indexing.
+//
+// Every update splits the extents it overlaps and the parts with older
+// sequential numbers are replaced. Neighbouring extents which follow each other
+// in the same object and were written by the same write are merged back, so
+// the tree does not fragment by rewrites of the same data, e.g. by GC.
+type ExtentTree struct {
+	tree btree
+
+	// Number of sectors of the device.
+	length int64
+
+	// Extents overlapped by the update and the extents replacing them.
+	// Kept for reuse by the next update.
+	old    []extent
+	pieces []extent
+
+	ObjUtilizations map[int64]int64
+	DeadObjs        map[int64]struct{}
+}
+
+// Serialized extent which has data in the object in the gob checkpoint.
+type checkpointExtent struct {
+	Sector       int64
+	Length       int64
+	Key          int64
+	ObjectSector int64
+}
+
+// Serialized form of the map, which follows the header in the gob checkpoint,
+// and the result of the conversion from the SectorMap. It has no sequential
+// numbers and unmapped sectors read the same as never written, hence only
+// extents with data are stored.
+type checkpoint struct {
+	Extents         []checkpointExtent
+	ObjUtilizations map[int64]int64
+	DeadObjs        map[int64]struct{}
+}
+
+// Returns new instance of the extent tree for the device with length sectors.
+// The map should not be used directly because it does not support concurrent
+// access.
+func New(length int64) *ExtentTree {
+	return &ExtentTree{
+		tree:            newBtree(),
+		length:          length,
+		ObjUtilizations: make(map[int64]int64),
+		DeadObjs:        make(map[int64]struct{}),
+	}
+}
+
+// Updates sectors in the map with new values from extents. startOfDataSectors
+// is the first sector with data in the object and key is the key of the
+// object. Repeated updates with the same key add to its utilization.
+func (m *ExtentTree) Update(extents []mapproxy.Extent, startOfDataSectors, key int64) {
+	for _, e := range extents {
+		if !e.HasData() {
+			m.write(extent{e.Sector, e.Length, notMappedKey, 0, e.SeqNo, e.Flag}, key)
+			continue
+		}
+		m.write(extent{e.Sector, e.Length, key, startOfDataSectors, e.SeqNo, e.Flag}, key)
+		startOfDataSectors += e.Length
+	}
+
+	// Because of GC we can add object which will never update the map
+	// because all write records are old
+	if m.ObjUtilizations[key] == 0 {
+		delete(m.ObjUtilizations, key)
+		m.DeadObjs[key] = struct{}{}
+	}
+}
+
+// Writes e to the sectors where the map has no newer write. Equality wins
+// because of GC. Key is the key of the object with the extent. The extents
+// overlapped by e and its direct neighbours are replaced by the pieces, which
+// are merged where possible.
+func (m *ExtentTree) write(e extent, key int64) {
+	m.old = m.old[:0]
+	for it := m.tree.seek(e.sector - 1); it.valid() && it.extent().sector <= e.end(); it.advance() {
+		m.old = append(m.old, *it.extent())
+	}
+
+	m.pieces = m.pieces[:0]
+	pos := e.sector
+	for _, o := range m.old {
+		if o.sector < e.sector {
+			m.pieces = append(m.pieces, o.slice(o.sector, min64(o.end(), e.sector)))
+		}
+
+		if gapEnd := min64(o.sector, e.end()); gapEnd > pos {
+			m.replace(e.slice(pos, gapEnd), notMappedKey, key)
+			pos = gapEnd
+		}
+
+		if from, to := max64(o.sector, e.sector), min64(o.end(), e.end()); from < to {
+			if o.seqNo > e.seqNo {
+				m.pieces = append(m.pieces, o.slice(from, to))
+			} else {
+				m.replace(e.slice(from, to), o.key, key)
+			}
+			pos = to
+		}
+
+		if o.end() > e.end() {
+			m.pieces = append(m.pieces, o.slice(max64(o.sector, e.end()), o.end()))
+		}
+	}
+
+	if pos < e.end() {
+		m.replace(e.slice(pos, e.end()), notMappedKey, key)
+	}
+
+	for i := range m.old {
+		m.tree.delete(m.old[i].sector)
+	}
+
+	last := 0
+	for i := 1; i < len(m.pieces); i++ {
+		if mergeable(&m.pieces[last], &m.pieces[i]) {
+			m.pieces[last].length += m.pieces[i].length
+			continue
+		}
+		m.tree.insert(m.pieces[last])
+		last = i
+	}
+	m.tree.insert(m.pieces[last])
+}
+
+// Adds piece e replacing sectors of object old to the pieces and updates the
+// information about objects utilizations. Key is the key of the object with
+// the extent.
+func (m *ExtentTree) replace(e extent, old, key int64) {
+	m.pieces = append(m.pieces, e)
+
+	// Increment cannot be done at once because GC can
+	// introduce object with writes with lower seqNo
+	if e.key != notMappedKey {
+		m.ObjUtilizations[e.key] += e.length
+	}
+
+	if old == notMappedKey {
+		return
+	}
+
+	// Sectors unmapped by the object which wrote them earlier are
+	// accounted by Update() when the whole object is processed.
+	m.ObjUtilizations[old] -= e.length
+	if m.ObjUtilizations[old] == 0 && (e.key != notMappedKey || old != key) {
+		delete(m.ObjUtilizations, old)
+		m.DeadObjs[old] = struct{}{}
+	}
+}
+
+// Returns all ObjectParts from which extent starting at sector with length
+// length can be reconstructed. Sectors not mapped are one part with
+// notMappedKey.
+func (m *ExtentTree) Lookup(sector, length int64) []mapproxy.ObjectPart {
+	parts := make([]mapproxy.ObjectPart, 0, typicalObjectPartsPerLookup)
+	end := sector + length
+
+	add := func(p mapproxy.ObjectPart) {
+		if n := len(parts); n > 0 && parts[n-1].Key == p.Key &&
+			(p.Key == notMappedKey || parts[n-1].Sector+parts[n-1].Length == p.Sector) {
+
+			parts[n-1].Length += p.Length
+			return
+		}
+		parts = append(parts, p)
+	}
+
+	pos := sector
+	for it := m.tree.seek(sector); it.valid() && it.extent().sector < end; it.advance() {
+		o := it.extent()
+		from, to := max64(o.sector, sector), min64(o.end(), end)
+		if from > pos {
+			add(mapproxy.ObjectPart{Sector: 0, Length: from - pos, Key: notMappedKey})
+		}
+
+		p := o.slice(from, to)
+		add(mapproxy.ObjectPart{Sector: p.objectSector, Length: p.length, Key: p.key})
+		pos = to
+	}
+
+	if pos < end {
+		add(mapproxy.ObjectPart{Sector: 0, Length: end - pos, Key: notMappedKey})
+	}
+
+	return parts
+}
+
+// Returns all extents and objectparts starting from sector with length length
+// that are stored in any of keys in keys.
+func (m *ExtentTree) FindExtentsWithKeys(sector, length int64, keys map[int64]struct{}) []mapproxy.ExtentWithObjectPart {
+	ci := make([]mapproxy.ExtentWithObjectPart, 0, typicalObjectPartsPerLookup)
+	end := min64(sector+length, m.length)
+
+	for it := m.tree.seek(sector); it.valid() && it.extent().sector < end; it.advance() {
+		o := it.extent()
+		if _, ok := keys[o.key]; !ok {
+			continue
+		}
+
+		p := o.slice(max64(o.sector, sector), min64(o.end(), end))
+		ci = append(ci, mapproxy.ExtentWithObjectPart{
+			Extent: mapproxy.Extent{
+				Sector: p.objectSector,
+				Length: p.length,
+				SeqNo:  p.seqNo,
+				Flag:   p.flag,
+			},
+			ObjectPart: mapproxy.ObjectPart{
+				Sector: p.sector,
+				Length: 0,
+				Key:    p.key,
+			},
+		})
+	}
+
+	return ci
+}
+
+// Returns copy of deadObjects. These are objects with no valid data which can
+// be deleted.
+func (m *ExtentTree) DeadObjects() map[int64]struct{} {
+	deadObjects := make(map[int64]struct{})
+
+	for k := range m.DeadObjs {
+		deadObjects[k] = struct{}{}
+	}
+
+	return deadObjects
+}
+
+// Returns the highest key from the map.
+func (m *ExtentTree) GetMaxKey() int64 {
+	var maxKey int64
+	for k := range m.ObjUtilizations {
+		if k > maxKey {
+			maxKey = k
+		}
+	}
+
+	return maxKey
+}
+
+// Return copy of the structure representing the object utilization.
+// Utilization is number of non-dead sectors.
+func (m *ExtentTree) ObjectsUtilization() map[int64]int64 {
+	objectUtilization := make(map[int64]int64)
+
+	for k, v := range m.ObjUtilizations {
+		objectUtilization[k] = v
+	}
+
+	return objectUtilization
+}
+
+// Returns serialized version of the map. It is the binary checkpoint, see
+// binaryCheckpointVersion.
+func (m *ExtentTree) Serialize() []byte {
+	buf := make([]byte, binaryHeaderSize)
+	copy(buf, checkpointMagic)
+	buf[len(checkpointMagic)] = binaryCheckpointVersion
+
+	var n uint64
+	for it := m.tree.seek(0); it.valid(); it.advance() {
+		buf = appendExtent(buf, it.extent())
+		n++
+	}
+	binary.LittleEndian.PutUint64(buf[16:], n)
+
+	return mapproxy.AppendObjects(buf, m.ObjUtilizations, m.DeadObjs)
+}
+
+// Appends all fields of e to buf.
+func appendExtent(buf []byte, e *extent) []byte {
+	buf = mapproxy.AppendUint64(buf, uint64(e.sector))
+	buf = mapproxy.AppendUint64(buf, uint64(e.length))
+	buf = mapproxy.AppendUint64(buf, uint64(e.key))
+	buf = mapproxy.AppendUint64(buf, uint64(e.objectSector))
+	buf = mapproxy.AppendUint64(buf, uint64(e.seqNo))
+
+	return mapproxy.AppendUint64(buf, uint64(e.flag))
+}
+
+// Returns extent stored by appendExtent() at the beginning of b.
+func readExtent(b []byte) extent {
+	return extent{
+		sector:       int64(binary.LittleEndian.Uint64(b)),
+		length:       int64(binary.LittleEndian.Uint64(b[8:])),
+		key:          int64(binary.LittleEndian.Uint64(b[16:])),
+		objectSector: int64(binary.LittleEndian.Uint64(b[24:])),
+		seqNo:        int64(binary.LittleEndian.Uint64(b[32:])),
+		flag:         int64(binary.LittleEndian.Uint64(b[40:])),
+	}
+}
+
+// Deserialized map from buf which was previously serialized by Serialize(). It
+// restores map and structures representing object utilization and dead
+// objects. Sequential numbers are restored too, gob checkpoints restore zeros,
+// see ResetSeqNos(). Extents beyond the end of the device are dropped, so the
+// device size can change.
+//
+// Checkpoints of the SectorMap are converted, so existing devices can switch
+// to the extent tree. The conversion needs the memory of the SectorMap once.
+func (m *ExtentTree) DeserializeAndReturnNextKey(buf []byte) int64 {
+	var extents []extent
+	var utilizations map[int64]int64
+	var dead map[int64]struct{}
+
+	if objects, ok := binaryObjects(buf, binaryHeaderSize, 16, extentSize); ok && buf[len(checkpointMagic)] == binaryCheckpointVersion {
+		extents = make([]extent, binary.LittleEndian.Uint64(buf[16:]))
+		for i := range extents {
+			extents[i] = readExtent(buf[binaryHeaderSize+i*extentSize:])
+		}
+		utilizations, dead = mapproxy.ReadObjects(objects)
+	} else if e, u, d, ok := decodeUnversioned(buf); ok {
+		extents, utilizations, dead = e, u, d
+	} else {
+		var c checkpoint
+		if bytes.HasPrefix(buf, []byte(checkpointMagic)) {
+			gob.NewDecoder(bytes.NewReader(buf[len(checkpointMagic)+1:])).Decode(&c)
+		} else {
+			c = fromSectorMap(buf, m.length)
+		}
+
+		extents = make([]extent, len(c.Extents))
+		for i, ce := range c.Extents {
+			extents[i] = extent{ce.Sector, ce.Length, ce.Key, ce.ObjectSector, 0, 0}
+		}
+		utilizations, dead = c.ObjUtilizations, c.DeadObjs
+	}
+
+	m.tree = newBtree()
+	if utilizations != nil {
+		m.ObjUtilizations = utilizations
+	}
+	if dead != nil {
+		m.DeadObjs = dead
+	}
+
+	var maxKey int64 = notMappedKey
+	var last *extent
+	for i := range extents {
+		e := &extents[i]
+		if e.sector >= m.length {
+			break
+		}
+
+		e.length = min64(e.length, m.length-e.sector)
+		if e.key > maxKey {
+			maxKey = e.key
+		}
+
+		if last != nil && mergeable(last, e) {
+			last.length += e.length
+			continue
+		}
+		if last != nil {
+			m.tree.insert(*last)
+		}
+		last = e
+	}
+	if last != nil {
+		m.tree.insert(*last)
+	}
+
+	return maxKey + 1
+}
+
+// Returns checkpoint of the device with length sectors converted from the
+// checkpoint of the SectorMap in buf.
+func fromSectorMap(buf []byte, length int64) checkpoint {
+	s := sectormap.New(length)
+	s.DeserializeAndReturnNextKey(buf)
+
+	c := checkpoint{
+		ObjUtilizations: s.ObjectsUtilization(),
+		DeadObjs:        s.DeadObjects(),
+	}
+
+	if length == 0 {
+		return c
+	}
+
+	sector := int64(0)
+	for _, p := range s.Lookup(0, length) {
+		if p.Key != notMappedKey {
+			c.Extents = append(c.Extents, checkpointExtent{sector, p.Length, p.Key, p.Sector})
+		}
+		sector += p.Length
+	}
+
+	return c
+}
+
+// Returns the objects part of the binary checkpoint in buf with the header of
+// headerSize bytes, the number of extents at offset count and extents of
+// extentSize bytes. The second value is false when buf is not such checkpoint,
+// i.e. its size does not match the numbers of extents and objects stored in it
+// exactly. Gob checkpoints never match.
+func binaryObjects(buf []byte, headerSize, count, extentSize int) ([]byte, bool) {
+	if !bytes.HasPrefix(buf, []byte(checkpointMagic)) || len(buf) < headerSize+16 {
+		return nil, false
+	}
+
+	n := binary.LittleEndian.Uint64(buf[count:])
+	if n > uint64(len(buf)-headerSize-16)/uint64(extentSize) {
+		return nil, false
+	}
+	objects := buf[headerSize+int(n)*extentSize:]
+
+	u := binary.LittleEndian.Uint64(objects)
+	if u > uint64(len(objects)-16)/16 {
+		return nil, false
+	}
+	d := binary.LittleEndian.Uint64(objects[8+16*u:])
+
+	return objects, uint64(len(objects)) == 16+16*u+8*d
+}
+
+// Returns extents and objects of the binary checkpoint version 2, which has
+// the number of extents over the version byte. The last value is false when
+// buf is not such checkpoint.
+func decodeUnversioned(buf []byte) ([]extent, map[int64]int64, map[int64]struct{}, bool) {
+	objects, ok := binaryObjects(buf, unversionedHeaderSize, 8, unversionedExtentSize)
+	if !ok {
+		return nil, nil, nil, false
+	}
+
+	extents := make([]extent, binary.LittleEndian.Uint64(buf[8:]))
+	for i := range extents {
+		b := buf[unversionedHeaderSize+i*unversionedExtentSize:]
+		extents[i] = extent{
+			sector:       int64(binary.LittleEndian.Uint64(b)),
+			length:       int64(binary.LittleEndian.Uint64(b[8:])),
+			key:          int64(binary.LittleEndian.Uint64(b[16:])),
+			objectSector: int64(binary.LittleEndian.Uint64(b[24:])),
+		}
+	}
+	utilizations, dead := mapproxy.ReadObjects(objects)
+
+	return extents, utilizations, dead, true
+}
+
+// Returns serialized extents within ranges with their sequential numbers. It
+// is the number of ranges followed by the sector, the length, the number of
+// extents and the extents of every range. Extents are clipped to the range.
+func (m *ExtentTree) SerializeRanges(ranges []mapproxy.Extent) []byte {
+	buf := mapproxy.AppendUint64(nil, uint64(len(ranges)))
+
+	for _, r := range ranges {
+		from, to := r.Sector, r.Sector+r.Length
+		buf = mapproxy.AppendUint64(buf, uint64(from))
+		buf = mapproxy.AppendUint64(buf, uint64(r.Length))
+
+		count := len(buf)
+		buf = mapproxy.AppendUint64(buf, 0)
+
+		var n uint64
+		for it := m.tree.seek(from); it.valid() && it.extent().sector < to; it.advance() {
+			e := it.extent().slice(max64(from, it.extent().sector), min64(to, it.extent().end()))
+			buf = appendExtent(buf, &e)
+			n++
+		}
+		binary.LittleEndian.PutUint64(buf[count:], n)
+	}
+
+	return buf
+}
+
+// Replaces sectors by the ranges serialized by SerializeRanges(). Object
+// utilizations are not updated, see RecomputeUtilization().
+func (m *ExtentTree) DeserializeRanges(buf []byte) {
+	ranges := binary.LittleEndian.Uint64(buf)
+	buf = buf[8:]
+
+	for ; ranges > 0; ranges-- {
+		from := int64(binary.LittleEndian.Uint64(buf))
+		to := min64(from+int64(binary.LittleEndian.Uint64(buf[8:])), m.length)
+		n := binary.LittleEndian.Uint64(buf[16:])
+		buf = buf[24:]
+
+		if from < to {
+			m.clear(from, to)
+		}
+
+		for ; n > 0; n-- {
+			e := readExtent(buf)
+			buf = buf[extentSize:]
+
+			if e.sector < to {
+				m.tree.insert(e.slice(e.sector, min64(e.end(), to)))
+			}
+		}
+	}
+}
+
+// Removes all extents between sectors from and to. Extents crossing the
+// boundaries are cut.
+func (m *ExtentTree) clear(from, to int64) {
+	m.old = m.old[:0]
+	for it := m.tree.seek(from); it.valid() && it.extent().sector < to; it.advance() {
+		m.old = append(m.old, *it.extent())
+	}
+
+	for i := range m.old {
+		o := &m.old[i]
+		m.tree.delete(o.sector)
+		if o.sector < from {
+			m.tree.insert(o.slice(o.sector, from))
+		}
+		if o.end() > to {
+			m.tree.insert(o.slice(to, o.end()))
+		}
+	}
+}
+
+// Recomputes object utilizations from the extents. No object is dead.
+func (m *ExtentTree) RecomputeUtilization() {
+	m.ObjUtilizations = make(map[int64]int64)
+	m.DeadObjs = make(map[int64]struct{})
+
+	for it := m.tree.seek(0); it.valid(); it.advance() {
+		if e := it.extent(); e.key != notMappedKey {
+			m.ObjUtilizations[e.key] += e.length
+		}
+	}
+}
+
+// Zeroes all sequential numbers, so any later write overwrites the sectors.
+// It is needed after the restart, because BUSE most probably starts from 0.
+func (m *ExtentTree) ResetSeqNos() {
+	for it := m.tree.seek(0); it.valid(); it.advance() {
+		it.extent().seqNo = 0
+	}
+}
+
+// Deletes objects with keys from object utilizations.
+func (m *ExtentTree) DeleteFromUtilization(keys map[int64]struct{}) {
+	for k := range keys {
+		delete(m.ObjUtilizations, k)
+	}
+}
+
+// Deletes objects with keys from deadObjects from dead objects.
+func (m *ExtentTree) DeleteFromDeadObjects(deadObjects map[int64]struct{}) {
+	for k := range deadObjects {
+		delete(m.DeadObjs, k)
+	}
+}
@@ -1,23 +1,58 @@
 // Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
 
 // Mapproxy package is a proxy for structs with ExtentMapper interface. It
-// serializes and prioritizes requests coming to the ExtentMapper and also
-// improves cache locality since all operations are done by the same go
-// routine.
+// divides the address space into shards, each with its own ExtentMapper and
+// lock, so requests coming to the extent map are served in parallel on the go
+// routines of the callers.
 package mapproxy
 
 import (
-	"time"
+	"bytes"
+	"encoding/gob"
+	"math/bits"
+	"sync"
 )
 
 const (
 	NotMappedKey = -1
+
+	// Flag of the extent which carries no data and unmaps its sectors.
+	FlagDiscard = 1 << 0
+
+	// Flag of the extent which carries no data and makes its sectors read
+	// as zeros. It differs from FlagDiscard just by the guarantee given to
+	// the user, the extent map handles both the same.
+	FlagZero = 1 << 1
+
+	// Number of independent shards of the map. Every shard has its own
+	// lock.
+	shards = 64
+
+	// Checkpoints of the sharded map start with the magic followed by the
+	// version. Anything else is a checkpoint of a single ExtentMapper
+	// covering the whole device. Version 1 is the gob of checkpoint, newer
+	// versions are binary, see binaryCheckpointVersion.
+	checkpointMagic      = "\x00bs3shards"
+	gobCheckpointVersion = 1
+
+	// Changes since the last checkpoint are tracked in pages of
+	// 1<<dirtyPageBits sectors of the shard.
+	dirtyPageBits = 6
 )
 
 // Provides mapping from logical extents presented in the system to the
 // potentionaly mutliple extents in the backend storage. Furthermore it has to
 // be provide multiple operations related to garbage collection and map
-// restoration.
+// restoration. Update can be called multiple times with the same key, the
+// utilization of the object is accumulated.
+//
+// Checkpoints keep the sequential numbers, so objects applied to the map
+// after the checkpoint was taken can be replayed on top of it. ResetSeqNos
+// zeroes them once the replay is finished. SerializeRanges stores just the
+// given ranges of sectors and DeserializeRanges replaces them, which is used
+// for incremental checkpoints. Utilizations are not maintained by
+// DeserializeRanges, RecomputeUtilization computes them from the map
+// afterwards. Ranges are given by Sector and Length of the extents.
 type ExtentMapper interface {
 	Update(extents []Extent, startOfDataSectors, key int64)
 	Lookup(sector, length int64) []ObjectPart
@@ -29,24 +64,89 @@ type ExtentMapper interface {
 	DeadObjects() map[int64]struct{}
 	DeserializeAndReturnNextKey(buf []byte) int64
 	Serialize() []byte
+	SerializeRanges(ranges []Extent) []byte
+	DeserializeRanges(buf []byte)
+	RecomputeUtilization()
+	ResetSeqNos()
 }
 
-// Proxy to the ExtentMapper. It serializes and prioritizes requests comming to
-// the extent map and also improves cache locality since the map is always
-// traversed by the same thread.
+// Implemented by ExtentMappers whose Lookup can run concurrently with all
+// other methods, e.g. because updates publish modified copies of the map. The
+// proxy calls it without any lock.
+type LockFreeLookuper interface {
+	LockFreeLookup(sector, length int64) []ObjectPart
+}
+
+// Proxy to the ExtentMapper. The address space is divided into stripes and
+// stripe i belongs to the shard i modulo shards. Every shard is an independent
+// ExtentMapper with its own reader-writer lock, so lookups run in parallel on
+// the go routine of the caller and updates of different shards do not wait for
+// each other. Requests crossing stripes are split and the results are joined.
+// Lookups of mappers implementing LockFreeLookuper do not take the lock at all.
+//
+// An object can have data in multiple shards. Its utilization is the sum over
+// all shards and it is dead only when no shard utilizes it. Operations on the
+// whole map, like searching for dead objects or serialization, need consistent
+// view of all shards, hence they exclude updates by the global lock.
+//
+// Every shard remembers pages changed since the last checkpoint, so the delta
+// checkpoint serializes only them, see SerializeDelta().
 type ExtentMapProxy struct {
-	Instance ExtentMapper
+	shards [shards]shard
+
+	// Number of sectors of the device and of one stripe.
+	length int64
+	stripe int64
+
+	// Returns empty ExtentMapper of length sectors for one shard.
+	newMapper func(length int64) ExtentMapper
+
+	// Held for reading by updates and for writing by operations on the
+	// whole map.
+	global sync.RWMutex
+}
+
+// One shard of the map.
+type shard struct {
+	lock   sync.RWMutex
+	mapper ExtentMapper
+
+	// The mapper when it implements LockFreeLookuper, nil otherwise.
+	lockFree LockFreeLookuper
+
+	// Bitmap of pages changed since the last checkpoint.
+	dirty []uint64
+
+	// Avoid false sharing of the neighbouring shards.
+	_ [64]byte
+}
+
+// Update of one shard. Extents are in sectors of the shard and their data are
+// stored continuously in the object from start.
+type shardUpdate struct {
+	extents []Extent
+	start   int64
+
+	// Sector in the object following the data of extents.
+	next int64
+}
 
-	// Timeout after which low priority request can be handled.
-	idleTimeout time.Duration
+// Serialized form of the map. Every shard is serialized by its ExtentMapper.
+type checkpoint struct {
+	Length int64
+	Stripe int64
+	Shards [][]byte
 
-	// Channels for internal communication specific to one type of request.
-	updateChan       chan updateRequest
-	lookupChan       chan lookupRequest
-	keyedExtentsChan chan keyedExtentsRequest
+	// Whether it is the delta checkpoint. Gob checkpoints are never deltas.
+	Delta bool
+}
 
-	// General low priority channel used for multiple types of requests.
-	lockChan chan lockRequest
+// Read only view of the whole map, which is either ExtentMapProxy or
+// ExtentMapper.
+type mapReader interface {
+	Lookup(sector, length int64) []ObjectPart
+	ObjectsUtilization() map[int64]int64
+	DeadObjects() map[int64]struct{}
 }
 
 // Mapping from the logical extent to the extent in the object.
@@ -66,10 +166,17 @@ type Extent struct {
 	// Sequential number of write which wrote this extent
 	SeqNo int64
 
-	// Reserved for future usage.
+	// Combination of Flag* values. Extents with any flag set have no data
+	// in the object.
 	Flag int64
 }
 
+// Returns whether the extent has data stored in the object. Extents with
+// FlagDiscard or FlagZero have no data and unmap their sectors.
+func (e Extent) HasData() bool {
+	return e.Flag&(FlagDiscard|FlagZero) == 0
+}
+
 // Object part is extent in the object.
 type ObjectPart struct {
 	// First sector of the extent.
@@ -82,173 +189,502 @@ type ObjectPart struct {
 	Key int64
 }
 
-// Returns proxy which can be directly used. It spawns one worker which handles
-// all serialized and prioritized requests.
-func New(instance ExtentMapper, idleTimeout time.Duration) ExtentMapProxy {
-	updateChan := make(chan updateRequest)
-	lookupChan := make(chan lookupRequest)
-	keyedExtentsChan := make(chan keyedExtentsRequest)
-	lockChan := make(chan lockRequest)
+// Returns proxy of the map of the device with length sectors divided into
+// stripes of stripe sectors. Every shard is created by newMapper with the
+// number of its sectors.
+func New(newMapper func(length int64) ExtentMapper, length, stripe int64) *ExtentMapProxy {
+	p := &ExtentMapProxy{
+		length:    length,
+		stripe:    stripe,
+		newMapper: newMapper,
+	}
 
-	m := ExtentMapProxy{
-		Instance:         instance,
-		idleTimeout:      idleTimeout,
-		updateChan:       updateChan,
-		lookupChan:       lookupChan,
-		keyedExtentsChan: keyedExtentsChan,
-		lockChan:         lockChan,
+	stripes := (length + stripe - 1) / stripe
+	for i := range p.shards {
+		s := &p.shards[i]
+		n := (stripes - int64(i) + shards - 1) / shards * stripe
+		s.mapper = newMapper(n)
+		s.lockFree, _ = s.mapper.(LockFreeLookuper)
+		pages := (n + 1<<dirtyPageBits - 1) >> dirtyPageBits
+		s.dirty = make([]uint64, (pages+63)/64)
 	}
 
-	go m.worker()
+	return p
+}
 
-	return m
+// Returns shard of sector and the sector within the shard.
+func (p *ExtentMapProxy) locate(sector int64) (int, int64) {
+	stripe := sector / p.stripe
+
+	return int(stripe % shards), stripe/shards*p.stripe + sector%p.stripe
+}
+
+// Returns sector of the device for sector within shard i.
+func (p *ExtentMapProxy) deviceSector(i int, sector int64) int64 {
+	return (sector/p.stripe*shards+int64(i))*p.stripe + sector%p.stripe
+}
+
+// Calls fn for every part of the extent starting at sector with length length
+// which lies in one stripe. Fn gets the shard, the sector within the shard and
+// the length of the part. Parts are passed in order.
+func (p *ExtentMapProxy) split(sector, length int64, fn func(i int, sector, length int64)) {
+	for length > 0 {
+		n := p.stripe - sector%p.stripe
+		if n > length {
+			n = length
+		}
+
+		i, s := p.locate(sector)
+		fn(i, s, n)
+
+		sector += n
+		length -= n
+	}
 }
 
 // Updates all extents specified in extents. startOfDataSectors is the first
 // sector in the object with real data and key is the key of the object.
 func (p *ExtentMapProxy) Update(extents []Extent, startOfDataSectors, key int64) {
-	done := make(chan struct{})
-	p.updateChan <- updateRequest{extents, startOfDataSectors, key, done}
-	<-done
+	p.global.RLock()
+	defer p.global.RUnlock()
+
+	p.update(extents, startOfDataSectors, key)
+}
+
+// Like Update but without the global lock.
+func (p *ExtentMapProxy) update(extents []Extent, startOfDataSectors, key int64) {
+	var updates [shards][]shardUpdate
+
+	touched := false
+	for _, e := range extents {
+		p.split(e.Sector, e.Length, func(i int, sector, length int64) {
+			u := updates[i]
+			if len(u) == 0 || (e.HasData() && u[len(u)-1].next != startOfDataSectors) {
+				u = append(u, shardUpdate{start: startOfDataSectors, next: startOfDataSectors})
+			}
+
+			last := &u[len(u)-1]
+			last.extents = append(last.extents, Extent{sector, length, e.SeqNo, e.Flag})
+			if e.HasData() {
+				last.next += length
+				startOfDataSectors += length
+			}
+
+			updates[i] = u
+			touched = true
+		})
+	}
+
+	// The object without any extent is dead. It has to be recorded by
+	// some shard.
+	if !touched {
+		updates[0] = []shardUpdate{{start: startOfDataSectors}}
+	}
+
+	for i := range updates {
+		if len(updates[i]) == 0 {
+			continue
+		}
+
+		s := &p.shards[i]
+		s.lock.Lock()
+		for _, u := range updates[i] {
+			s.mapper.Update(u.extents, u.start, key)
+			for _, e := range u.extents {
+				s.markDirty(e.Sector, e.Length)
+			}
+		}
+		s.lock.Unlock()
+	}
 }
 
 // Finds all pieces from which the logical extent starting from sector with
 // length length can be reconstructed.
 func (p *ExtentMapProxy) Lookup(sector, length int64) []ObjectPart {
-	reply := make(chan []ObjectPart)
-	p.lookupChan <- lookupRequest{sector, length, reply}
-	return <-reply
+	var parts []ObjectPart
+
+	p.split(sector, length, func(i int, sector, length int64) {
+		pieces := p.shards[i].lookup(sector, length)
+
+		if parts == nil {
+			parts = pieces
+			return
+		}
+
+		// Join the parts continuing across the stripe boundary.
+		last, first := &parts[len(parts)-1], pieces[0]
+		if last.Key == first.Key && (first.Key == NotMappedKey || last.Sector+last.Length == first.Sector) {
+			last.Length += first.Length
+			pieces = pieces[1:]
+		}
+		parts = append(parts, pieces...)
+	})
+
+	return parts
+}
+
+// Marks pages of the shard with sectors from sector to sector+length-1 as
+// changed.
+func (s *shard) markDirty(sector, length int64) {
+	last := (sector + length - 1) >> dirtyPageBits
+	for page := sector >> dirtyPageBits; page <= last && page>>6 < int64(len(s.dirty)); page++ {
+		s.dirty[page>>6] |= 1 << uint(page&63)
+	}
+}
+
+// Returns ranges of sectors of the shard changed since the last checkpoint.
+// Neighbouring pages are joined.
+func (s *shard) dirtyRanges() []Extent {
+	var ranges []Extent
+	for i, word := range s.dirty {
+		for ; word != 0; word &= word - 1 {
+			page := int64(i)*64 + int64(bits.TrailingZeros64(word))
+			sector := page << dirtyPageBits
+
+			if n := len(ranges); n > 0 && ranges[n-1].Sector+ranges[n-1].Length == sector {
+				ranges[n-1].Length += 1 << dirtyPageBits
+				continue
+			}
+			ranges = append(ranges, Extent{Sector: sector, Length: 1 << dirtyPageBits})
+		}
+	}
+
+	return ranges
+}
+
+// Forgets all changes of the shard.
+func (s *shard) clearDirty() {
+	for i := range s.dirty {
+		s.dirty[i] = 0
+	}
+}
+
+// Looks up the extent within the shard.
+func (s *shard) lookup(sector, length int64) []ObjectPart {
+	if s.lockFree != nil {
+		return s.lockFree.LockFreeLookup(sector, length)
+	}
+
+	s.lock.RLock()
+	defer s.lock.RUnlock()
+
+	return s.mapper.Lookup(sector, length)
+}
+
+// Like Lookup but for multiple logical extents at once. Only Sector and Length
+// of the extents are used. The returned pieces are in the same order as
+// extents.
+func (p *ExtentMapProxy) LookupBatch(extents []Extent) [][]ObjectPart {
+	pieces := make([][]ObjectPart, len(extents))
+	for i, e := range extents {
+		pieces[i] = p.Lookup(e.Sector, e.Length)
+	}
+
+	return pieces
 }
 
 // Finds all extents which are stored in any of the objects with keys in keys.
 // Sector and length is the range of interest.
 func (p *ExtentMapProxy) ExtentsInObjects(sector, length int64, keys map[int64]struct{}) []ExtentWithObjectPart {
-	reply := make(chan []ExtentWithObjectPart)
-	p.keyedExtentsChan <- keyedExtentsRequest{sector, length, keys, reply}
-	return <-reply
+	var extents []ExtentWithObjectPart
+
+	p.split(sector, length, func(i int, sector, length int64) {
+		s := &p.shards[i]
+		s.lock.RLock()
+		found := s.mapper.FindExtentsWithKeys(sector, length, keys)
+		s.lock.RUnlock()
+
+		for j := range found {
+			found[j].ObjectPart.Sector = p.deviceSector(i, found[j].ObjectPart.Sector)
+		}
+		extents = append(extents, found...)
+	})
+
+	return extents
 }
 
 // Returns all dead objects. I.e. objects without any live data.
 func (p *ExtentMapProxy) DeadObjects() map[int64]struct{} {
-	done := make(chan struct{})
-	p.lockChan <- lockRequest{done}
-	tmp := p.Instance.DeadObjects()
-	<-done
+	p.global.Lock()
+	defer p.global.Unlock()
 
-	return tmp
+	return p.deadObjects()
+}
+
+// Like DeadObjects but without the global lock. Shards record objects which
+// are dead in the shard, but they can still be utilized by other shards.
+func (p *ExtentMapProxy) deadObjects() map[int64]struct{} {
+	dead := make(map[int64]struct{})
+	for i := range p.shards {
+		for k := range p.shards[i].mapper.DeadObjects() {
+			dead[k] = struct{}{}
+		}
+	}
+
+	for k := range p.objectsUtilization() {
+		delete(dead, k)
+	}
+
+	return dead
 }
 
 // Returns all objects utilization. I.e. number of non-dead sectors in each
 // non-dead object.
 func (p *ExtentMapProxy) ObjectsUtilization() map[int64]int64 {
-	done := make(chan struct{})
-	p.lockChan <- lockRequest{done}
-	tmp := p.Instance.ObjectsUtilization()
-	<-done
+	p.global.Lock()
+	defer p.global.Unlock()
+
+	return p.objectsUtilization()
+}
 
-	return tmp
+// Like ObjectsUtilization but without the global lock.
+func (p *ExtentMapProxy) objectsUtilization() map[int64]int64 {
+	utilization := make(map[int64]int64)
+	for i := range p.shards {
+		for k, v := range p.shards[i].mapper.ObjectsUtilization() {
+			utilization[k] += v
+		}
+	}
+
+	return utilization
 }
 
 // Returns highest object key contained in the map.
 func (p *ExtentMapProxy) GetMaxKey() int64 {
-	done := make(chan struct{})
-	p.lockChan <- lockRequest{done}
-	tmp := p.Instance.GetMaxKey()
-	<-done
+	p.global.Lock()
+	defer p.global.Unlock()
 
-	return tmp
+	var maxKey int64
+	for i := range p.shards {
+		if k := p.shards[i].mapper.GetMaxKey(); k > maxKey {
+			maxKey = k
+		}
+	}
 
+	return maxKey
 }
 
 // Deletes all provided keys from object utilization list.
 func (p *ExtentMapProxy) DeleteFromUtilization(keys map[int64]struct{}) {
-	done := make(chan struct{})
-	p.lockChan <- lockRequest{done}
-	defer func() {
-		<-done
-	}()
-
-	p.Instance.DeleteFromUtilization(keys)
+	p.global.Lock()
+	defer p.global.Unlock()
+
+	for i := range p.shards {
+		s := &p.shards[i]
+		s.lock.Lock()
+		s.mapper.DeleteFromUtilization(keys)
+		s.lock.Unlock()
+	}
 }
 
 // Deletes all dead objects from dead objects list.
 func (p *ExtentMapProxy) DeleteDeadObjects(deadObjects map[int64]struct{}) {
-	done := make(chan struct{})
-	p.lockChan <- lockRequest{done}
-	defer func() {
-		<-done
-	}()
+	p.global.Lock()
+	defer p.global.Unlock()
+
+	for i := range p.shards {
+		s := &p.shards[i]
+		s.lock.Lock()
+		s.mapper.DeleteFromDeadObjects(deadObjects)
+		s.lock.Unlock()
+	}
+}
 
-	p.Instance.DeleteFromDeadObjects(deadObjects)
+// Returns serialized version of the map. It is the binary checkpoint with the
+// sections serialized by the ExtentMappers of the shards in parallel. Updates
+// wait until it is finished, so the checkpoint never contains just a part of
+// an object. Following delta checkpoints contain changes since this one.
+func (p *ExtentMapProxy) Serialize() []byte {
+	p.global.Lock()
+	defer p.global.Unlock()
+
+	sections := make([][]byte, shards)
+	parallel(shards, func(i int) {
+		s := &p.shards[i]
+		sections[i] = s.mapper.Serialize()
+		s.clearDirty()
+	})
+
+	return encodeSections(fullCheckpoint, p.length, p.stripe, sections)
 }
 
-type updateRequest struct {
-	extents            []Extent
-	startOfDataSectors int64
-	key                int64
-	done               chan struct{}
+// Returns the delta checkpoint with pages of the map changed since the last
+// checkpoint returned by Serialize() or SerializeDelta(). Every shard
+// serializes its changed pages with the sequential numbers and the last section
+// contains all dead objects. It can be restored only on top of the previous
+// checkpoints, see DeserializeAndReturnNextKey(). When it is lost, the next
+// checkpoint has to be full.
+func (p *ExtentMapProxy) SerializeDelta() []byte {
+	p.global.Lock()
+	defer p.global.Unlock()
+
+	sections := make([][]byte, shards+1)
+	parallel(shards, func(i int) {
+		s := &p.shards[i]
+		sections[i] = s.mapper.SerializeRanges(s.dirtyRanges())
+		s.clearDirty()
+	})
+	sections[shards] = AppendObjects(nil, nil, p.deadObjects())
+
+	return encodeSections(deltaCheckpoint, p.length, p.stripe, sections)
 }
 
-// Internal request structures just for wrapping the function calls into the
-// channel communication.
+// Zeroes sequential numbers of all extents, see ExtentMapper.
+func (p *ExtentMapProxy) ResetSeqNos() {
+	p.global.Lock()
+	defer p.global.Unlock()
 
-type lookupRequest struct {
-	sector int64
-	length int64
-	reply  chan []ObjectPart
+	for i := range p.shards {
+		s := &p.shards[i]
+		s.lock.Lock()
+		s.mapper.ResetSeqNos()
+		s.lock.Unlock()
+	}
 }
 
-type keyedExtentsRequest struct {
-	sector int64
-	length int64
-	keys   map[int64]struct{}
-	reply  chan<- []ExtentWithObjectPart
-}
+// Deserializes map from buf which was previously serialized by Serialize() and
+// returns the key following the highest key in the map. Deltas returned by
+// SerializeDelta() after buf are applied on top of it in order. The size of the
+// device can change. Checkpoints with different stripes, gob checkpoints and
+// checkpoints of a single ExtentMapper, i.e. before the map was sharded, are
+// converted. The map is not changed when any checkpoint is corrupted or the
+// deltas do not belong to buf. The ExtentMappers can use buf in place, so it
+// must not be modified afterwards.
+func (p *ExtentMapProxy) DeserializeAndReturnNextKey(buf []byte, deltas ...[]byte) (int64, error) {
+	p.global.Lock()
+	defer p.global.Unlock()
 
-type lockRequest struct {
-	done chan struct{}
-}
+	defer func() {
+		for i := range p.shards {
+			p.shards[i].clearDirty()
+		}
+	}()
 
-// Worker is doing prioritization and serialization of the requests. Updates
-// and lookups into the map have highest priority. All other request are low
-// priority.
-func (p *ExtentMapProxy) worker() {
-	for {
-		select {
-		case u := <-p.updateChan:
-			p.update(u)
+	if !bytes.HasPrefix(buf, []byte(checkpointMagic)) {
+		if len(deltas) > 0 {
+			return 0, ErrCorruptedCheckpoint
+		}
 
-		case l := <-p.lookupChan:
-			p.lookup(l)
+		old := p.newMapper(p.length)
+		nextKey := old.DeserializeAndReturnNextKey(buf)
+		p.convert(old, p.length)
 
-		//case <-time.NewTicker(m.idleTimeout).C:
-		default:
-			select {
-			case u := <-p.updateChan:
-				p.update(u)
+		return nextKey, nil
+	}
 
-			case l := <-p.lookupChan:
-				p.lookup(l)
+	var c checkpoint
+	if len(buf) > len(checkpointMagic) && buf[len(checkpointMagic)] == gobCheckpointVersion {
+		gob.NewDecoder(bytes.NewReader(buf[len(checkpointMagic)+1:])).Decode(&c)
+	} else {
+		var err error
+		if c, err = decodeSections(buf); err != nil {
+			return 0, err
+		}
+	}
+	if c.Delta {
+		return 0, ErrCorruptedCheckpoint
+	}
 
-			case e := <-p.keyedExtentsChan:
-				p.findExtensWithKeys(e)
+	ds := make([]checkpoint, len(deltas))
+	for i := range deltas {
+		var err error
+		if ds[i], err = decodeSections(deltas[i]); err != nil {
+			return 0, err
+		}
 
-			case l := <-p.lockChan:
-				l.done <- struct{}{}
-			}
+		d := ds[i]
+		if !d.Delta || d.Length != c.Length || d.Stripe != c.Stripe || len(d.Shards) != len(c.Shards)+1 {
+			return 0, ErrCorruptedCheckpoint
 		}
 	}
-}
 
-func (p *ExtentMapProxy) update(r updateRequest) {
-	p.Instance.Update(r.extents, r.startOfDataSectors, r.key)
-	r.done <- struct{}{}
+	if c.Stripe != p.stripe || len(c.Shards) != shards {
+		old := New(p.newMapper, c.Length, c.Stripe)
+		nextKey := old.deserializeShards(c, ds)
+
+		length := c.Length
+		if length > p.length {
+			length = p.length
+		}
+		p.convert(old, length)
+
+		return nextKey, nil
+	}
+
+	return p.deserializeShards(c, ds), nil
 }
 
-func (p *ExtentMapProxy) lookup(r lookupRequest) {
-	r.reply <- p.Instance.Lookup(r.sector, r.length)
+// Restores shards from c, which has the same stripe, and applies deltas in
+// parallel. Returns the key following the highest key in all shards.
+func (p *ExtentMapProxy) deserializeShards(c checkpoint, deltas []checkpoint) int64 {
+	nextKeys := make([]int64, shards)
+	parallel(shards, func(i int) {
+		s := &p.shards[i]
+		s.lock.Lock()
+		nextKeys[i] = s.mapper.DeserializeAndReturnNextKey(c.Shards[i])
+		if len(deltas) > 0 {
+			for _, d := range deltas {
+				s.mapper.DeserializeRanges(d.Shards[i])
+			}
+			s.mapper.RecomputeUtilization()
+			if k := s.mapper.GetMaxKey() + 1; k > nextKeys[i] {
+				nextKeys[i] = k
+			}
+		}
+		s.lock.Unlock()
+	})
+
+	var nextKey int64
+	for _, k := range nextKeys {
+		if k > nextKey {
+			nextKey = k
+		}
+	}
+
+	// Utilizations were computed from the map, objects dead at the time of
+	// the last delta are recorded again.
+	if len(deltas) > 0 {
+		_, dead := ReadObjects(deltas[len(deltas)-1].Shards[shards])
+		for k := range dead {
+			p.update(nil, 0, k)
+			if k >= nextKey {
+				nextKey = k + 1
+			}
+		}
+	}
+
+	return nextKey
 }
 
-func (p *ExtentMapProxy) findExtensWithKeys(r keyedExtentsRequest) {
-	r.reply <- p.Instance.FindExtentsWithKeys(r.sector, r.length, r.keys)
+// Fills the empty map with the first length sectors of old. Sequential numbers
+// are zero, see ExtentMapper.ResetSeqNos(). Utilizations are computed again
+// from the mapping and objects dead or utilized in old, but not anymore, are
+// dead.
+func (p *ExtentMapProxy) convert(old mapReader, length int64) {
+	for sector := int64(0); sector < length; sector += p.stripe {
+		n := p.stripe
+		if sector+n > length {
+			n = length - sector
+		}
+
+		s := sector
+		for _, op := range old.Lookup(sector, n) {
+			if op.Key != NotMappedKey {
+				p.update([]Extent{{Sector: s, Length: op.Length}}, op.Sector, op.Key)
+			}
+			s += op.Length
+		}
+	}
+
+	live := p.objectsUtilization()
+	dead := old.DeadObjects()
+	for k := range old.ObjectsUtilization() {
+		dead[k] = struct{}{}
+	}
+
+	for k := range dead {
+		if _, ok := live[k]; !ok {
+			p.update(nil, 0, k)
+		}
+	}
 }
@@ -7,7 +7,11 @@ package sectormap
 
 import (
 	"bytes"
+	"encoding/binary"
 	"encoding/gob"
+	"math"
+	"sync/atomic"
+	"unsafe"
 
 	"github.com/asch/bs3/internal/bs3/mapproxy"
 )
@@ -19,22 +23,59 @@ const (
 	typicalObjectPartsPerLookup = 64
 
 	notMappedKey = -1
+
+	// Layout of the packed sector entry. From the least significant bits it
+	// is the flag, the sector in the object and the key of the object.
+	flagBits   = 4
+	sectorBits = 20
+	keyBits    = 64 - sectorBits - flagBits
+
+	flagMask   = 1<<flagBits - 1
+	sectorMask = 1<<sectorBits - 1
+
+	// Key field of sectors which are not mapped.
+	unmappedKey = 1<<keyBits - 1
+
+	// Entry of the sector which is not mapped and has no flag.
+	unmappedEntry = uint64(unmappedKey) << (sectorBits + flagBits)
+
+	// Maximal number of sectors in one object addressable by the map. The
+	// highest sector is not used, so the next entry of the last sector of
+	// an object never overflows into the key.
+	MaxObjectSectors = 1<<sectorBits - 1
+
+	// Number of sectors in one segment of entries. Segments are the unit of
+	// copy-on-write, see SectorMap.
+	segmentBits = 6
+	segmentSize = 1 << segmentBits
+	segmentMask = segmentSize - 1
+
+	// Checkpoints start with the magic followed by the version. Legacy
+	// checkpoints are plain gobs of the array of SectorMetadata, which
+	// never start with a zero byte. Version 1 is the gob of checkpoint.
+	checkpointMagic      = "\x00bs3map"
+	gobCheckpointVersion = 1
+
+	// Binary checkpoint. After the magic and the version it has the number
+	// of entries, the key following the highest key in them and seqBase,
+	// then the entries, the relative sequential numbers padded to 8 bytes
+	// and the objects, see mapproxy.AppendObjects(). All numbers are
+	// little-endian. Entries start at the offset aligned to 8 bytes, so
+	// they are used in place, see entriesOf(). Version 2 has no seqBase and
+	// no sequential numbers.
+	binaryCheckpointVersion = 3
+	binaryHeaderSize        = 32
+	noSeqsCheckpointVersion = 2
+	noSeqsHeaderSize        = 24
 )
 
-// Description of the sector. It provides information about corresponding
-// sector in the object and object identification.
+// Legacy description of the sector. It is used only for reading checkpoints
+// of the version without the header.
 type SectorMetadata struct {
-	// Sector in the object.
 	Sector int64
-
-	// Key of the object.
-	Key int64
-
-	// Sequential number of the last write to this sector.
-	SeqNo int64
-
-	// Reserved for future usage.
-	Flag int64
+	Key    int64
+	SeqNo  int64
+	Flag   int64
 }
 
 // Implementation of the ExtentMapper interface hence serving as and extent map. This is high
@@ -45,31 +86,124 @@ type SectorMetadata struct {
 // possible because we don't store any additional data like in some more complex data structures
 // like trees.
 //
-// Nevertheless if the memory usage is a problem, slightly raising the sector size helps
-// tremendously. 4k sectors are norm today and if we have 1TB block device the map consumes
-// 1TB/4k*32 = 8GB. With 8k sectors it is just 4GB. This can be further reduced by shrinking data
-// types in SectorMetadata structure from int64 which is an overkill for most of them.
+// The map is structure of arrays. Key, sector in the object and flag of every sector are packed
+// into one uint64 in entries, see flagBits, sectorBits and keyBits. Sequential numbers, which are
+// needed only for ordering of writes, are in a separate array of uint32 relative to seqBase. Hence
+// one sector takes 12 bytes and 1TB block device with 4k sectors needs 3GB for the map. Lookups,
+// which are the hot path, scan just the entries. Comparing two neighbouring entries decides
+// whether they belong to one object part.
 //
-// This structure is serialized by gobs hence it has to be exported and all its attributes as well.
+// Entries are split into segments of segmentSize sectors. Published segments are never modified.
+// Updates copy the segment, modify the copy and publish it by an atomic store of the pointer.
+// Hence Lookup does not need any lock and runs concurrently with updates. It sees every segment
+// either before or after the update. Replaced segments are freed by the garbage collector once
+// the last lookup reading them returns. Segments of sectors never written share
+// unmappedSegment.
 type SectorMap struct {
+	segments []unsafe.Pointer
+	length   int64
+
+	// Sequential numbers of the last writes to the sectors. Zero means
+	// a write older than seqBase, n means seqBase+n-1. Writes older than
+	// 2^31 writes cannot be reordered with the current ones, hence their
+	// exact sequential numbers are not needed. See relativeSeqNo(). The
+	// base starts at 1, so zero is the sequential number 0 of sectors
+	// never written and of a restored map.
+	seqs    []uint32
+	seqBase int64
+
+	ObjUtilizations map[int64]int64
+	DeadObjs        map[int64]struct{}
+}
+
+// Serialized form of the map, which follows the header in the gob checkpoint.
+// Sequential numbers are not stored, since they are zeroed during
+// deserialization.
+type checkpoint struct {
+	Entries         []uint64
+	ObjUtilizations map[int64]int64
+	DeadObjs        map[int64]struct{}
+}
+
+// Serialized form of the map before the version header was introduced.
+type legacyCheckpoint struct {
 	Sectors         []SectorMetadata
 	ObjUtilizations map[int64]int64
 	DeadObjs        map[int64]struct{}
 }
 
-// Returns new instance of the sector map. The map should not be used directly because it does not
-// support concurrent access.
+// Entries of segmentSize consecutive sectors.
+type segment [segmentSize]uint64
+
+// Segment of sectors which were never written. It is shared by all such
+// segments, hence it must never be modified.
+var unmappedSegment = func() *segment {
+	var s segment
+	for i := range s {
+		s[i] = unmappedEntry
+	}
+
+	return &s
+}()
+
+// Whether the entries in memory have the same layout as in the binary
+// checkpoint.
+var nativeLittleEndian = func() bool {
+	x := uint16(1)
+	return *(*byte)(unsafe.Pointer(&x)) == 1
+}()
+
+// Returns entry of sector with flag in object with key.
+func pack(key, sector, flag int64) uint64 {
+	k := uint64(key)
+	if key == notMappedKey {
+		k = unmappedKey
+	}
+
+	return k<<(sectorBits+flagBits) | uint64(sector)<<flagBits | uint64(flag)
+}
+
+// Returns key of the object the entry points to.
+func entryKey(e uint64) int64 {
+	k := e >> (sectorBits + flagBits)
+	if k == unmappedKey {
+		return notMappedKey
+	}
+
+	return int64(k)
+}
+
+// Returns sector in the object the entry points to.
+func entrySector(e uint64) int64 {
+	return int64(e >> flagBits & sectorMask)
+}
+
+// Returns flag of the entry.
+func entryFlag(e uint64) int64 {
+	return int64(e & flagMask)
+}
+
+// Returns whether the entry is not mapped.
+func unmapped(e uint64) bool {
+	return e>>(sectorBits+flagBits) == unmappedKey
+}
+
+// Returns new instance of the sector map. The map should not be used directly because only
+// Lookup supports concurrent access.
 func New(length int64) *SectorMap {
-	sectors := make([]SectorMetadata, length)
+	segments := make([]unsafe.Pointer, (length+segmentMask)/segmentSize)
 	objectUtilization := make(map[int64]int64)
 	deadObjects := make(map[int64]struct{})
 
-	for i := range sectors {
-		sectors[i].Key = notMappedKey
+	for i := range segments {
+		segments[i] = unsafe.Pointer(unmappedSegment)
 	}
 
 	s := SectorMap{
-		Sectors:         sectors,
+		segments:        segments,
+		length:          length,
+		seqs:            make([]uint32, length),
+		seqBase:         1,
 		ObjUtilizations: objectUtilization,
 		DeadObjs:        deadObjects,
 	}
@@ -77,13 +211,72 @@ func New(length int64) *SectorMap {
 	return &s
 }
 
+// Returns published segment i.
+func (m *SectorMap) segment(i int64) *segment {
+	return (*segment)(atomic.LoadPointer(&m.segments[i]))
+}
+
+// Returns entry of sector.
+func (m *SectorMap) entry(sector int64) uint64 {
+	return m.segment(sector >> segmentBits)[sector&segmentMask]
+}
+
+// Returns private copy of segment i for modification. It is made visible to
+// lookups by publish().
+func (m *SectorMap) modify(i int64) *segment {
+	s := *m.segment(i)
+	return &s
+}
+
+// Replaces segment i by s.
+func (m *SectorMap) publish(i int64, s *segment) {
+	atomic.StorePointer(&m.segments[i], unsafe.Pointer(s))
+}
+
+// Returns sequential number relative to seqBase as stored in seqs. The base
+// is moved forward when seqNo does not fit, which makes the oldest sequential
+// numbers zero. That happens once per 2^31 writes.
+func (m *SectorMap) relativeSeqNo(seqNo int64) uint32 {
+	if seqNo-m.seqBase >= math.MaxUint32 {
+		m.rebase(seqNo - math.MaxInt32)
+	}
+
+	if seqNo < m.seqBase {
+		return 0
+	}
+
+	return uint32(seqNo-m.seqBase) + 1
+}
+
+// Returns absolute sequential number of relative seq. Writes older than the
+// base are reported just before it.
+func (m *SectorMap) absoluteSeqNo(seq uint32) int64 {
+	return m.seqBase + int64(seq) - 1
+}
+
+// Moves seqBase to base and recomputes all relative sequential numbers.
+func (m *SectorMap) rebase(base int64) {
+	shift := base - m.seqBase
+	for i, s := range m.seqs {
+		if int64(s) <= shift {
+			m.seqs[i] = 0
+		} else {
+			m.seqs[i] = uint32(int64(s) - shift)
+		}
+	}
+
+	m.seqBase = base
+}
+
 // Updates sectors in the map with new values from extents. startOfDataSectors
 // is the first sector with data in the object and key is the key of the
-// object.
+// object. Repeated updates with the same key add to its utilization.
 func (m *SectorMap) Update(extents []mapproxy.Extent, startOfDataSectors, key int64) {
-	m.ObjUtilizations[key] = 0
-
 	for _, e := range extents {
+		if !e.HasData() {
+			m.unmapExtent(e, key)
+			continue
+		}
 		m.updateExtent(e, startOfDataSectors, key)
 		startOfDataSectors += e.Length
 	}
@@ -97,101 +290,166 @@ func (m *SectorMap) Update(extents []mapproxy.Extent, startOfDataSectors, key in
 }
 
 // Updates the information about objects utilizations for given sector.
-func (m *SectorMap) updateUtilization(key int64, s *SectorMetadata) {
+func (m *SectorMap) updateUtilization(key int64, e uint64) {
 	// Increment cannot be done at once because GC can
 	// introduce object with writes with lower seqNo
 	m.ObjUtilizations[key]++
-	if s.Key != notMappedKey {
-		m.ObjUtilizations[s.Key]--
-		if m.ObjUtilizations[s.Key] == 0 {
-			delete(m.ObjUtilizations, s.Key)
-			m.DeadObjs[s.Key] = struct{}{}
+	if old := entryKey(e); old != notMappedKey {
+		m.ObjUtilizations[old]--
+		if m.ObjUtilizations[old] == 0 {
+			delete(m.ObjUtilizations, old)
+			m.DeadObjs[old] = struct{}{}
 		}
 	}
 }
 
-// Update one sector.
-func (m *SectorMap) updateSector(key int64, s *SectorMetadata, targetSector int64, e mapproxy.Extent) {
-	m.updateUtilization(key, s)
-
-	s.Sector = targetSector
-	s.Key = key
-	s.SeqNo = e.SeqNo
-	s.Flag = e.Flag
-}
-
 // Updates an extent. It checks whether the write is actually newer than write
 // already in the map. Like this we always keep the map consistent.
 func (m *SectorMap) updateExtent(e mapproxy.Extent, startOfDataSectors, key int64) {
+	if startOfDataSectors+e.Length > MaxObjectSectors {
+		panic("sectormap: object larger than MaxObjectSectors")
+	}
+
+	seq := m.relativeSeqNo(e.SeqNo)
 	targetSector := startOfDataSectors
-	for i := e.Sector; i < e.Sector+e.Length; i++ {
-		s := &m.Sectors[i]
-		if s.SeqNo <= e.SeqNo { // Equality because of GC
-			m.updateSector(key, s, targetSector, e)
+	end := e.Sector + e.Length
+	for i := e.Sector; i < end; {
+		// Segments are copied only when some of their sectors change.
+		var s *segment
+		idx := i >> segmentBits
+		for ; i < end && i>>segmentBits == idx; i++ {
+			if m.seqs[i] <= seq { // Equality because of GC
+				if s == nil {
+					s = m.modify(idx)
+				}
+				m.updateUtilization(key, s[i&segmentMask])
+				s[i&segmentMask] = pack(key, targetSector, e.Flag)
+				m.seqs[i] = seq
+			}
+			targetSector++
+		}
+
+		if s != nil {
+			m.publish(idx, s)
+		}
+	}
+}
+
+// Unmaps sectors of the discard or zero extent. Unmapped sectors read as
+// zeros. The sequential number is kept so older writes replayed during
+// recovery do not map the sectors again and the flag is kept to record what
+// unmapped the sector. Such extents have no data in the object, hence the
+// object utilization is not increased. Key is the key of the object with the
+// extent.
+func (m *SectorMap) unmapExtent(e mapproxy.Extent, key int64) {
+	seq := m.relativeSeqNo(e.SeqNo)
+	end := e.Sector + e.Length
+	for i := e.Sector; i < end; {
+		var s *segment
+		idx := i >> segmentBits
+		for ; i < end && i>>segmentBits == idx; i++ {
+			if m.seqs[i] > seq {
+				continue
+			}
+			if s == nil {
+				s = m.modify(idx)
+			}
+
+			// Sectors written earlier in the same object are
+			// accounted by Update() when the whole object is
+			// processed.
+			if old := entryKey(s[i&segmentMask]); old != notMappedKey {
+				m.ObjUtilizations[old]--
+				if m.ObjUtilizations[old] == 0 && old != key {
+					delete(m.ObjUtilizations, old)
+					m.DeadObjs[old] = struct{}{}
+				}
+			}
+
+			s[i&segmentMask] = pack(notMappedKey, 0, e.Flag)
+			m.seqs[i] = seq
+		}
+
+		if s != nil {
+			m.publish(idx, s)
 		}
-		targetSector++
 	}
 }
 
 // Returns longest possible extent in the object starting at startSector with
 // maximal length length. This means that the extent has the same key and
 // sequential number.
-func (m *SectorMap) getExtent(startSector, length uint64) mapproxy.Extent {
-	s := m.Sectors[startSector]
+func (m *SectorMap) getExtent(startSector, length int64) mapproxy.Extent {
+	prev := m.entry(startSector)
+	seq := m.seqs[startSector]
 	e := mapproxy.Extent{
-		Sector: s.Sector,
+		Sector: entrySector(prev),
 		Length: 1,
-		SeqNo:  s.SeqNo,
-		Flag:   s.Flag,
+		SeqNo:  m.absoluteSeqNo(seq),
+		Flag:   entryFlag(prev),
 	}
 
-	for i := startSector + 1; ; i++ {
-		if i >= uint64(len(m.Sectors)) ||
-			i >= startSector+length ||
-			m.Sectors[i].Key != m.Sectors[i-1].Key ||
-			m.Sectors[i].SeqNo != e.SeqNo ||
-			m.Sectors[i-1].Sector != m.Sectors[i].Sector-1 {
+	for i := startSector + 1; i < m.length && i < startSector+length; i++ {
+		cur := m.entry(i)
+		if entryKey(cur) != entryKey(prev) ||
+			m.seqs[i] != seq ||
+			entrySector(prev) != entrySector(cur)-1 {
 
 			break
 		}
 
 		e.Length++
+		prev = cur
 	}
 
 	return e
 }
 
 // Returns all ObjectParts from which extent starting at sector with length
-// length can be reconstructed.
+// length can be reconstructed. Neighbouring sectors belong to one part when
+// they are both unmapped or when the entry of the second one, without the
+// flag, follows the entry of the first one, i.e. the key is the same and the
+// sector in the object is the next one. It can run concurrently with all
+// other methods.
 func (m *SectorMap) Lookup(sector, length int64) []mapproxy.ObjectPart {
 	parts := make([]mapproxy.ObjectPart, 0, typicalObjectPartsPerLookup)
-	s := m.Sectors[sector].Sector
-	l := int64(1)
-	for i := int64(1); i < length; i++ {
-		id := sector + i
-		// The next sector is not from the same extent. Store part into
-		// the returned value and begin new extent.
-		if (m.Sectors[id].Key != m.Sectors[id-1].Key ||
-			m.Sectors[id].Sector != m.Sectors[id-1].Sector+1) &&
-			(m.Sectors[id].Key != -1 || m.Sectors[id-1].Key != notMappedKey) {
-
-			parts = append(parts, mapproxy.ObjectPart{
-				Sector: s,
-				Length: l,
-				Key:    m.Sectors[id-1].Key,
-			})
-			s = m.Sectors[id].Sector
-			l = 1
-		} else {
-			l++
+	end := sector + length
+
+	first := m.entry(sector)
+	prev, start := first, sector
+	for i := sector + 1; i < end; {
+		idx := i >> segmentBits
+		s := m.segment(idx)
+		stop := (idx + 1) << segmentBits
+		if stop > end {
+			stop = end
+		}
+
+		for ; i < stop; i++ {
+			cur := s[i&segmentMask]
+			if cur>>flagBits != prev>>flagBits+1 && !(unmapped(cur) && unmapped(prev)) {
+				parts = append(parts, m.objectPart(first, i-start))
+				first, start = cur, i
+			}
+			prev = cur
 		}
 	}
-	parts = append(parts, mapproxy.ObjectPart{
-		Sector: s,
-		Length: l,
-		Key:    m.Sectors[sector+length-1].Key,
-	})
-	return parts
+
+	return append(parts, m.objectPart(first, end-start))
+}
+
+// Lookup of the map can run concurrently with updates, see SectorMap.
+func (m *SectorMap) LockFreeLookup(sector, length int64) []mapproxy.ObjectPart {
+	return m.Lookup(sector, length)
+}
+
+// Returns object part of length sectors starting at entry e.
+func (m *SectorMap) objectPart(e uint64, length int64) mapproxy.ObjectPart {
+	return mapproxy.ObjectPart{
+		Sector: entrySector(e),
+		Length: length,
+		Key:    entryKey(e),
+	}
 }
 
 // Returns all extents and objectparts starting from sector with length length
@@ -199,10 +457,10 @@ func (m *SectorMap) Lookup(sector, length int64) []mapproxy.ObjectPart {
 func (m *SectorMap) FindExtentsWithKeys(sector, length int64, keys map[int64]struct{}) []mapproxy.ExtentWithObjectPart {
 	ci := make([]mapproxy.ExtentWithObjectPart, 0, typicalObjectPartsPerLookup)
 
-	for i := sector; i < sector+length && i < int64(len(m.Sectors)); {
-		key := m.Sectors[i].Key
+	for i := sector; i < sector+length && i < m.length; {
+		key := entryKey(m.entry(i))
 		_, ok := keys[key]
-		extent := m.getExtent(uint64(i), uint64(sector+length-i))
+		extent := m.getExtent(i, sector+length-i)
 		if ok {
 			op := mapproxy.ObjectPart{
 				Sector: i,
@@ -256,60 +514,280 @@ func (m *SectorMap) ObjectsUtilization() map[int64]int64 {
 	return objectUtilization
 }
 
-// Returns serialized version of the map with go gobs.
+// Returns serialized version of the map. It is the binary checkpoint, see
+// binaryCheckpointVersion.
 func (m *SectorMap) Serialize() []byte {
-	var buf bytes.Buffer
+	buf := make([]byte, binaryHeaderSize+8*m.length+seqsSize(m.length))
+	copy(buf, checkpointMagic)
+	buf[len(checkpointMagic)] = binaryCheckpointVersion
+	binary.LittleEndian.PutUint64(buf[8:], uint64(m.length))
+	binary.LittleEndian.PutUint64(buf[24:], uint64(m.seqBase))
+
+	var maxKey int64 = notMappedKey
+	entries := buf[binaryHeaderSize:]
+	for i := range m.segments {
+		s := m.segment(int64(i))
+		for j := 0; j < segmentSize && len(entries) > 0; j++ {
+			binary.LittleEndian.PutUint64(entries, s[j])
+			if k := entryKey(s[j]); k > maxKey {
+				maxKey = k
+			}
+			entries = entries[8:]
+		}
+	}
+	binary.LittleEndian.PutUint64(buf[16:], uint64(maxKey+1))
+
+	putSeqs(buf[binaryHeaderSize+8*m.length:], m.seqs)
 
-	encoder := gob.NewEncoder(&buf)
-	encoder.Encode(m)
+	return mapproxy.AppendObjects(buf, m.ObjUtilizations, m.DeadObjs)
+}
+
+// Returns size of n relative sequential numbers in the binary checkpoint.
+func seqsSize(n int64) int64 {
+	return (4*n + 7) &^ 7
+}
 
-	return buf.Bytes()
+// Stores seqs into b.
+func putSeqs(b []byte, seqs []uint32) {
+	for i, s := range seqs {
+		binary.LittleEndian.PutUint32(b[4*i:], s)
+	}
 }
 
 // Deserialized map from buf which was previously serialized by Serialize(). It
 // restored map and structures representing object utilization and dead
-// objects. During deserialization all sequential numbers are zeroed because
-// most they are not needed and most probably BUSE starts from 0 since it was
-// restarted. The map supports device size change.
+// objects. Sequential numbers are restored too, checkpoints without them
+// restore zeros, see ResetSeqNos(). The map supports device size change. Gob
+// checkpoints and checkpoints without the header, which store the array of
+// SectorMetadata, are converted.
+//
+// Entries of the binary checkpoint are not decoded but used in place, hence
+// buf must not be modified afterwards.
 func (m *SectorMap) DeserializeAndReturnNextKey(buf []byte) int64 {
 	// Size of the allocated map
-	intendedSize := len(m.Sectors)
-
-	// 1) In case of smaller checkpointed map, i.e. we enlarged the device,
-	//    the map would be shrinked and we need to resize it to its
-	//    intended size.
-	// 2) In case of larger checkpointed map, i.e. we shrinked the device,
-	//    the map would be enlarged and we need to resize it to its inteded size.
-	decoder := gob.NewDecoder(bytes.NewReader(buf))
-	decoder.Decode(m)
-
-	if intendedSize < len(m.Sectors) {
-		// Create new map with smaller size and copy the intended range
-		// to it. Then replace the the map. We could just change the
-		// len of the map, but then the memory would be still occupied
-		// like in the case of larger map.
-		sectors := make([]SectorMetadata, intendedSize)
-		copy(sectors, m.Sectors)
-		m.Sectors = sectors
+	intendedSize := int(m.length)
+
+	m.ResetSeqNos()
+
+	var nextKey int64
+	if version, ok := binaryVersion(buf); ok {
+		header := int64(noSeqsHeaderSize)
+		if version == binaryCheckpointVersion {
+			header = binaryHeaderSize
+		}
+
+		length := int64(binary.LittleEndian.Uint64(buf[8:]))
+		nextKey = int64(binary.LittleEndian.Uint64(buf[16:]))
+
+		entries := buf[header : header+8*length]
+		rest := buf[header+8*length:]
+		if version == binaryCheckpointVersion {
+			m.seqBase = int64(binary.LittleEndian.Uint64(buf[24:]))
+			m.restoreSeqs(0, rest[:4*length])
+			rest = rest[seqsSize(length):]
+		}
+
+		utilizations, dead := mapproxy.ReadObjects(rest)
+		m.restore(checkpoint{entriesOf(entries), utilizations, dead}, intendedSize)
 	} else {
-		// We already have allocated large map, but we decoded smaller
-		// one and it the len was set according to the decoded
-		// (smaller) map. We just change len to its full size.
-		m.Sectors = m.Sectors[:cap(m.Sectors)]
+		var c checkpoint
+		if bytes.HasPrefix(buf, []byte(checkpointMagic)) {
+			gob.NewDecoder(bytes.NewReader(buf[len(checkpointMagic)+1:])).Decode(&c)
+		} else {
+			var legacy legacyCheckpoint
+			gob.NewDecoder(bytes.NewReader(buf)).Decode(&legacy)
+
+			c = checkpoint{
+				Entries:         make([]uint64, len(legacy.Sectors)),
+				ObjUtilizations: legacy.ObjUtilizations,
+				DeadObjs:        legacy.DeadObjs,
+			}
+			for i, s := range legacy.Sectors {
+				c.Entries[i] = pack(s.Key, s.Sector, s.Flag)
+			}
+		}
+
+		m.restore(c, intendedSize)
+
+		var maxKey int64 = notMappedKey
+		for i := range m.segments {
+			for _, e := range m.segment(int64(i)) {
+				if k := entryKey(e); k > maxKey {
+					maxKey = k
+				}
+			}
+		}
+		nextKey = maxKey + 1
 	}
 
-	var maxKey int64 = notMappedKey
-	for _, s := range m.Sectors {
-		if s.Key > maxKey {
-			maxKey = s.Key
+	return nextKey
+}
+
+// Returns version of the binary checkpoint in buf and whether it is one.
+func binaryVersion(buf []byte) (byte, bool) {
+	if !bytes.HasPrefix(buf, []byte(checkpointMagic)) || len(buf) <= len(checkpointMagic) {
+		return 0, false
+	}
+
+	version := buf[len(checkpointMagic)]
+
+	return version, version == binaryCheckpointVersion || version == noSeqsCheckpointVersion
+}
+
+// Restores relative sequential numbers from sector stored in b. Numbers after
+// the end of the map are dropped.
+func (m *SectorMap) restoreSeqs(sector int64, b []byte) {
+	for i := int64(0); 4*i < int64(len(b)) && sector+i < m.length; i++ {
+		m.seqs[sector+i] = binary.LittleEndian.Uint32(b[4*i:])
+	}
+}
+
+// Returns entries stored in b by the binary checkpoint. When the layout in
+// memory is the same, b is used in place, so even huge maps are restored
+// without decoding and without the second copy in memory.
+func entriesOf(b []byte) []uint64 {
+	n := len(b) / 8
+	if n == 0 {
+		return nil
+	}
+
+	if nativeLittleEndian && uintptr(unsafe.Pointer(&b[0]))%8 == 0 {
+		return unsafe.Slice((*uint64)(unsafe.Pointer(&b[0])), n)
+	}
+
+	entries := make([]uint64, n)
+	for i := range entries {
+		entries[i] = binary.LittleEndian.Uint64(b[8*i:])
+	}
+
+	return entries
+}
+
+// Replaces content of the map by decoded checkpoint c and resizes it to
+// intendedSize. Segments are slices of c.Entries, so it must not be modified
+// afterwards.
+func (m *SectorMap) restore(c checkpoint, intendedSize int) {
+	// The checkpointed map is smaller when we enlarged the device and
+	// larger when we shrinked it. Sectors after its end are unmapped and
+	// sectors after the end of the device are dropped.
+	if len(c.Entries) > intendedSize {
+		c.Entries = c.Entries[:intendedSize]
+	}
+
+	for i := range m.segments {
+		from := i * segmentSize
+		switch {
+		case from+segmentSize <= len(c.Entries):
+			m.publish(int64(i), (*segment)(c.Entries[from:from+segmentSize]))
+		case from < len(c.Entries):
+			s := new(segment)
+			n := copy(s[:], c.Entries[from:])
+			for j := n; j < segmentSize; j++ {
+				s[j] = unmappedEntry
+			}
+			m.publish(int64(i), s)
+		default:
+			m.publish(int64(i), unmappedSegment)
 		}
 	}
 
-	for i := range m.Sectors {
-		m.Sectors[i].SeqNo = 0
+	if c.ObjUtilizations != nil {
+		m.ObjUtilizations = c.ObjUtilizations
 	}
+	if c.DeadObjs != nil {
+		m.DeadObjs = c.DeadObjs
+	}
+}
+
+// Returns serialized sectors of ranges with their sequential numbers. It is
+// seqBase and the number of ranges followed by the sector, the length, the
+// entries and the relative sequential numbers padded to 8 bytes of every
+// range. Ranges are clipped to the map.
+func (m *SectorMap) SerializeRanges(ranges []mapproxy.Extent) []byte {
+	buf := mapproxy.AppendUint64(nil, uint64(m.seqBase))
+	buf = mapproxy.AppendUint64(buf, uint64(len(ranges)))
+
+	for _, r := range ranges {
+		from, to := r.Sector, r.Sector+r.Length
+		if to > m.length {
+			to = m.length
+		}
+		if from > to {
+			from = to
+		}
 
-	return maxKey + 1
+		buf = mapproxy.AppendUint64(buf, uint64(from))
+		buf = mapproxy.AppendUint64(buf, uint64(to-from))
+		for i := from; i < to; i++ {
+			buf = mapproxy.AppendUint64(buf, m.entry(i))
+		}
+
+		seqs := make([]byte, seqsSize(to-from))
+		putSeqs(seqs, m.seqs[from:to])
+		buf = append(buf, seqs...)
+	}
+
+	return buf
+}
+
+// Replaces sectors by the ranges serialized by SerializeRanges(). Sequential
+// numbers relative to a different seqBase are converted. Object utilizations
+// are not updated, see RecomputeUtilization().
+func (m *SectorMap) DeserializeRanges(buf []byte) {
+	seqBase := int64(binary.LittleEndian.Uint64(buf))
+	n := binary.LittleEndian.Uint64(buf[8:])
+	buf = buf[16:]
+
+	for ; n > 0; n-- {
+		from := int64(binary.LittleEndian.Uint64(buf))
+		length := int64(binary.LittleEndian.Uint64(buf[8:]))
+		entries, seqs := buf[16:16+8*length], buf[16+8*length:]
+		buf = buf[16+8*length+seqsSize(length):]
+
+		for i := int64(0); i < length && from+i < m.length; {
+			idx := (from + i) >> segmentBits
+			s := m.modify(idx)
+			for ; i < length && from+i < m.length && (from+i)>>segmentBits == idx; i++ {
+				s[(from+i)&segmentMask] = binary.LittleEndian.Uint64(entries[8*i:])
+
+				seq := binary.LittleEndian.Uint32(seqs[4*i:])
+				if seq != 0 && seqBase != m.seqBase {
+					seq = m.relativeSeqNo(seqBase + int64(seq) - 1)
+				}
+				m.seqs[from+i] = seq
+			}
+			m.publish(idx, s)
+		}
+	}
+}
+
+// Recomputes object utilizations from the entries. No object is dead.
+func (m *SectorMap) RecomputeUtilization() {
+	m.ObjUtilizations = make(map[int64]int64)
+	m.DeadObjs = make(map[int64]struct{})
+
+	key, run := int64(notMappedKey), int64(0)
+	for i := int64(0); i < m.length; i++ {
+		if k := entryKey(m.entry(i)); k != key {
+			if key != notMappedKey {
+				m.ObjUtilizations[key] += run
+			}
+			key, run = k, 0
+		}
+		run++
+	}
+	if key != notMappedKey {
+		m.ObjUtilizations[key] += run
+	}
+}
+
+// Zeroes all sequential numbers, so any later write overwrites the sectors.
+// It is needed after the restart, because BUSE most probably starts from 0.
+func (m *SectorMap) ResetSeqNos() {
+	for i := range m.seqs {
+		m.seqs[i] = 0
+	}
+	m.seqBase = 1
 }
 
 // Deletes objects with keys from object utilizations.
@@ -0,0 +1,749 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+// Package diskcache implements a persistent cache of object blocks on a local
+// file or block device. It wraps any ObjectUploadDownloaderAt, hence it sits
+// under the object proxy and serves downloads of warm blocks without going to
+// the backend. Blocks are inserted when they are downloaded and when they are
+// uploaded. Both happens asynchronously, so the cache never slows down the
+// request which populates it.
+//
+// The device is split into lines of lineBlocks consecutive blocks of one
+// object. Every line has an entry in the index at the beginning of the device
+// describing which object blocks it holds together with their checksums. The
+// index is loaded when the cache is opened, hence the cache survives restarts.
+// Checksums are verified on every read, so torn writes after a crash or lines
+// reused while being read are just misses.
+//
+// Objects are immutable, but their keys are reused after the recovery deletes
+// objects breaking the prefix consistency. Hence lines of an object are
+// invalidated, also on the device, before the object with the same key is
+// uploaded or deleted.
+//
+// Lines are replaced by the CLOCK algorithm.
+package diskcache
+
+import (
+	"encoding/binary"
+	"errors"
+	"hash/crc32"
+	"hash/fnv"
+	"io"
+	"os"
+	"sync"
+	"syscall"
+
+	"github.com/rs/zerolog/log"
+
+	"github.com/asch/bs3/internal/bs3/objproxy"
+)
+
+const (
+	// Number of blocks in one line.
+	lineBlocks = 16
+
+	// Size of one index entry on the device. Entries never cross a 512 B
+	// sector, hence they are written atomically.
+	entrySize = 128
+
+	// Identification of the cache device and version of its layout.
+	magic   = "BS3CACHE"
+	version = 1
+
+	// Number of go routines writing inserted blocks to the device and the
+	// number of insertions waiting for them. Insertions are dropped when
+	// the queue is full.
+	writers    = 4
+	writeQueue = 256
+
+	// Size of the chunks in which the index is read and cleared.
+	indexChunk = 1 << 20
+)
+
+var crcTable = crc32.MakeTable(crc32.Castagnoli)
+
+// Identification of the cached line.
+type lineKey struct {
+	// Hash of the volume name.
+	volume uint64
+
+	object int64
+	line   int64
+}
+
+// One line of the cache.
+type line struct {
+	key lineKey
+
+	// Bitmap of valid blocks and their checksums.
+	valid uint64
+	crc   [lineBlocks]uint32
+
+	// Incremented when the line is assigned to a different key.
+	gen uint64
+
+	// Whether the line is assigned to some key and whether it was accessed
+	// since the last pass of the clock hand.
+	used       bool
+	referenced bool
+}
+
+// Blocks waiting to be written to the line.
+type writeJob struct {
+	slot  int
+	gen   uint64
+	first int
+	data  []byte
+}
+
+// Cache on the device shared by all volumes.
+type Cache struct {
+	file       *os.File
+	blockSize  int64
+	dataOffset int64
+
+	mutex sync.Mutex
+	lines []line
+	index map[lineKey]int
+
+	// Lines of every object, needed for invalidation.
+	objects map[lineKey]map[int64]int
+
+	free []int
+	hand int
+
+	writes chan writeJob
+	pool   sync.Pool
+}
+
+// Cache of one volume. It implements ObjectUploadDownloaderAt.
+type Volume struct {
+	cache    *Cache
+	volume   uint64
+	instance objproxy.ObjectUploadDownloaderAt
+}
+
+// Opens the cache on the file or block device at path. Regular files are
+// preallocated to size bytes, block devices are used up to size bytes.
+// Identity distinguishes backends, the cache content is dropped when the
+// cache was used with a different backend or a different block size before.
+func Open(path string, size int64, blockSize int, identity string) (*Cache, error) {
+	f, err := os.OpenFile(path, os.O_RDWR|os.O_CREATE, 0600)
+	if err != nil {
+		return nil, err
+	}
+
+	size, err = prepareDevice(f, size)
+	if err != nil {
+		f.Close()
+		return nil, err
+	}
+
+	bs := int64(blockSize)
+	lineSize := lineBlocks * bs
+
+	// Header block, index and data of all lines.
+	lines := (size - bs) / (entrySize + lineSize)
+	dataOffset := bs + (lines*entrySize+bs-1)/bs*bs
+	lines = (size - dataOffset) / lineSize
+	if lines < 1 {
+		f.Close()
+		return nil, errors.New("disk cache too small")
+	}
+
+	c := &Cache{
+		file:       f,
+		blockSize:  bs,
+		dataOffset: dataOffset,
+		lines:      make([]line, lines),
+		index:      make(map[lineKey]int),
+		objects:    make(map[lineKey]map[int64]int),
+		writes:     make(chan writeJob, writeQueue),
+	}
+
+	c.pool.New = func() interface{} {
+		return make([]byte, lineSize)
+	}
+
+	if err := c.load(header(blockSize, lines, identity)); err != nil {
+		f.Close()
+		return nil, err
+	}
+
+	for i := 0; i < writers; i++ {
+		go c.writer()
+	}
+
+	log.Info().Str("path", path).Int64("lines", lines).Int("cached", len(c.index)).Msg("Disk cache opened.")
+
+	return c, nil
+}
+
+// Returns cache of the volume with name, which uses instance as the backend.
+func (c *Cache) Volume(name string, instance objproxy.ObjectUploadDownloaderAt) *Volume {
+	h := fnv.New64a()
+	h.Write([]byte(name))
+
+	return &Volume{
+		cache:    c,
+		volume:   h.Sum64(),
+		instance: instance,
+	}
+}
+
+// Preallocates regular file to size bytes. Returns size of the device, which
+// is at most size.
+func prepareDevice(f *os.File, size int64) (int64, error) {
+	fi, err := f.Stat()
+	if err != nil {
+		return 0, err
+	}
+
+	if fi.Mode().IsRegular() {
+		err := syscall.Fallocate(int(f.Fd()), 0, 0, size)
+		if err == syscall.EOPNOTSUPP {
+			err = f.Truncate(size)
+		}
+		return size, err
+	}
+
+	end, err := f.Seek(0, io.SeekEnd)
+	if err != nil {
+		return 0, err
+	}
+	if end < size {
+		size = end
+	}
+
+	return size, nil
+}
+
+// Returns header block of the device with given geometry.
+func header(blockSize int, lines int64, identity string) []byte {
+	h := make([]byte, blockSize)
+	copy(h, magic)
+	binary.LittleEndian.PutUint32(h[8:], version)
+	binary.LittleEndian.PutUint32(h[12:], uint32(blockSize))
+	binary.LittleEndian.PutUint64(h[16:], uint64(lines))
+	copy(h[24:blockSize-4], identity)
+	binary.LittleEndian.PutUint32(h[blockSize-4:], crc32.Checksum(h[:blockSize-4], crcTable))
+
+	return h
+}
+
+// Loads the index from the device. When the header does not match, the index
+// is cleared and the header is written.
+func (c *Cache) load(h []byte) error {
+	old := make([]byte, len(h))
+	if _, err := c.file.ReadAt(old, 0); err != nil && err != io.EOF {
+		return err
+	}
+
+	if string(old) != string(h) {
+		return c.reset(h)
+	}
+
+	buf := make([]byte, indexChunk)
+	for first := 0; first < len(c.lines); first += indexChunk / entrySize {
+		n := len(c.lines) - first
+		if n > indexChunk/entrySize {
+			n = indexChunk / entrySize
+		}
+
+		if _, err := c.file.ReadAt(buf[:n*entrySize], c.blockSize+int64(first)*entrySize); err != nil {
+			return err
+		}
+
+		for i := 0; i < n; i++ {
+			l, ok := parseEntry(buf[i*entrySize : (i+1)*entrySize])
+			if _, dup := c.index[l.key]; !ok || dup {
+				c.free = append(c.free, first+i)
+				continue
+			}
+			c.lines[first+i] = l
+			c.assign(first+i, l.key)
+		}
+	}
+
+	return nil
+}
+
+// Clears the index on the device and writes header h.
+func (c *Cache) reset(h []byte) error {
+	zero := make([]byte, indexChunk)
+	for off := c.blockSize; off < c.dataOffset; off += indexChunk {
+		n := c.dataOffset - off
+		if n > indexChunk {
+			n = indexChunk
+		}
+		if _, err := c.file.WriteAt(zero[:n], off); err != nil {
+			return err
+		}
+	}
+
+	if _, err := c.file.WriteAt(h, 0); err != nil {
+		return err
+	}
+
+	for i := range c.lines {
+		c.free = append(c.free, i)
+	}
+
+	return c.file.Sync()
+}
+
+// Parses index entry. Returns false when the entry is empty or damaged.
+func parseEntry(b []byte) (line, bool) {
+	var l line
+
+	if binary.LittleEndian.Uint32(b[entrySize-4:]) != crc32.Checksum(b[:entrySize-4], crcTable) {
+		return l, false
+	}
+
+	l.key.volume = binary.LittleEndian.Uint64(b[0:])
+	l.key.object = int64(binary.LittleEndian.Uint64(b[8:]))
+	l.key.line = int64(binary.LittleEndian.Uint64(b[16:]))
+	l.valid = binary.LittleEndian.Uint64(b[24:])
+	for i := range l.crc {
+		l.crc[i] = binary.LittleEndian.Uint32(b[32+4*i:])
+	}
+
+	return l, l.valid != 0
+}
+
+// Serializes index entry of the line. Unused line has an empty entry.
+func (l *line) entry() []byte {
+	b := make([]byte, entrySize)
+	if !l.used || l.valid == 0 {
+		return b
+	}
+
+	binary.LittleEndian.PutUint64(b[0:], l.key.volume)
+	binary.LittleEndian.PutUint64(b[8:], uint64(l.key.object))
+	binary.LittleEndian.PutUint64(b[16:], uint64(l.key.line))
+	binary.LittleEndian.PutUint64(b[24:], l.valid)
+	for i := range l.crc {
+		binary.LittleEndian.PutUint32(b[32+4*i:], l.crc[i])
+	}
+	binary.LittleEndian.PutUint32(b[entrySize-4:], crc32.Checksum(b[:entrySize-4], crcTable))
+
+	return b
+}
+
+// Writes index entry of the line in slot to the device. Has to be called with
+// mutex held, so entries of one slot are written in order.
+func (c *Cache) writeEntry(slot int) error {
+	_, err := c.file.WriteAt(c.lines[slot].entry(), c.blockSize+int64(slot)*entrySize)
+
+	return err
+}
+
+// Assigns slot to key. Has to be called with mutex held.
+func (c *Cache) assign(slot int, key lineKey) {
+	l := &c.lines[slot]
+	l.key = key
+	l.used = true
+	l.referenced = false
+	c.index[key] = slot
+
+	obj := lineKey{volume: key.volume, object: key.object}
+	if c.objects[obj] == nil {
+		c.objects[obj] = make(map[int64]int)
+	}
+	c.objects[obj][key.line] = slot
+}
+
+// Releases slot. Has to be called with mutex held.
+func (c *Cache) release(slot int) {
+	l := &c.lines[slot]
+	delete(c.index, l.key)
+
+	obj := lineKey{volume: l.key.volume, object: l.key.object}
+	delete(c.objects[obj], l.key.line)
+	if len(c.objects[obj]) == 0 {
+		delete(c.objects, obj)
+	}
+
+	l.used = false
+	l.valid = 0
+	l.gen++
+}
+
+// Returns slot for the line with key, possibly evicting another line. Has to
+// be called with mutex held.
+func (c *Cache) allocate(key lineKey) int {
+	if slot, ok := c.index[key]; ok {
+		return slot
+	}
+
+	var slot int
+	if n := len(c.free); n > 0 {
+		slot = c.free[n-1]
+		c.free = c.free[:n-1]
+	} else {
+		for {
+			l := &c.lines[c.hand]
+			slot = c.hand
+			c.hand = (c.hand + 1) % len(c.lines)
+			if !l.referenced {
+				break
+			}
+			l.referenced = false
+		}
+		c.release(slot)
+	}
+
+	c.lines[slot].gen++
+	c.assign(slot, key)
+
+	return slot
+}
+
+// Drops all lines of the object with key of volume and of all its successors
+// when successors is true. Entries are cleared on the device too.
+func (c *Cache) invalidate(volume uint64, key int64, successors bool) error {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+
+	var slots []int
+	add := func(lines map[int64]int) {
+		for _, slot := range lines {
+			slots = append(slots, slot)
+		}
+	}
+
+	if successors {
+		for obj, lines := range c.objects {
+			if obj.volume == volume && obj.object >= key {
+				add(lines)
+			}
+		}
+	} else {
+		add(c.objects[lineKey{volume: volume, object: key}])
+	}
+
+	if len(slots) == 0 {
+		return nil
+	}
+
+	for _, slot := range slots {
+		c.release(slot)
+		c.free = append(c.free, slot)
+		if err := c.writeEntry(slot); err != nil {
+			return err
+		}
+	}
+
+	// The object with the same key can be uploaded right after return,
+	// hence the old entries must not survive a crash.
+	return c.file.Sync()
+}
+
+// Blocks of one line found in the cache.
+type hit struct {
+	slot  int
+	first int
+	crc   []uint32
+}
+
+// Returns number of consecutive blocks cached in the object with key of
+// volume starting at block first, going backwards when reverse is true, at
+// most max blocks. The blocks are grouped by lines in hits, which are in the
+// order of the lookup. Blocks of one hit are always in ascending order.
+func (c *Cache) lookup(volume uint64, key, first int64, max int, reverse bool) (int, []hit) {
+	c.mutex.Lock()
+	defer c.mutex.Unlock()
+
+	var hits []hit
+	n := 0
+	for n < max {
+		block := first + int64(n)
+		if reverse {
+			block = first - int64(n)
+		}
+
+		slot, ok := c.index[lineKey{volume, key, block / lineBlocks}]
+		if !ok || c.lines[slot].valid&(1<<uint(block%lineBlocks)) == 0 {
+			break
+		}
+
+		l := &c.lines[slot]
+		l.referenced = true
+		i := int(block % lineBlocks)
+
+		if k := len(hits) - 1; k >= 0 && hits[k].slot == slot {
+			if reverse {
+				hits[k].first = i
+				hits[k].crc = append([]uint32{l.crc[i]}, hits[k].crc...)
+			} else {
+				hits[k].crc = append(hits[k].crc, l.crc[i])
+			}
+		} else {
+			hits = append(hits, hit{slot: slot, first: i, crc: []uint32{l.crc[i]}})
+		}
+		n++
+	}
+
+	return n, hits
+}
+
+// Reads blocks of hits returned by lookup from the device into dst. Returns
+// number of blocks from the beginning of dst, or from its end when reverse is
+// true, which were read and verified.
+func (c *Cache) read(hits []hit, dst []byte, reverse bool) int {
+	buf := c.pool.Get().([]byte)
+	defer c.pool.Put(buf)
+
+	read := 0
+	offset := int64(0)
+	if reverse {
+		offset = int64(len(dst))
+	}
+
+	for _, h := range hits {
+		size := int64(len(h.crc)) * c.blockSize
+		data := buf[:size]
+		if _, err := c.file.ReadAt(data, c.lineOffset(h.slot, h.first)); err != nil {
+			return read
+		}
+
+		ok := len(h.crc)
+		for i := range h.crc {
+			j := i
+			if reverse {
+				j = len(h.crc) - 1 - i
+			}
+			if crc32.Checksum(data[int64(j)*c.blockSize:int64(j+1)*c.blockSize], crcTable) != h.crc[j] {
+				ok = i
+				break
+			}
+		}
+
+		if reverse {
+			offset -= int64(ok) * c.blockSize
+			copy(dst[offset:], data[size-int64(ok)*c.blockSize:])
+		} else {
+			copy(dst[offset:], data[:int64(ok)*c.blockSize])
+			offset += int64(ok) * c.blockSize
+		}
+
+		read += ok
+		if ok != len(h.crc) {
+			break
+		}
+	}
+
+	return read
+}
+
+// Returns position on the device of block first of the line in slot.
+func (c *Cache) lineOffset(slot, first int) int64 {
+	return c.dataOffset + (int64(slot)*lineBlocks+int64(first))*c.blockSize
+}
+
+// Queues insertion of blocks from data starting at block first of the object
+// with key of volume. Data are copied. Partial block at the end is ignored.
+func (c *Cache) insert(volume uint64, key, first int64, data []byte) {
+	blocks := int64(len(data)) / c.blockSize
+
+	for blocks > 0 {
+		i := first % lineBlocks
+		n := lineBlocks - i
+		if n > blocks {
+			n = blocks
+		}
+
+		buf := c.pool.Get().([]byte)
+		size := n * c.blockSize
+		copy(buf, data[:size])
+
+		// Jobs are queued only with mutex held, so the space found
+		// stays free until the send. The line is allocated only then,
+		// a dropped job does not evict anything.
+		c.mutex.Lock()
+		if len(c.writes) < cap(c.writes) {
+			slot := c.allocate(lineKey{volume, key, first / lineBlocks})
+			c.writes <- writeJob{slot: slot, gen: c.lines[slot].gen, first: int(i), data: buf[:size]}
+		} else {
+			c.pool.Put(buf[:cap(buf)])
+		}
+		c.mutex.Unlock()
+
+		first += n
+		blocks -= n
+		data = data[size:]
+	}
+}
+
+// Writes queued blocks to the device and marks them valid in the index.
+func (c *Cache) writer() {
+	for j := range c.writes {
+		_, err := c.file.WriteAt(j.data, c.lineOffset(j.slot, j.first))
+		if err != nil {
+			log.Info().Err(err).Msg("Disk cache write failed.")
+			c.pool.Put(j.data[:cap(j.data)])
+			continue
+		}
+
+		c.mutex.Lock()
+		l := &c.lines[j.slot]
+		if l.used && l.gen == j.gen {
+			for i := 0; i < len(j.data)/int(c.blockSize); i++ {
+				b := j.data[int64(i)*c.blockSize : int64(i+1)*c.blockSize]
+				l.crc[j.first+i] = crc32.Checksum(b, crcTable)
+				l.valid |= 1 << uint(j.first+i)
+			}
+			c.writeEntry(j.slot)
+		}
+		c.mutex.Unlock()
+
+		c.pool.Put(j.data[:cap(j.data)])
+	}
+}
+
+// Uploads the object and inserts it into the cache. Lines of the previous
+// object with the same key are dropped before.
+func (v *Volume) Upload(key int64, buf []byte) error {
+	if key < 0 {
+		return v.instance.Upload(key, buf)
+	}
+
+	if err := v.cache.invalidate(v.volume, key, false); err != nil {
+		return err
+	}
+
+	if err := v.instance.Upload(key, buf); err != nil {
+		return err
+	}
+
+	v.cache.insert(v.volume, key, 0, buf)
+
+	return nil
+}
+
+// Downloads data like DownloadAtV.
+func (v *Volume) DownloadAt(key int64, buf []byte, offset int64) error {
+	return v.DownloadAtV(key, [][]byte{buf}, offset)
+}
+
+// Downloads data into bufs. Cached blocks at the beginning and at the end of
+// the range are read from the cache, the rest is downloaded by one request
+// and inserted into the cache. Negative keys, i.e. checkpoints, and unaligned
+// requests bypass the cache.
+func (v *Volume) DownloadAtV(key int64, bufs [][]byte, offset int64) error {
+	c := v.cache
+
+	if key < 0 || offset%c.blockSize != 0 {
+		return v.instance.DownloadAtV(key, bufs, offset)
+	}
+
+	var size int64
+	for _, b := range bufs {
+		size += int64(len(b))
+	}
+
+	// Only whole blocks are served from the cache.
+	first := offset / c.blockSize
+	blocks := int(size / c.blockSize)
+
+	head := 0
+	if n, hits := c.lookup(v.volume, key, first, blocks, false); n > 0 {
+		data := make([]byte, int64(n)*c.blockSize)
+		head = c.read(hits, data, false)
+		scatter(bufs, 0, data[:int64(head)*c.blockSize])
+	}
+
+	// The partial block at the end is never cached, hence the tail can
+	// be served from the cache only when there is none.
+	tail := 0
+	if head < blocks && size%c.blockSize == 0 {
+		last := first + int64(blocks) - 1
+		if n, hits := c.lookup(v.volume, key, last, blocks-head, true); n > 0 {
+			data := make([]byte, int64(n)*c.blockSize)
+			tail = c.read(hits, data, true)
+			data = data[int64(n-tail)*c.blockSize:]
+			scatter(bufs, int64(blocks-tail)*c.blockSize, data)
+		}
+	}
+
+	missOffset := int64(head) * c.blockSize
+	missSize := size - missOffset - int64(tail)*c.blockSize
+	if missSize == 0 {
+		return nil
+	}
+
+	missing := slice(bufs, missOffset, missSize)
+	if err := v.instance.DownloadAtV(key, missing, offset+missOffset); err != nil {
+		return err
+	}
+
+	data := gather(missing, missSize)
+	c.insert(v.volume, key, first+int64(head), data)
+
+	return nil
+}
+
+// Returns size of the object from the backend.
+func (v *Volume) GetObjectSize(key int64) (int64, error) {
+	return v.instance.GetObjectSize(key)
+}
+
+// Drops the object and its successors from the cache and deletes them from the
+// backend.
+func (v *Volume) DeleteKeyAndSuccessors(key int64) error {
+	if err := v.cache.invalidate(v.volume, key, true); err != nil {
+		return err
+	}
+
+	return v.instance.DeleteKeyAndSuccessors(key)
+}
+
+// Returns sub-slices of bufs covering size bytes starting at offset, as if bufs
+// were one continuous buffer.
+func slice(bufs [][]byte, offset, size int64) [][]byte {
+	sliced := make([][]byte, 0, 1)
+
+	for _, b := range bufs {
+		if size == 0 {
+			break
+		}
+
+		if offset >= int64(len(b)) {
+			offset -= int64(len(b))
+			continue
+		}
+
+		b = b[offset:]
+		offset = 0
+
+		if int64(len(b)) > size {
+			b = b[:size]
+		}
+
+		sliced = append(sliced, b)
+		size -= int64(len(b))
+	}
+
+	return sliced
+}
+
+// Copies data into bufs starting at offset.
+func scatter(bufs [][]byte, offset int64, data []byte) {
+	for _, b := range slice(bufs, offset, int64(len(data))) {
+		data = data[copy(b, data):]
+	}
+}
+
+// Returns bufs as one continuous buffer. It is copied only when there are more
+// bufs.
+func gather(bufs [][]byte, size int64) []byte {
+	if len(bufs) == 1 {
+		return bufs[0]
+	}
+
+	data := make([]byte, 0, size)
+	for _, b := range bufs {
+		data = append(data, b...)
+	}
+
+	return data
+}
@@ -0,0 +1,229 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package objproxy
+
+import (
+	"math/bits"
+	"sync"
+	"time"
+)
+
+const (
+	// Requests are divided by size into classes of power of four sizes.
+	// Latencies are compared only within one class, since large objects
+	// take longer because of the transfer, not because of the overload.
+	limiterClasses = 16
+
+	// Number of samples of one class after which its minimal latency is
+	// recomputed. The baseline is the minimum of the last two windows, so
+	// it follows the backend when it gets permanently slower.
+	limiterWindow = 256
+
+	// Number of samples of one class needed before its latencies are
+	// compared with the baseline.
+	limiterWarmup = 16
+
+	// Multiplicative decrease of the limit on overload.
+	limiterBackoff = 0.9
+)
+
+// Parameters of the adaptive concurrency. The limit moves between Min and the
+// number of workers. Requests slower than Tolerance times the minimal recent
+// latency signal the overload. Zero Min means fixed concurrency.
+type LimitPolicy struct {
+	Min       int
+	Tolerance float64
+}
+
+// Current state of the limiter of one direction.
+type Concurrency struct {
+	// Maximal number of requests in flight.
+	Limit int
+
+	// Number of requests in flight.
+	InFlight int
+}
+
+// Limiter of requests in flight in one direction, i.e. uploads or downloads.
+// The limit is tuned by AIMD, which is additive increase and multiplicative
+// decrease like in TCP congestion control. Every request completing within
+// tolerance times the minimal recent latency of requests of similar size
+// increases the limit by 1/limit, i.e. by one per round trip. A failed or slow
+// request decreases it by limiterBackoff at most once per round trip. Until the
+// first decrease the limit grows by one per request, so it reaches the capacity
+// of the backend quickly. Like this each backend gets as much concurrency as it
+// can handle without queueing requests internally.
+type limiter struct {
+	min, max  float64
+	tolerance float64
+
+	mutex sync.Mutex
+	cond  *sync.Cond
+	limit float64
+
+	// Slots taken by workers and requests being served by them.
+	slots int
+	busy  int
+
+	slowStart bool
+
+	// Completions since the last decrease.
+	sinceDecrease int
+
+	classes [limiterClasses]latencyClass
+}
+
+// Minimal latencies of one size class.
+type latencyClass struct {
+	current  time.Duration
+	previous time.Duration
+	samples  int
+}
+
+// Returns limiter with the limit between min and max. Returns nil, which never
+// limits, when min is not smaller than max or it is zero.
+func newLimiter(min, max int, tolerance float64) *limiter {
+	if min <= 0 || min >= max {
+		return nil
+	}
+
+	l := &limiter{
+		min:       float64(min),
+		max:       float64(max),
+		tolerance: tolerance,
+		limit:     float64(min),
+		slowStart: true,
+	}
+	l.cond = sync.NewCond(&l.mutex)
+
+	return l
+}
+
+// Waits until the number of requests in flight is under the limit and takes a
+// slot. The slot is returned by release() or cancel().
+func (l *limiter) acquire() {
+	if l == nil {
+		return
+	}
+
+	l.mutex.Lock()
+	defer l.mutex.Unlock()
+
+	for l.slots >= int(l.limit) {
+		l.cond.Wait()
+	}
+	l.slots++
+}
+
+// Marks the slot as serving a request.
+func (l *limiter) start() {
+	if l == nil {
+		return
+	}
+
+	l.mutex.Lock()
+	l.busy++
+	l.mutex.Unlock()
+}
+
+// Returns the slot without serving any request.
+func (l *limiter) cancel() {
+	if l == nil {
+		return
+	}
+
+	l.mutex.Lock()
+	l.slots--
+	l.mutex.Unlock()
+
+	l.cond.Signal()
+}
+
+// Returns the slot of a request of size bytes which took latency and finished
+// with err and adjusts the limit.
+func (l *limiter) release(size int, latency time.Duration, err error) {
+	if l == nil {
+		return
+	}
+
+	l.mutex.Lock()
+	defer l.mutex.Unlock()
+
+	busy := l.busy
+	l.slots--
+	l.busy--
+	l.sinceDecrease++
+
+	baseline := l.classes[sizeClass(size)].add(latency)
+	overloaded := err != nil || (baseline > 0 && float64(latency) > l.tolerance*float64(baseline))
+
+	switch {
+	case overloaded:
+		// Requests in flight during the previous decrease complete
+		// within one round trip, they must not decrease it again.
+		if l.sinceDecrease >= int(l.limit) {
+			l.limit *= limiterBackoff
+			l.sinceDecrease = 0
+			l.slowStart = false
+		}
+	case 2*busy < int(l.limit):
+		// The limit is not reached, there is no evidence the backend
+		// can handle more.
+	case l.slowStart:
+		l.limit++
+	default:
+		l.limit += 1 / l.limit
+	}
+
+	if l.limit < l.min {
+		l.limit = l.min
+	}
+	if l.limit > l.max {
+		l.limit = l.max
+	}
+
+	l.cond.Broadcast()
+}
+
+// Returns current state of the limiter.
+func (l *limiter) concurrency() Concurrency {
+	l.mutex.Lock()
+	defer l.mutex.Unlock()
+
+	return Concurrency{Limit: int(l.limit), InFlight: l.busy}
+}
+
+// Records latency and returns the baseline of the class. Returns zero when
+// there are not enough samples yet. The first window has no previous minimum,
+// its baseline is the minimum so far.
+func (c *latencyClass) add(latency time.Duration) time.Duration {
+	if c.samples%limiterWindow == 0 {
+		c.previous = c.current
+		c.current = latency
+	}
+	c.samples++
+
+	if latency < c.current {
+		c.current = latency
+	}
+
+	if c.samples <= limiterWarmup {
+		return 0
+	}
+
+	if c.samples > limiterWindow && c.previous < c.current {
+		return c.previous
+	}
+
+	return c.current
+}
+
+// Returns size class of request with size bytes.
+func sizeClass(size int) int {
+	class := bits.Len(uint(size)) / 2
+	if class >= limiterClasses {
+		class = limiterClasses - 1
+	}
+
+	return class
+}
@@ -1,7 +1,7 @@
 // Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
 
 // Package objproxy is a proxy for ObjectUploadDownloaderAt which performs
-// prioritization of various requests.
+// scheduling of various classes of requests and retries the failed ones.
 package objproxy
 
 import (
@@ -18,6 +18,10 @@ type ObjectUploadDownloaderAt interface {
 	// identified by key. The length of buf is the legth of requested data.
 	DownloadAt(key int64, buf []byte, offset int64) error
 
+	// Like DownloadAt but the data are scattered into bufs, which are
+	// filled in order as if they were one continuous buffer.
+	DownloadAtV(key int64, bufs [][]byte, offset int64) error
+
 	// Returns size in bytes of object identified by key. Needed only for
 	// garbage collection and extent map recovery. Otherwise can have empty
 	// implementation.
@@ -29,125 +33,209 @@ type ObjectUploadDownloaderAt interface {
 	DeleteKeyAndSuccessors(key int64) error
 }
 
-// Proxy for the backend storage which prioritizes requests. Requests coming to
-// the priority channels are handled first. Like this requests from low
-// priority operations like garbage collection do not slow down normal
-// operation.
+// Proxy for the backend storage which schedules requests. Every request has a
+// class and workers are shared by the classes with waiting requests according
+// to their weights, see scheduler. Like this requests from background
+// operations like garbage collection do not slow down normal operation, but
+// they are not starved either.
+//
+// Multiple proxies, each with its own instance, can share one pool of workers.
+// This is the case when multiple volumes are served by one process.
 type ObjectProxy struct {
 	Instance ObjectUploadDownloaderAt
 
+	workers *Workers
+}
+
+// Pool of go routines serving requests of all proxies created by Proxy().
+type Workers struct {
 	// Number of go routines to spawn for handling upload requests and
 	// download requests.
 	uploaders   int
 	downloaders int
 
-	// Timeout after which low priority request can be served.
+	// Time after which a waiting request is served before requests of all
+	// other classes.
 	idleTimeout time.Duration
 
-	// Internal channels.
-	uploads       chan request
-	downloads     chan request
-	uploadsPrio   chan request
-	downloadsPrio chan request
+	// Schedulers of uploads and downloads.
+	uploads   *scheduler
+	downloads *scheduler
+
+	// Retries of failed requests of all proxies.
+	retry *retrier
+
+	// Limiters of uploads and downloads in flight. Nil when the
+	// concurrency is fixed to the number of workers.
+	uploadLimit   *limiter
+	downloadLimit *limiter
 }
 
-// Request is internal structure for wrapping the communication into channels.
+// Request is internal structure for passing the request to the workers.
 type request struct {
+	// Instance of the proxy which issued the request.
+	instance ObjectUploadDownloaderAt
+
+	class  Class
+	queued time.Time
+
 	key    int64
 	data   []byte
 	offset int64
 	done   chan error
+
+	// Scattered destination of vectored downloads. Data is unused then.
+	segments [][]byte
 }
 
 // Return new instance of the proxy which can be directly used. It immediately
-// spawns go routines for upload and download workers.
+// spawns go routines for upload and download workers, which are used just by
+// this proxy.
 func New(storeInstance ObjectUploadDownloaderAt, uploaders, downloaders int,
-	idleTimeout time.Duration) ObjectProxy {
+	idleTimeout time.Duration, policy RetryPolicy, limits LimitPolicy) ObjectProxy {
+
+	return NewWorkers(uploaders, downloaders, idleTimeout, policy, limits).Proxy(storeInstance)
+}
 
-	uploads := make(chan request)
-	downloads := make(chan request)
-	uploadsPrio := make(chan request)
-	downloadsPrio := make(chan request)
+// Returns new pool of workers retrying failed requests according to policy.
+// Number of uploaders and downloaders is the upper bound of requests in flight,
+// the actual number is adapted according to limits. It immediately spawns go
+// routines for upload and download workers.
+func NewWorkers(uploaders, downloaders int, idleTimeout time.Duration,
+	policy RetryPolicy, limits LimitPolicy) *Workers {
 
-	s := ObjectProxy{
-		Instance:      storeInstance,
+	w := &Workers{
 		uploaders:     uploaders,
 		downloaders:   downloaders,
 		idleTimeout:   idleTimeout,
-		uploads:       uploads,
-		downloads:     downloads,
-		uploadsPrio:   uploadsPrio,
-		downloadsPrio: downloadsPrio,
+		retry:         newRetrier(policy),
+		uploadLimit:   newLimiter(limits.Min, uploaders, limits.Tolerance),
+		downloadLimit: newLimiter(limits.Min, downloaders, limits.Tolerance),
 	}
+	w.uploads = newScheduler(uploaders, idleTimeout, w.uploadLimit)
+	w.downloads = newScheduler(downloaders, idleTimeout, w.downloadLimit)
 
-	for i := 0; i < s.uploaders; i++ {
-		go s.uploadWorker()
+	for i := 0; i < w.uploaders; i++ {
+		go w.uploadWorker()
 	}
 
-	for i := 0; i < s.downloaders; i++ {
-		go s.downloadWorker()
+	for i := 0; i < w.downloaders; i++ {
+		go w.downloadWorker()
 	}
 
-	return s
+	return w
 }
 
-// Proxy function for uploading the object with key. It selects the right
-// channel according to prio and waits for reply.
-func (p *ObjectProxy) Upload(key int64, body []byte, prio bool) error {
-	c := p.uploads
-	if prio {
-		c = p.uploadsPrio
+// Returns proxy for storeInstance served by the workers.
+func (w *Workers) Proxy(storeInstance ObjectUploadDownloaderAt) ObjectProxy {
+	return ObjectProxy{
+		Instance: storeInstance,
+		workers:  w,
 	}
+}
 
-	done := make(chan error)
-	c <- request{key: key, data: body, done: done}
-	return <-done
+// Stops all workers. Requests issued after Close() block forever.
+func (w *Workers) Close() {
+	w.uploads.close()
+	w.downloads.close()
 }
 
-// Proxy function for downloading the object with key. It selects the right
-// channel according to prio and waits for reply.
-func (p *ObjectProxy) Download(key int64, chunk []byte, offset int64, prio bool) error {
-	c := p.downloads
-	if prio {
-		c = p.downloadsPrio
+// Returns current concurrency of uploads and downloads.
+func (w *Workers) Concurrency() (uploads, downloads Concurrency) {
+	uploads = Concurrency{Limit: w.uploaders}
+	if w.uploadLimit != nil {
+		uploads = w.uploadLimit.concurrency()
+	}
+
+	downloads = Concurrency{Limit: w.downloaders}
+	if w.downloadLimit != nil {
+		downloads = w.downloadLimit.concurrency()
 	}
 
-	done := make(chan error)
-	c <- request{key, chunk, offset, done}
-	return <-done
+	return uploads, downloads
 }
 
-// Generic function for prioritization used by both, uploader and downloader workers.
-func (p *ObjectProxy) receiveRequest(prio chan request, normal chan request) request {
-	var r request
+// Returns the workers serving the proxy.
+func (p *ObjectProxy) Workers() *Workers {
+	return p.workers
+}
 
-	select {
-	case r = <-prio:
-	//case <-time.NewTicker(p.idleTimeout).C:
-	default:
-		select {
-		case r = <-prio:
-		case r = <-normal:
-		}
-	}
+// Proxy function for uploading the object with key. It enqueues the request
+// to the scheduler under class and waits for reply. Failed uploads are retried
+// according to the retry policy, the error is returned once it gives up.
+func (p *ObjectProxy) Upload(key int64, body []byte, class Class) error {
+	return p.send(p.workers.uploads, request{instance: p.Instance, class: class, key: key, data: body})
+}
+
+// Proxy function for downloading the object with key. It enqueues the request
+// to the scheduler under class and waits for reply. Failed downloads are
+// retried like uploads.
+func (p *ObjectProxy) Download(key int64, chunk []byte, offset int64, class Class) error {
+	return p.send(p.workers.downloads, request{instance: p.Instance, class: class, key: key, data: chunk, offset: offset})
+}
+
+// Proxy function for downloading the object with key into scattered segments.
+// It enqueues the request to the scheduler under class and waits for reply.
+// Failed downloads are retried like uploads.
+func (p *ObjectProxy) DownloadV(key int64, segments [][]byte, offset int64, class Class) error {
+	return p.send(p.workers.downloads, request{instance: p.Instance, class: class, key: key, offset: offset, segments: segments})
+}
 
-	return r
+// Sends r to the workers through s and waits for reply. Retries are sent from
+// the calling go routine, so workers never sleep in a backoff.
+func (p *ObjectProxy) send(s *scheduler, r request) error {
+	return p.workers.retry.do(func() error {
+		r.done = make(chan error, 1)
+		s.push(r)
+		return <-r.done
+	})
 }
 
-// Upload worker just calls Upload() on the instance provided in New().
-func (p *ObjectProxy) uploadWorker() {
+// Upload worker just calls Upload() on the instance of the request. The slot
+// of the limiter is taken before the request is scheduled, so the waiting
+// workers do not hold requests and the scheduling is kept.
+func (w *Workers) uploadWorker() {
 	for {
-		r := p.receiveRequest(p.uploadsPrio, p.uploads)
-		err := p.Instance.Upload(r.key, r.data)
+		w.uploadLimit.acquire()
+		r, ok := w.uploads.pop()
+		if !ok {
+			w.uploadLimit.cancel()
+			return
+		}
+		w.uploadLimit.start()
+		start := time.Now()
+		err := r.instance.Upload(r.key, r.data)
+		w.uploadLimit.release(len(r.data), time.Since(start), err)
+		w.uploads.done(r.class)
 		r.done <- err
 	}
 }
 
-// Upload worker just calls Download() on the instance provided in New().
-func (p *ObjectProxy) downloadWorker() {
+// Download worker just calls DownloadAt() or DownloadAtV() on the instance of
+// the request. It is limited like the upload worker.
+func (w *Workers) downloadWorker() {
 	for {
-		r := p.receiveRequest(p.downloadsPrio, p.downloads)
-		err := p.Instance.DownloadAt(r.key, r.data, r.offset)
+		var err error
+		w.downloadLimit.acquire()
+		r, ok := w.downloads.pop()
+		if !ok {
+			w.downloadLimit.cancel()
+			return
+		}
+		w.downloadLimit.start()
+		start := time.Now()
+		size := len(r.data)
+		if r.segments != nil {
+			err = r.instance.DownloadAtV(r.key, r.segments, r.offset)
+			size = 0
+			for _, s := range r.segments {
+				size += len(s)
+			}
+		} else {
+			err = r.instance.DownloadAt(r.key, r.data, r.offset)
+		}
+		w.downloadLimit.release(size, time.Since(start), err)
+		w.downloads.done(r.class)
 		r.done <- err
 	}
 }
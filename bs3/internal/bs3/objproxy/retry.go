@@ -0,0 +1,189 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package objproxy
+
+import (
+	"errors"
+	"math/rand"
+	"sync"
+	"time"
+)
+
+// Returned without contacting the backend when the circuit breaker is open.
+var ErrCircuitOpen = errors.New("objproxy: backend unavailable, circuit open")
+
+// Parameters of retrying failed requests. Zero value means no retries.
+type RetryPolicy struct {
+	// Backoff of the first retry and the maximal backoff. Backoffs grow
+	// with decorrelated jitter, i.e. every backoff is random between
+	// BaseDelay and three times the previous one.
+	BaseDelay time.Duration
+	MaxDelay  time.Duration
+
+	// Time after which the request is not retried anymore and the last
+	// error is returned.
+	Deadline time.Duration
+
+	// Maximal number of retries as a fraction of all requests. When the
+	// backend fails persistently, retries would just multiply its load.
+	Budget float64
+
+	// Number of consecutive failures opening the circuit breaker and time
+	// for which it stays open. Requests fail immediately while the circuit
+	// is open. After the cooldown one request probes the backend and closes
+	// the circuit when it succeeds. Zero threshold disables the breaker.
+	BreakerThreshold int
+	BreakerCooldown  time.Duration
+}
+
+const (
+	// Maximal number of retries which can be saved in the budget.
+	retryMaxTokens = 64
+)
+
+// Retry state shared by all requests of one pool of workers, i.e. of one
+// backend.
+type retrier struct {
+	policy RetryPolicy
+
+	mutex  sync.Mutex
+	random *rand.Rand
+	tokens float64
+
+	// Circuit breaker state.
+	failures  int
+	openUntil time.Time
+	probing   bool
+}
+
+func newRetrier(policy RetryPolicy) *retrier {
+	return &retrier{
+		policy: policy,
+		random: rand.New(rand.NewSource(time.Now().UnixNano())),
+		tokens: retryMaxTokens,
+	}
+}
+
+// Executes op and retries it according to the policy until it succeeds, the
+// deadline expires, the budget is exhausted or the circuit opens. Returns the
+// last error of op or ErrCircuitOpen.
+func (r *retrier) do(op func() error) error {
+	deadline := time.Now().Add(r.policy.Deadline)
+	backoff := r.policy.BaseDelay
+
+	r.deposit()
+
+	for {
+		probe, err := r.allow()
+		if err != nil {
+			return err
+		}
+
+		err = op()
+		r.report(err, probe)
+		if err == nil {
+			return nil
+		}
+
+		backoff = r.next(backoff)
+		if time.Now().Add(backoff).After(deadline) || !r.withdraw() {
+			return err
+		}
+
+		time.Sleep(backoff)
+	}
+}
+
+// Returns backoff following prev, see RetryPolicy.
+func (r *retrier) next(prev time.Duration) time.Duration {
+	base := r.policy.BaseDelay
+	if base <= 0 {
+		return 0
+	}
+
+	// Prev is below base when MaxDelay is, the interval would be empty.
+	if prev < base {
+		prev = base
+	}
+
+	r.mutex.Lock()
+	backoff := base + time.Duration(r.random.Int63n(int64(3*prev-base)+1))
+	r.mutex.Unlock()
+
+	if backoff > r.policy.MaxDelay {
+		backoff = r.policy.MaxDelay
+	}
+
+	return backoff
+}
+
+// Adds one request to the retry budget.
+func (r *retrier) deposit() {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	r.tokens += r.policy.Budget
+	if r.tokens > retryMaxTokens {
+		r.tokens = retryMaxTokens
+	}
+}
+
+// Takes one retry from the budget. Returns false when it is exhausted.
+func (r *retrier) withdraw() bool {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	if r.tokens < 1 {
+		return false
+	}
+	r.tokens--
+
+	return true
+}
+
+// Returns whether the request can be sent to the backend and whether it is the
+// probe of the half open circuit.
+func (r *retrier) allow() (bool, error) {
+	if r.policy.BreakerThreshold == 0 {
+		return false, nil
+	}
+
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	if r.failures < r.policy.BreakerThreshold {
+		return false, nil
+	}
+
+	if r.probing || time.Now().Before(r.openUntil) {
+		return false, ErrCircuitOpen
+	}
+
+	r.probing = true
+
+	return true, nil
+}
+
+// Updates the circuit breaker with the result of the request.
+func (r *retrier) report(err error, probe bool) {
+	if r.policy.BreakerThreshold == 0 {
+		return
+	}
+
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	if probe {
+		r.probing = false
+	}
+
+	if err == nil {
+		r.failures = 0
+		return
+	}
+
+	r.failures++
+	if r.failures >= r.policy.BreakerThreshold {
+		r.openUntil = time.Now().Add(r.policy.BreakerCooldown)
+	}
+}
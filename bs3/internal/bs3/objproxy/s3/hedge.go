@@ -0,0 +1,209 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package s3
+
+import (
+	"context"
+	"sort"
+	"sync"
+	"time"
+)
+
+const (
+	// Number of the latest GET latencies the percentile is computed from.
+	hedgeWindow = 1024
+
+	// Number of GETs after which the percentile is recomputed. The
+	// percentile is not used before the first recomputation.
+	hedgeRecompute = 64
+
+	// Maximal number of hedges which can be saved in the budget. It bounds
+	// the burst of hedges after a calm period.
+	hedgeMaxTokens = 16
+
+	// Larger GETs, like the checkpoint download, are never hedged. Their
+	// latency is dominated by the transfer, not by a stall.
+	hedgeMaxSize = 8 << 20
+)
+
+// Hedging of GET requests. When a GET takes longer than the configured
+// percentile of recent GET latencies, a duplicate GET is sent and the one
+// finishing first wins. The loser is cancelled. The number of duplicates is
+// limited by a budget, which is a fraction of all GETs, so a slow backend is
+// not overloaded by hedges. One hedger is shared by all S3 instances created
+// by WithPrefix, since they talk to the same backend.
+type hedger struct {
+	// Percentile of latencies after which the hedge is sent, e.g. 0.99.
+	percentile float64
+
+	// Budget of hedges as a fraction of all GETs, e.g. 0.05.
+	budget float64
+
+	// Minimal delay before the hedge.
+	minDelay time.Duration
+
+	mutex     sync.Mutex
+	latencies [hedgeWindow]time.Duration
+	samples   int
+	threshold time.Duration
+	tokens    float64
+}
+
+// Returns hedger or nil when hedging is disabled.
+func newHedger(percentile, budget float64, minDelay time.Duration) *hedger {
+	if percentile <= 0 || percentile >= 1 || budget <= 0 {
+		return nil
+	}
+
+	return &hedger{
+		percentile: percentile,
+		budget:     budget,
+		minDelay:   minDelay,
+	}
+}
+
+// Records latency of a finished GET and recomputes the threshold from time
+// to time.
+func (h *hedger) record(latency time.Duration) {
+	h.mutex.Lock()
+	defer h.mutex.Unlock()
+
+	h.latencies[h.samples%hedgeWindow] = latency
+	h.samples++
+
+	if h.samples%hedgeRecompute != 0 {
+		return
+	}
+
+	n := h.samples
+	if n > hedgeWindow {
+		n = hedgeWindow
+	}
+
+	sorted := make([]time.Duration, n)
+	copy(sorted, h.latencies[:n])
+	sort.Slice(sorted, func(i, j int) bool { return sorted[i] < sorted[j] })
+
+	h.threshold = sorted[int(float64(n-1)*h.percentile)]
+	if h.threshold < h.minDelay {
+		h.threshold = h.minDelay
+	}
+}
+
+// Returns delay after which the GET should be hedged and adds the GET to the
+// budget. Returns zero when there are not enough samples yet.
+func (h *hedger) delay() time.Duration {
+	h.mutex.Lock()
+	defer h.mutex.Unlock()
+
+	h.tokens += h.budget
+	if h.tokens > hedgeMaxTokens {
+		h.tokens = hedgeMaxTokens
+	}
+
+	return h.threshold
+}
+
+// Takes one hedge from the budget. Returns false when the budget is exhausted.
+func (h *hedger) take() bool {
+	h.mutex.Lock()
+	defer h.mutex.Unlock()
+
+	if h.tokens < 1 {
+		return false
+	}
+	h.tokens--
+
+	return true
+}
+
+// Executes get downloading into bufs and hedges it when it is slow. The hedge
+// downloads into its own memory, which is copied into bufs only when the hedge
+// wins, after the cancelled primary GET stopped writing into bufs.
+func (h *hedger) do(bufs [][]byte, get func(ctx context.Context, bufs [][]byte) error) error {
+	var size int
+	for _, b := range bufs {
+		size += len(b)
+	}
+
+	if h == nil || size > hedgeMaxSize {
+		return get(context.Background(), bufs)
+	}
+
+	start := time.Now()
+	delay := h.delay()
+	if delay == 0 {
+		err := get(context.Background(), bufs)
+		if err == nil {
+			h.record(time.Since(start))
+		}
+		return err
+	}
+
+	ctx, cancel := context.WithCancel(context.Background())
+	defer cancel()
+
+	primary := make(chan error, 1)
+	go func() {
+		primary <- get(ctx, bufs)
+	}()
+
+	timer := time.NewTimer(delay)
+	defer timer.Stop()
+
+	select {
+	case err := <-primary:
+		if err == nil {
+			h.record(time.Since(start))
+		}
+		return err
+	case <-timer.C:
+	}
+
+	if !h.take() {
+		err := <-primary
+		if err == nil {
+			h.record(time.Since(start))
+		}
+		return err
+	}
+
+	scratch := make([]byte, size)
+
+	hedgeCtx, hedgeCancel := context.WithCancel(context.Background())
+	defer hedgeCancel()
+
+	hedge := make(chan error, 1)
+	go func() {
+		hedge <- get(hedgeCtx, [][]byte{scratch})
+	}()
+
+	select {
+	case err := <-primary:
+		if err == nil {
+			h.record(time.Since(start))
+			return nil
+		}
+		if err = <-hedge; err != nil {
+			return err
+		}
+	case err := <-hedge:
+		if err != nil {
+			return <-primary
+		}
+		cancel()
+		if <-primary == nil {
+			// The primary finished before it noticed the
+			// cancellation, bufs are complete.
+			h.record(time.Since(start))
+			return nil
+		}
+	}
+
+	h.record(time.Since(start))
+	for _, b := range bufs {
+		scratch = scratch[copy(b, scratch):]
+	}
+
+	return nil
+}
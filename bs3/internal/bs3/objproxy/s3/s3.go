@@ -6,9 +6,12 @@ package s3
 
 import (
 	"bytes"
+	"context"
 	"fmt"
+	"io"
 	"net"
 	"net/http"
+	"strings"
 	"time"
 
 	"github.com/aws/aws-sdk-go/aws"
@@ -41,6 +44,13 @@ type S3 struct {
 	downloader *s3manager.Downloader
 	client     *s3.S3
 	bucket     string
+
+	// Prefix of all keys. It separates volumes sharing one bucket. Empty
+	// for a volume owning the whole bucket.
+	prefix string
+
+	// Hedging of slow GETs. Nil when hedging is disabled.
+	hedge *hedger
 }
 
 // Options to use in New() function due to high number of parameters. There is
@@ -52,6 +62,13 @@ type Options struct {
 	AccessKey string
 	SecretKey string
 	PartSize  int64
+
+	// GETs slower than HedgePercentile of recent GETs, but at least
+	// HedgeMinDelay, are duplicated. At most HedgeBudget fraction of GETs
+	// is duplicated. Zero percentile disables hedging.
+	HedgePercentile float64
+	HedgeBudget     float64
+	HedgeMinDelay   time.Duration
 }
 
 // Helper struct used for tuning the http connection.
@@ -94,7 +111,7 @@ func newHTTPClientWithSettings(httpSettings httpClientSettings) *http.Client {
 func (s *S3) Upload(key int64, buf []byte) error {
 	_, err := s.uploader.Upload(&s3manager.UploadInput{
 		Bucket: aws.String(s.bucket),
-		Key:    aws.String(encode(key)),
+		Key:    aws.String(s.encode(key)),
 		Body:   bytes.NewReader(buf),
 	})
 
@@ -105,7 +122,7 @@ func (s *S3) Upload(key int64, buf []byte) error {
 func (s *S3) GetObjectSize(key int64) (int64, error) {
 	head, err := s.client.HeadObject(&s3.HeadObjectInput{
 		Bucket: aws.String(s.bucket),
-		Key:    aws.String(encode(key)),
+		Key:    aws.String(s.encode(key)),
 	})
 
 	var size int64
@@ -118,24 +135,77 @@ func (s *S3) GetObjectSize(key int64) (int64, error) {
 
 // DownloadAt function implemented through s3 api.
 func (s *S3) DownloadAt(key int64, buf []byte, offset int64) error {
-	to := offset + int64(len(buf)) - 1
+	return s.DownloadAtV(key, [][]byte{buf}, offset)
+}
+
+// DownloadAtV function implemented through s3 api. The response body is
+// written directly into bufs without any intermediate buffer, unless the GET
+// is hedged and the hedge wins.
+func (s *S3) DownloadAtV(key int64, bufs [][]byte, offset int64) error {
+	return s.hedge.do(bufs, func(ctx context.Context, bufs [][]byte) error {
+		return s.get(ctx, key, bufs, offset)
+	})
+}
+
+// Downloads range of the object with key starting at offset into bufs. The
+// request is aborted when ctx is cancelled.
+func (s *S3) get(ctx context.Context, key int64, bufs [][]byte, offset int64) error {
+	var size int64
+	for _, b := range bufs {
+		size += int64(len(b))
+	}
+
+	to := offset + size - 1
 	rng := fmt.Sprintf("bytes=%d-%d", offset, to)
-	b := aws.NewWriteAtBuffer(buf)
 
-	_, err := s.downloader.Download(b, &s3.GetObjectInput{
+	var w io.WriterAt = segmentsWriterAt(bufs)
+	if len(bufs) == 1 {
+		w = aws.NewWriteAtBuffer(bufs[0])
+	}
+
+	_, err := s.downloader.DownloadWithContext(ctx, w, &s3.GetObjectInput{
 		Bucket: aws.String(s.bucket),
-		Key:    aws.String(encode(key)),
+		Key:    aws.String(s.encode(key)),
 		Range:  &rng,
 	})
 
 	return err
 }
 
+// Implementation of io.WriterAt scattering data into segments which are
+// treated as one continuous buffer.
+type segmentsWriterAt [][]byte
+
+func (w segmentsWriterAt) WriteAt(p []byte, off int64) (int, error) {
+	n := 0
+	for _, s := range w {
+		if len(p) == 0 {
+			break
+		}
+
+		if off >= int64(len(s)) {
+			off -= int64(len(s))
+			continue
+		}
+
+		c := copy(s[off:], p)
+		p = p[c:]
+		n += c
+		off = 0
+	}
+
+	if len(p) > 0 {
+		return n, io.ErrShortWrite
+	}
+
+	return n, nil
+}
+
 // Delete function implemented through s3 api.
 func (s *S3) Delete(key int64) error {
 	_, err := s.client.DeleteObject(&s3.DeleteObjectInput{
 		Bucket: aws.String(s.bucket),
-		Key:    aws.String(encode(key)),
+		Key:    aws.String(s.encode(key)),
 	})
 
 	return err
@@ -144,6 +214,7 @@ func (s *S3) Delete(key int64) error {
 func New(o Options) (*S3, error) {
 	s := new(S3)
 	s.bucket = o.Bucket
+	s.hedge = newHedger(o.HedgePercentile, o.HedgeBudget, o.HedgeMinDelay)
 
 	// For the best possible performance (throughput close to 10GB/s) it
 	// should be tuned according to the object backend.
@@ -182,7 +253,8 @@ func New(o Options) (*S3, error) {
 	// exception is downloading/uploading the extent map during initial
 	// recover or final map upload. This should be tuned if your map is
 	// huge (= huge device) and you have fast network and don't want to
-	// wait.
+	// wait. Concurrency of whole requests is adapted to the backend by the
+	// object proxy.
 	s.uploader.Concurrency = 1
 	s3manager.WithUploaderRequestOptions(request.Option(func(r *request.Request) {
 		r.HTTPRequest.Header.Add("X-Amz-Content-Sha256", "UNSIGNED-PAYLOAD")
@@ -194,6 +266,15 @@ func New(o Options) (*S3, error) {
 	return s, err
 }
 
+// Returns S3 storing objects under prefix in the same bucket. The returned S3
+// shares the client and hence also the http connection pool with s.
+func (s *S3) WithPrefix(prefix string) *S3 {
+	p := *s
+	p.prefix = prefix
+
+	return &p
+}
+
 // Check whether bucket exist and if not, create it and wait until it appears.
 func (s *S3) makeBucketExist() error {
 	_, err := s.client.HeadBucket(&s3.HeadBucketInput{Bucket: aws.String(s.bucket)})
@@ -215,10 +296,11 @@ func (s *S3) makeBucketExist() error {
 func (s *S3) DeleteKeyAndSuccessors(fromKey int64) error {
 	err := s.client.ListObjectsV2Pages(&s3.ListObjectsV2Input{
 		Bucket: aws.String(s.bucket),
+		Prefix: aws.String(s.prefix),
 	}, func(page *s3.ListObjectsV2Output, last bool) bool {
 		for _, o := range page.Contents {
-			key := decode(*o.Key)
-			if key >= fromKey {
+			key, ok := s.decode(*o.Key)
+			if ok && key >= fromKey {
 				s.Delete(key)
 			}
 		}
@@ -231,19 +313,24 @@ func (s *S3) DeleteKeyAndSuccessors(fromKey int64) error {
 // We split the key into halves and use the lower half of bits as s3 prefix and
 // upper half for the object key. This is to prevent s3 rate limiting which is
 // applied to objects with the same prefix.
-func encode(key int64) string {
+func (s *S3) encode(key int64) string {
 	left := (key >> 32) & 0xffffffff
 	right := key & 0xffffffff
 
-	return fmt.Sprintf(keyFmt, right, left)
+	return s.prefix + fmt.Sprintf(keyFmt, right, left)
 }
 
-// The inverse to encode()
-func decode(keyWithPrefix string) int64 {
+// The inverse to encode(). Returns false for keys not belonging to s, e.g.
+// objects of other volumes in the same bucket.
+func (s *S3) decode(keyWithPrefix string) (int64, bool) {
+	if !strings.HasPrefix(keyWithPrefix, s.prefix) {
+		return 0, false
+	}
+
 	var prefix, key int64
-	fmt.Sscanf(keyWithPrefix, keyFmt, &prefix, &key)
+	_, err := fmt.Sscanf(keyWithPrefix[len(s.prefix):], keyFmt, &prefix, &key)
 
 	k := (key << 32) + prefix
 
-	return k
+	return k, err == nil && s.encode(k) == keyWithPrefix
 }
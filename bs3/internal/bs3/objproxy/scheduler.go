@@ -0,0 +1,204 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package objproxy
+
+import (
+	"sync"
+	"time"
+)
+
+// Class of a request. Workers are shared by classes according to their
+// weights, see classWeights.
+type Class int
+
+const (
+	// Reads of the guest waiting for data.
+	ClassRead Class = iota
+
+	// Writes of the guest waiting for acknowledge.
+	ClassWrite
+
+	// Upload and download of the extent map.
+	ClassCheckpoint
+
+	// Readahead into the cache.
+	ClassPrefetch
+
+	// Garbage collection.
+	ClassGC
+
+	classes
+)
+
+var (
+	// Relative shares of workers of classes with waiting requests.
+	classWeights = [classes]float64{
+		ClassRead:       16,
+		ClassWrite:      16,
+		ClassCheckpoint: 4,
+		ClassPrefetch:   2,
+		ClassGC:         1,
+	}
+
+	// Maximal part of the current concurrency limit serving one class at
+	// once. In percent.
+	classCaps = [classes]int{
+		ClassRead:       100,
+		ClassWrite:      100,
+		ClassCheckpoint: 50,
+		ClassPrefetch:   25,
+		ClassGC:         25,
+	}
+)
+
+// Maximal part of the current concurrency limit serving all background
+// classes, i.e. all but reads and writes, at once. In percent. Like this a
+// burst of foreground requests always finds some slots free.
+const backgroundCap = 75
+
+// Weighted fair scheduler of requests of one direction. It is a stride
+// scheduler, i.e. each class has a pass, which is the virtual time of its next
+// request, and the class with the lowest pass is served. Serving a request
+// advances the pass of its class by the inverse of its weight. A class which
+// becomes active does not get credit for the time it was idle, its pass starts
+// at the current virtual time.
+//
+// A request waiting longer than the deadline is served before all others, no
+// matter the weights. Like this even a low weight class is never starved by a
+// continuous stream of foreground requests.
+type scheduler struct {
+	deadline time.Duration
+
+	// Concurrency without the limiter.
+	workers int
+	limiter *limiter
+
+	mutex    sync.Mutex
+	cond     *sync.Cond
+	queues   [classes][]request
+	inFlight [classes]int
+	pass     [classes]float64
+	vtime    float64
+	closed   bool
+}
+
+// Returns scheduler for workers go routines limited by l, which may be nil.
+// Requests waiting longer than deadline are promoted, zero deadline disables
+// the promotion.
+func newScheduler(workers int, deadline time.Duration, l *limiter) *scheduler {
+	s := &scheduler{deadline: deadline, workers: workers, limiter: l}
+	s.cond = sync.NewCond(&s.mutex)
+
+	return s
+}
+
+// Returns pct percent of limit, at least one.
+func share(limit, pct int) int {
+	n := limit * pct / 100
+	if n == 0 {
+		n = 1
+	}
+
+	return n
+}
+
+// Enqueues request r.
+func (s *scheduler) push(r request) {
+	r.queued = time.Now()
+
+	s.mutex.Lock()
+	if len(s.queues[r.class]) == 0 && s.pass[r.class] < s.vtime {
+		s.pass[r.class] = s.vtime
+	}
+	s.queues[r.class] = append(s.queues[r.class], r)
+	s.mutex.Unlock()
+
+	s.cond.Signal()
+}
+
+// Waits for the next request to serve. Returns false when the scheduler is
+// closed. The caller has to call done() after the request is served.
+func (s *scheduler) pop() (request, bool) {
+	s.mutex.Lock()
+	defer s.mutex.Unlock()
+
+	for {
+		if s.closed {
+			return request{}, false
+		}
+
+		if c, ok := s.pick(); ok {
+			r := s.queues[c][0]
+			s.queues[c][0] = request{}
+			s.queues[c] = s.queues[c][1:]
+
+			s.inFlight[c]++
+			s.vtime = s.pass[c]
+			s.pass[c] += 1 / classWeights[c]
+
+			return r, true
+		}
+
+		s.cond.Wait()
+	}
+}
+
+// Returns class to be served next. Has to be called with mutex held.
+func (s *scheduler) pick() (Class, bool) {
+	now := time.Now()
+	best, promoted := Class(-1), Class(-1)
+
+	limit := s.workers
+	if s.limiter != nil {
+		limit = s.limiter.concurrency().Limit
+	}
+
+	background := 0
+	for c := ClassCheckpoint; c < classes; c++ {
+		background += s.inFlight[c]
+	}
+	backgroundFull := background >= share(limit, backgroundCap)
+
+	for c := Class(0); c < classes; c++ {
+		q := s.queues[c]
+		if len(q) == 0 || s.inFlight[c] >= share(limit, classCaps[c]) ||
+			(c >= ClassCheckpoint && backgroundFull) {
+			continue
+		}
+
+		if s.deadline > 0 && now.Sub(q[0].queued) > s.deadline &&
+			(promoted < 0 || q[0].queued.Before(s.queues[promoted][0].queued)) {
+			promoted = c
+		}
+
+		if best < 0 || s.pass[c] < s.pass[best] {
+			best = c
+		}
+	}
+
+	if promoted >= 0 {
+		return promoted, true
+	}
+
+	return best, best >= 0
+}
+
+// Marks request of class c as served.
+func (s *scheduler) done(c Class) {
+	s.mutex.Lock()
+	s.inFlight[c]--
+	s.mutex.Unlock()
+
+	// The class may have been capped, so the waiting worker can serve it
+	// now.
+	s.cond.Signal()
+}
+
+// Wakes up all workers waiting in pop() and makes them exit.
+func (s *scheduler) close() {
+	s.mutex.Lock()
+	s.closed = true
+	s.mutex.Unlock()
+
+	s.cond.Broadcast()
+}
@@ -0,0 +1,109 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package bs3
+
+import (
+	"sort"
+	"sync"
+
+	"github.com/asch/bs3/internal/bs3/mapproxy"
+	"github.com/asch/bs3/internal/config"
+)
+
+// Object part together with the memory it is downloaded to.
+type readPart struct {
+	part     mapproxy.ObjectPart
+	segments [][]byte
+}
+
+// Downloads all parts in parallel and waits until they are finished. Parts
+// are merged by planReads before, so nearby parts of one object cost just one
+// request. Returns the first error of failed downloads.
+func (b *Bs3) downloadParts(parts []readPart) error {
+	gap := config.Cfg.Read.MergeGap / int64(config.Cfg.BlockSize)
+	plan := planReads(parts, gap)
+	errs := make([]error, len(plan))
+
+	var wg sync.WaitGroup
+	for i, p := range plan {
+		wg.Add(1)
+		go func(i int, p readPart) {
+			errs[i] = b.downloadObjectPart(p.part, p.segments)
+			wg.Done()
+		}(i, p)
+	}
+	wg.Wait()
+
+	for _, err := range errs {
+		if err != nil {
+			return err
+		}
+	}
+
+	return nil
+}
+
+// Groups parts by objects and merges parts of one object which are at most gap
+// blocks apart. Blocks in the gaps are downloaded into scratch memory. Every
+// gap has its own piece of it, since the downloaded blocks are cached and a
+// shared piece would leave data of another gap under the key of the block.
+// Overlapping parts are never merged. Segments of merged parts
+// are concatenated, hence no data are copied.
+func planReads(parts []readPart, gap int64) []readPart {
+	sort.Slice(parts, func(i, j int) bool {
+		if parts[i].part.Key != parts[j].part.Key {
+			return parts[i].part.Key < parts[j].part.Key
+		}
+		return parts[i].part.Sector < parts[j].part.Sector
+	})
+
+	blockSize := int64(config.Cfg.BlockSize)
+	merged := make([]readPart, 0, len(parts))
+
+	for len(parts) > 0 {
+		// Find parts merged with the first one and the size of their
+		// gaps.
+		n, gaps := 1, int64(0)
+		end := parts[0].part.Sector + parts[0].part.Length
+		for ; n < len(parts); n++ {
+			p := parts[n].part
+			if p.Key != parts[0].part.Key || p.Sector < end || p.Sector-end > gap {
+				break
+			}
+
+			// The last block of an unaligned read is partial, nothing
+			// can follow it.
+			if prev := parts[n-1]; segmentsSize(prev.segments) != prev.part.Length*blockSize {
+				break
+			}
+
+			gaps += p.Sector - end
+			end = p.Sector + p.Length
+		}
+
+		if n == 1 {
+			merged = append(merged, parts[0])
+			parts = parts[1:]
+			continue
+		}
+
+		scratch := make([]byte, gaps*blockSize)
+		m := readPart{part: parts[0].part}
+		m.part.Length = end - m.part.Sector
+
+		prevEnd := m.part.Sector
+		for _, p := range parts[:n] {
+			if g := p.part.Sector - prevEnd; g > 0 {
+				m.segments = append(m.segments, scratch[:g*blockSize:g*blockSize])
+				scratch = scratch[g*blockSize:]
+			}
+			m.segments = append(m.segments, p.segments...)
+			prevEnd = p.part.Sector + p.part.Length
+		}
+
+		merged = append(merged, m)
+		parts = parts[n:]
+	}
+
+	return merged
+}
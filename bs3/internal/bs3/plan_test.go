@@ -0,0 +1,54 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package bs3
+
+import (
+	"bytes"
+	"testing"
+
+	"github.com/asch/bs3/internal/bs3/mapproxy"
+	"github.com/asch/bs3/internal/config"
+)
+
+// Gaps of one merged part have to be backed by distinct memory, since blocks
+// downloaded into them are cached.
+func TestPlanReadsDistinctGaps(t *testing.T) {
+	config.Cfg.BlockSize = 4096
+	blockSize := int64(config.Cfg.BlockSize)
+
+	part := func(sector, length int64) readPart {
+		return readPart{
+			part:     mapproxy.ObjectPart{Key: 1, Sector: sector, Length: length},
+			segments: [][]byte{make([]byte, length*blockSize)},
+		}
+	}
+
+	// Gaps of 2 and 3 blocks.
+	plan := planReads([]readPart{part(0, 1), part(3, 1), part(7, 2)}, 4)
+	if len(plan) != 1 {
+		t.Fatalf("got %d parts, want 1", len(plan))
+	}
+
+	m := plan[0]
+	if m.part.Sector != 0 || m.part.Length != 9 || segmentsSize(m.segments) != 9*blockSize {
+		t.Fatalf("wrong merged part %+v", m.part)
+	}
+
+	for i := int64(0); i < m.part.Length; i++ {
+		for _, s := range sliceSegments(m.segments, i*blockSize, blockSize) {
+			for j := range s {
+				s[j] = byte(i + 1)
+			}
+		}
+	}
+
+	for i := int64(0); i < m.part.Length; i++ {
+		var block bytes.Buffer
+		for _, s := range sliceSegments(m.segments, i*blockSize, blockSize) {
+			block.Write(s)
+		}
+		if !bytes.Equal(block.Bytes(), bytes.Repeat([]byte{byte(i + 1)}, int(blockSize))) {
+			t.Fatalf("block %d shares memory with another block", i)
+		}
+	}
+}
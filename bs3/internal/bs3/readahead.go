@@ -0,0 +1,216 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package bs3
+
+import (
+	"sync"
+
+	"github.com/rs/zerolog/log"
+
+	"github.com/asch/bs3/internal/bs3/mapproxy"
+	"github.com/asch/bs3/internal/bs3/objproxy"
+	"github.com/asch/bs3/internal/config"
+)
+
+const (
+	// Number of sequential streams tracked per volume. The least recently
+	// used stream is replaced by a new one.
+	readaheadStreams = 16
+
+	// Initial readahead window of a stream. In blocks.
+	readaheadInitialWindow = 32
+
+	// Maximal number of prefetches of one volume running at once. Further
+	// prefetches are skipped and retried by the next read of the stream.
+	readaheadInFlight = 4
+)
+
+// Detector of sequential read streams. Reads of a stream which directly follow
+// each other open the readahead window, which doubles with every further
+// sequential read up to the configured maximum. Blocks in the window are
+// prefetched with low priority into the read cache, so the following reads of
+// the stream are served from memory and the stream is limited by bandwidth
+// instead of latency of the backend.
+type readahead struct {
+	b *Bs3
+
+	// Maximal window in blocks.
+	maxWindow int64
+
+	mutex   sync.Mutex
+	streams [readaheadStreams]stream
+	clock   uint64
+
+	// Semaphore limiting running prefetches.
+	inFlight chan struct{}
+}
+
+// One sequential stream.
+type stream struct {
+	// Sector expected to be read next.
+	next int64
+
+	// End of the prefetched range.
+	prefetched int64
+
+	window int64
+
+	// Time of the last access in reads of the volume. Zero for unused
+	// stream.
+	used uint64
+}
+
+// Returns readahead for volume b or nil if readahead is disabled.
+func newReadahead(b *Bs3) *readahead {
+	maxWindow := config.Cfg.Read.Readahead / int64(config.Cfg.BlockSize)
+	if maxWindow == 0 || b.cache == nil {
+		return nil
+	}
+
+	return &readahead{
+		b:         b,
+		maxWindow: maxWindow,
+		inFlight:  make(chan struct{}, readaheadInFlight),
+	}
+}
+
+// Records read of length blocks starting at sector and starts prefetch when
+// the read continues a sequential stream.
+func (r *readahead) access(sector, length int64) {
+	if r == nil {
+		return
+	}
+
+	start, end, ok := r.advance(sector, length)
+	if !ok {
+		return
+	}
+
+	select {
+	case r.inFlight <- struct{}{}:
+	default:
+		r.retreat(sector+length, start)
+		return
+	}
+
+	go func() {
+		r.b.prefetch(start, end-start)
+		<-r.inFlight
+	}()
+}
+
+// Updates streams with the read and returns range which should be prefetched.
+func (r *readahead) advance(sector, length int64) (start, end int64, ok bool) {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	r.clock++
+
+	var s *stream
+	lru := &r.streams[0]
+	for i := range r.streams {
+		if r.streams[i].used != 0 && r.streams[i].next == sector {
+			s = &r.streams[i]
+			break
+		}
+		if r.streams[i].used < lru.used {
+			lru = &r.streams[i]
+		}
+	}
+
+	// Random read or a start of a new stream.
+	if s == nil {
+		*lru = stream{
+			next:       sector + length,
+			prefetched: sector + length,
+			window:     readaheadInitialWindow,
+			used:       r.clock,
+		}
+		return 0, 0, false
+	}
+
+	s.used = r.clock
+	s.next = sector + length
+	if s.prefetched < s.next {
+		s.prefetched = s.next
+	}
+
+	// Prefetch the next window when the stream consumed half of the
+	// current one, so the data are ready before the stream gets there.
+	if s.prefetched-s.next > s.window/2 {
+		return 0, 0, false
+	}
+
+	if s.window < r.maxWindow {
+		s.window *= 2
+		if s.window > r.maxWindow {
+			s.window = r.maxWindow
+		}
+	}
+
+	start = s.prefetched
+	end = s.next + s.window
+	if sectors := config.Cfg.Size / int64(config.Cfg.BlockSize); end > sectors {
+		end = sectors
+	}
+	if end <= start {
+		return 0, 0, false
+	}
+
+	s.prefetched = end
+
+	return start, end, true
+}
+
+// Returns the prefetched range of the stream expecting next back to start,
+// since the prefetch was skipped.
+func (r *readahead) retreat(next, start int64) {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	for i := range r.streams {
+		if s := &r.streams[i]; s.used != 0 && s.next == next {
+			s.prefetched = start
+		}
+	}
+}
+
+// Downloads length blocks starting at sector into the cache with low priority.
+// Blocks which are cached already are skipped.
+func (b *Bs3) prefetch(sector, length int64) {
+	r := b.gcData.readers.enter(sector)
+	defer r.leave()
+
+	objectPieces := b.extentMapProxy.Lookup(sector, length)
+
+	blockSize := int64(config.Cfg.BlockSize)
+	for _, op := range objectPieces {
+		if op.Key == mapproxy.NotMappedKey {
+			continue
+		}
+
+		first, end := int64(0), op.Length
+		for first < end && b.cache.Contains(b.cacheKey(op.Key, op.Sector+first)) {
+			first++
+		}
+		for end-1 > first && b.cache.Contains(b.cacheKey(op.Key, op.Sector+end-1)) {
+			end--
+		}
+		if first == end {
+			continue
+		}
+
+		data := make([]byte, (end-first)*blockSize)
+		err := b.objectStoreProxy.Download(op.Key, data, (op.Sector+first)*blockSize, objproxy.ClassPrefetch)
+		if err != nil {
+			// Prefetch is just a hint, the demand read retries.
+			log.Debug().Err(err).Msg("Prefetch failed.")
+			return
+		}
+
+		for i := first; i < end; i++ {
+			offset := (i - first) * blockSize
+			b.cache.Put(b.cacheKey(op.Key, op.Sector+i), [][]byte{data[offset : offset+blockSize]})
+		}
+	}
+}
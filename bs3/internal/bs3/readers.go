@@ -0,0 +1,85 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package bs3
+
+import (
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+const (
+	// Number of counters of readers. Readers are spread over them by the
+	// sector, so concurrent readers rarely share a cache line.
+	readerSlots = 64
+
+	// How often synchronize() checks whether the old readers left.
+	readersPoll = time.Millisecond
+)
+
+// Tracks readers of the extent map, i.e. requests which looked up object parts
+// and did not finish downloading them yet. Objects which were dead when
+// synchronize() was called are not referenced by any reader after it returns,
+// hence they can be deleted. Readers only increment and decrement their
+// counter, there is no lock shared by all of them. The zero value is ready to
+// use.
+//
+// Readers are counted in one of two phases. Synchronize() switches new readers
+// to the other phase and waits until the counters of the old phase drop to
+// zero. A reader which loads the phase before the switch but increments its
+// counter after it sees the switch and retries in the new phase, so no reader
+// of the old phase is missed.
+type readers struct {
+	phase uint32
+	slots [readerSlots]readerSlot
+
+	// Serializes synchronize() calls.
+	mutex sync.Mutex
+}
+
+type readerSlot struct {
+	counters [2]int64
+
+	// Avoid false sharing of the neighbouring slots.
+	_ [48]byte
+}
+
+// Reader registered by enter().
+type reader struct {
+	counter *int64
+}
+
+// Registers a reader of sector. It has to call leave() when it does not use the
+// looked up object parts anymore.
+func (r *readers) enter(sector int64) reader {
+	slot := &r.slots[uint64(sector)%readerSlots]
+	for {
+		phase := atomic.LoadUint32(&r.phase)
+		c := &slot.counters[phase]
+		atomic.AddInt64(c, 1)
+		if atomic.LoadUint32(&r.phase) == phase {
+			return reader{c}
+		}
+		atomic.AddInt64(c, -1)
+	}
+}
+
+// Unregisters the reader.
+func (r reader) leave() {
+	atomic.AddInt64(r.counter, -1)
+}
+
+// Waits until all readers registered before the call leave.
+func (r *readers) synchronize() {
+	r.mutex.Lock()
+	defer r.mutex.Unlock()
+
+	old := atomic.LoadUint32(&r.phase)
+	atomic.StoreUint32(&r.phase, old^1)
+
+	for i := range r.slots {
+		for atomic.LoadInt64(&r.slots[i].counters[old]) != 0 {
+			time.Sleep(readersPoll)
+		}
+	}
+}
@@ -0,0 +1,63 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package bs3
+
+// Returns sub-slices of segments covering size bytes starting at offset, as if
+// segments were one continuous buffer. No data are copied, the returned
+// slices share memory with segments.
+func sliceSegments(segments [][]byte, offset, size int64) [][]byte {
+	sliced := make([][]byte, 0, 1)
+
+	for _, s := range segments {
+		if size == 0 {
+			break
+		}
+
+		if offset >= int64(len(s)) {
+			offset -= int64(len(s))
+			continue
+		}
+
+		s = s[offset:]
+		offset = 0
+
+		if int64(len(s)) > size {
+			s = s[:size]
+		}
+
+		sliced = append(sliced, s)
+		size -= int64(len(s))
+	}
+
+	return sliced
+}
+
+// Copies segments into continuous buffer dst and returns number of copied
+// bytes.
+func copyFromSegments(dst []byte, segments [][]byte) int {
+	n := 0
+	for _, s := range segments {
+		n += copy(dst[n:], s)
+	}
+
+	return n
+}
+
+// Zeroes all segments.
+func zeroSegments(segments [][]byte) {
+	for _, s := range segments {
+		for i := range s {
+			s[i] = 0
+		}
+	}
+}
+
+// Returns total size of segments.
+func segmentsSize(segments [][]byte) int64 {
+	var size int64
+	for _, s := range segments {
+		size += int64(len(s))
+	}
+
+	return size
+}
@@ -0,0 +1,328 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package bs3
+
+import (
+	"encoding/binary"
+	"sync"
+	"time"
+
+	"github.com/rs/zerolog/log"
+
+	"github.com/asch/bs3/internal/bs3/mapproxy"
+	"github.com/asch/bs3/internal/bs3/objproxy"
+	"github.com/asch/bs3/internal/config"
+)
+
+// Write buffer packs individual writes coming from the librbd interface into
+// chunk-sized objects with the same layout as the chunks produced by the
+// kernel in the BUSE write path. I.e. metadata for all writes come first,
+// until metadata_size, and data of all writes follow in the same order.
+//
+// Writes are appended to the open chunk concurrently. The chunk is sealed when
+// the next write does not fit or when the deadline since the first write
+// expires. Sealed chunks are uploaded in parallel but applied to the extent map
+// and acknowledged strictly in the order of their keys. Like this we never
+// acknowledge a write stored in an object which could be removed during
+// recovery because of broken prefix consistency. When the upload of a chunk
+// fails, its writers get the error right away, but the following chunks are
+// applied only after a tombstone is stored under its key.
+type writeBuffer struct {
+	b *Bs3
+
+	// Maximal time the first write waits in the open chunk before it is
+	// sealed. Zero means that every chunk is sealed immediately after
+	// the first write.
+	delay time.Duration
+
+	// Number of metadata slots in one chunk, i.e. maximal number of
+	// writes.
+	maxWrites int
+
+	// Number of blocks available for data in one chunk.
+	dataBlocks int64
+
+	// Recycled chunk memory.
+	pool sync.Pool
+
+	// Lock guarding open and last.
+	mutex sync.Mutex
+
+	// Chunk being filled. Nil when there is no open chunk.
+	open *openChunk
+
+	// Channel closed when the last sealed chunk is applied to the extent
+	// map or replaced by a tombstone. Nil when there is no such chunk.
+	last chan struct{}
+}
+
+// One chunk under construction.
+type openChunk struct {
+	object  []byte
+	extents []mapproxy.Extent
+
+	// Number of writes and data blocks already reserved in the chunk.
+	writes int
+	blocks int64
+
+	// Writes which reserved space but did not finish copying their data
+	// yet.
+	copies sync.WaitGroup
+
+	// Deadline timer sealing the chunk.
+	timer *time.Timer
+
+	// Closed when the chunk is uploaded and applied to the extent map or
+	// when the upload failed. Writers wait for it.
+	done chan struct{}
+
+	// Error of the failed upload. Valid after done is closed.
+	err error
+
+	// Closed when the chunk is applied or replaced by a tombstone. The
+	// next chunk waits for it.
+	applied chan struct{}
+}
+
+// Returns write buffer with chunk geometry derived from the configuration.
+func newWriteBuffer(b *Bs3) *writeBuffer {
+	w := &writeBuffer{
+		b:          b,
+		delay:      time.Duration(config.Cfg.Write.CoalesceDelayUs) * time.Microsecond,
+		maxWrites:  b.metadata_size / b.write_item_size,
+		dataBlocks: int64((config.Cfg.Write.ChunkSize - b.metadata_size) / config.Cfg.BlockSize),
+	}
+
+	w.pool.New = func() interface{} {
+		return make([]byte, config.Cfg.Write.ChunkSize)
+	}
+
+	return w
+}
+
+// Writes length blocks from data segments starting at sector. The call returns
+// after all the data are uploaded to the backend and visible in the extent
+// map. Writes larger than one chunk are split. Returns error when any of the
+// chunks failed, parts of the write in other chunks may be applied then.
+func (w *writeBuffer) write(sector, length int64, segments [][]byte) error {
+	blockSize := int64(config.Cfg.BlockSize)
+	waits := make([]*openChunk, 0, 1)
+
+	var offset int64
+	for length > 0 {
+		blocks := length
+		if blocks > w.dataBlocks {
+			blocks = w.dataBlocks
+		}
+
+		size := blocks * blockSize
+		e := mapproxy.Extent{Sector: sector, Length: blocks}
+		waits = append(waits, w.append(e, sliceSegments(segments, offset, size)))
+
+		sector += blocks
+		length -= blocks
+		offset += size
+	}
+
+	var err error
+	for _, c := range waits {
+		if e := c.wait(); e != nil {
+			err = e
+		}
+	}
+
+	return err
+}
+
+// Logs discard of length blocks starting at sector. The discard takes just one
+// metadata slot and no data, no matter how long it is. The call returns after
+// the discard is uploaded to the backend and applied to the extent map.
+func (w *writeBuffer) discard(sector, length int64) error {
+	return w.append(mapproxy.Extent{Sector: sector, Length: length, Flag: mapproxy.FlagDiscard}, nil).wait()
+}
+
+// Logs zeroing of length blocks starting at sector. Like discard, it takes
+// just one metadata slot and no data.
+func (w *writeBuffer) zero(sector, length int64) error {
+	return w.append(mapproxy.Extent{Sector: sector, Length: length, Flag: mapproxy.FlagZero}, nil).wait()
+}
+
+// Seals the open chunk, if any, and waits until all sealed chunks are applied
+// to the extent map or replaced by tombstones.
+func (w *writeBuffer) flush() {
+	w.mutex.Lock()
+	if w.open != nil {
+		w.seal()
+	}
+	last := w.last
+	w.mutex.Unlock()
+
+	if last != nil {
+		<-last
+	}
+}
+
+// Reserves space for extent e in the open chunk and copies its data from
+// segments there. Extents with flags have no data. Returns the chunk, see
+// openChunk.wait().
+func (w *writeBuffer) append(e mapproxy.Extent, segments [][]byte) *openChunk {
+	length := e.Length
+	if !e.HasData() {
+		length = 0
+	}
+
+	w.mutex.Lock()
+
+	c := w.open
+	if c != nil && (c.writes == w.maxWrites || c.blocks+length > w.dataBlocks) {
+		w.seal()
+		c = nil
+	}
+
+	if c == nil {
+		c = w.newChunk()
+	}
+
+	slot := c.writes
+	dataOffset := int64(w.b.metadata_size) + c.blocks*int64(config.Cfg.BlockSize)
+	c.writes++
+	c.blocks += length
+	c.copies.Add(1)
+
+	if w.delay == 0 || c.writes == w.maxWrites || c.blocks == w.dataBlocks {
+		w.seal()
+	}
+
+	w.mutex.Unlock()
+
+	c.extents[slot] = e
+	n := copyFromSegments(c.object[dataOffset:], segments)
+
+	// Chunk memory is recycled, hence the tail of the last partial block
+	// has to be zeroed.
+	reserved := c.object[dataOffset+int64(n) : dataOffset+length*int64(config.Cfg.BlockSize)]
+	for i := range reserved {
+		reserved[i] = 0
+	}
+	c.copies.Done()
+
+	return c
+}
+
+// Waits until the chunk is applied to the map or failed. Returns error of the
+// failed upload.
+func (c *openChunk) wait() error {
+	<-c.done
+
+	return c.err
+}
+
+// Opens a new chunk and arms its deadline. Has to be called with mutex held.
+func (w *writeBuffer) newChunk() *openChunk {
+	c := &openChunk{
+		object:  w.pool.Get().([]byte),
+		extents: make([]mapproxy.Extent, w.maxWrites),
+		done:    make(chan struct{}),
+		applied: make(chan struct{}),
+	}
+
+	if w.delay > 0 {
+		c.timer = time.AfterFunc(w.delay, func() {
+			w.mutex.Lock()
+			if w.open == c {
+				w.seal()
+			}
+			w.mutex.Unlock()
+		})
+	}
+
+	w.open = c
+
+	return c
+}
+
+// Seals the open chunk, assigns it a key and starts its upload. Has to be
+// called with mutex held.
+func (w *writeBuffer) seal() {
+	c := w.open
+	w.open = nil
+
+	if c.timer != nil {
+		c.timer.Stop()
+	}
+
+	prev := w.last
+	w.last = c.applied
+
+	go w.commit(c, w.b.keys.Next(), prev)
+}
+
+// Finalizes the metadata of the sealed chunk, uploads it and after the
+// previous chunk is applied, it applies this one to the extent map and wakes
+// up all writers. When the upload fails, writers are woken up with the error
+// and a tombstone is stored instead.
+func (w *writeBuffer) commit(c *openChunk, key int64, prev chan struct{}) {
+	defer w.b.keys.Done(key)
+
+	c.copies.Wait()
+
+	extents := c.extents[:c.writes]
+	metadata := c.object[:w.b.metadata_size]
+
+	// Writes from one chunk are ordered by their position in the chunk
+	// and chunks by their keys.
+	for i := range extents {
+		extents[i].SeqNo = key*int64(w.maxWrites) + int64(i)
+		writeExtent(metadata[i*w.b.write_item_size:], extents[i])
+	}
+
+	// Zero out the rest of the metadata. The recovery process relies on
+	// it to find the end of the metadata section.
+	for i := len(extents) * w.b.write_item_size; i < len(metadata); i++ {
+		metadata[i] = 0
+	}
+
+	object := c.object[:int64(w.b.metadata_size)+c.blocks*int64(config.Cfg.BlockSize)]
+
+	// Some s3 backends, like minio just drops connection when they are
+	// under load. The proxy retries the upload, when it gives up, the
+	// writers fail and the key is filled by a tombstone.
+	err := w.b.objectStoreProxy.Upload(key, object, objproxy.ClassWrite)
+	if err != nil {
+		log.Error().Err(err).Int64("key", key).Msg("Upload failed.")
+		c.err = err
+		close(c.done)
+		w.pool.Put(c.object)
+
+		w.b.storeTombstone(key)
+		if prev != nil {
+			<-prev
+		}
+		close(c.applied)
+
+		return
+	}
+
+	w.b.cacheObject(extents, key, object)
+
+	if prev != nil {
+		<-prev
+	}
+
+	w.b.applyObject(extents, key)
+	close(c.done)
+	close(c.applied)
+
+	w.pool.Put(c.object)
+}
+
+// Stores extent into the metadata part of the object. It is the inverse
+// operation to parseExtent, i.e. sector and length are stored in sectorUnit.
+func writeExtent(b []byte, e mapproxy.Extent) {
+	unitsPerBlock := uint64(config.Cfg.BlockSize / sectorUnit)
+
+	binary.LittleEndian.PutUint64(b[:8], uint64(e.Sector)*unitsPerBlock)
+	binary.LittleEndian.PutUint64(b[8:16], uint64(e.Length)*unitsPerBlock)
+	binary.LittleEndian.PutUint64(b[16:24], uint64(e.SeqNo))
+	binary.LittleEndian.PutUint64(b[24:32], uint64(e.Flag))
+}
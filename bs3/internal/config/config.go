@@ -6,6 +6,7 @@ package config
 
 import (
 	"flag"
+	"fmt"
 	"os"
 
 	"github.com/ilyakaznacheev/cleanenv"
@@ -33,6 +34,8 @@ type Config struct {
 	Scheduler  bool  `toml:"scheduler" env:"BS3_SCHEDULER" env-default:"false" env-description:"Use block layer scheduler."`
 	QueueDepth int   `toml:"queue_depth" env:"BS3_QUEUEDEPTH" env-default:"128" env-description:"Device IO queue depth."`
 
+	ExtentMap string `toml:"extent_map" env:"BS3_EXTENTMAP" env-default:"sector" env-description:"Extent map structure. \"sector\" for flat map of all blocks, \"tree\" for B+tree of written extents."`
+
 	S3 struct {
 		Bucket      string `toml:"bucket" env:"BS3_S3_BUCKET" env-description:"S3 Bucket name." env-default:"bs3"`
 		Remote      string `toml:"remote" env:"BS3_S3_REMOTE" env-description:"S3 Remote address. Empty string for AWS S3 endpoint." env-default:""`
@@ -41,26 +44,62 @@ type Config struct {
 		SecretKey   string `toml:"secret_key" env:"BS3_S3_SECRETKEY" env-description:"S3 Secret Key." env-default:""`
 		Uploaders   int    `toml:"uploaders" env:"BS3_S3_UPLOADERS" env-description:"S3 Max number of uploader threads." env-default:"16"`
 		Downloaders int    `toml:"downloaders" env:"BS3_S3_DOWNLOADERS" env-description:"S3 Max number of downloader threads." env-default:"16"`
+
+		HedgePercentile float64 `toml:"hedge_percentile" env:"BS3_S3_HEDGEPERCENTILE" env-description:"GETs slower than this percentile of recent GETs are duplicated. 0 disables hedging." env-default:"0.99"`
+		HedgeBudget     float64 `toml:"hedge_budget" env:"BS3_S3_HEDGEBUDGET" env-description:"Maximal fraction of GETs which can be duplicated." env-default:"0.02"`
+		HedgeMinDelayMs int64   `toml:"hedge_min_delay" env:"BS3_S3_HEDGEMINDELAY" env-description:"Minimal time before a GET is duplicated. In ms." env-default:"50"`
+
+		RetryBaseDelayMs  int64   `toml:"retry_base_delay" env:"BS3_S3_RETRYBASEDELAY" env-description:"Backoff before the first retry of a failed request. In ms." env-default:"10"`
+		RetryMaxDelayMs   int64   `toml:"retry_max_delay" env:"BS3_S3_RETRYMAXDELAY" env-description:"Maximal backoff between retries. In ms." env-default:"2000"`
+		RetryDeadlineMs   int64   `toml:"retry_deadline" env:"BS3_S3_RETRYDEADLINE" env-description:"Time after which a failed request is not retried anymore and fails with EIO. In ms." env-default:"30000"`
+		RetryBudget       float64 `toml:"retry_budget" env:"BS3_S3_RETRYBUDGET" env-description:"Maximal number of retries as a fraction of all requests." env-default:"0.1"`
+		BreakerThreshold  int     `toml:"breaker_threshold" env:"BS3_S3_BREAKERTHRESHOLD" env-description:"Consecutive failures after which requests fail fast. 0 disables the circuit breaker." env-default:"32"`
+		BreakerCooldownMs int64   `toml:"breaker_cooldown" env:"BS3_S3_BREAKERCOOLDOWN" env-description:"Time for which requests fail fast before the backend is probed again. In ms." env-default:"1000"`
+
+		MinConcurrency   int     `toml:"min_concurrency" env:"BS3_S3_MINCONCURRENCY" env-description:"Lower bound of adaptive number of uploads and downloads in flight. Uploaders and downloaders are the upper bounds. 0 disables the adaptation." env-default:"8"`
+		LatencyTolerance float64 `toml:"latency_tolerance" env:"BS3_S3_LATENCYTOLERANCE" env-description:"Requests slower than this multiple of the minimal recent latency decrease the concurrency." env-default:"2"`
 	} `toml:"s3"`
 
 	Write struct {
-		Durable       bool `toml:"durable" env:"BS3_WRITE_DURABLE" env-description:"Flush semantics. True means durable, false means barrier only." env-default:"false"`
-		BufSize       int  `toml:"shared_buffer_size" env:"BS3_WRITE_BUFSIZE" env-description:"Write shared memory size in MB." env-default:"32"`
-		ChunkSize     int  `toml:"chunk_size" env:"BS3_WRITE_CHUNKSIZE" env-description:"Chunk size in MB." env-default:"4"`
-		CollisionSize int  `toml:"collision_chunk_size" env:"BS3_WRITE_COLSIZE" env-description:"Collision size in MB." env-default:"1"`
+		Durable         bool `toml:"durable" env:"BS3_WRITE_DURABLE" env-description:"Flush semantics. True means durable, false means barrier only." env-default:"false"`
+		BufSize         int  `toml:"shared_buffer_size" env:"BS3_WRITE_BUFSIZE" env-description:"Write shared memory size in MB." env-default:"32"`
+		ChunkSize       int  `toml:"chunk_size" env:"BS3_WRITE_CHUNKSIZE" env-description:"Chunk size in MB." env-default:"4"`
+		CollisionSize   int  `toml:"collision_chunk_size" env:"BS3_WRITE_COLSIZE" env-description:"Collision size in MB." env-default:"1"`
+		CoalesceDelayUs int  `toml:"coalesce_delay" env:"BS3_WRITE_COALESCEDELAY" env-description:"Max time a write waits for other writes to share an object with. In us." env-default:"500"`
 	} `toml:"write"`
 
 	Read struct {
-		BufSize int `toml:"shared_buffer_size" env:"BS3_READ_BUFSIZE" env-description:"Read shared memory size in MB." env-default:"32"`
+		BufSize   int   `toml:"shared_buffer_size" env:"BS3_READ_BUFSIZE" env-description:"Read shared memory size in MB." env-default:"32"`
+		CacheSize int64 `toml:"cache_size" env:"BS3_READ_CACHESIZE" env-description:"Size of the in-memory cache of downloaded and uploaded blocks in MB. 0 disables the cache." env-default:"256"`
+		MergeGap  int64 `toml:"merge_gap" env:"BS3_READ_MERGEGAP" env-description:"Maximal gap between parts of one object downloaded by one request in KB." env-default:"256"`
+		Readahead int64 `toml:"readahead" env:"BS3_READ_READAHEAD" env-description:"Maximal readahead window of sequential reads in MB. 0 disables readahead." env-default:"8"`
+
+		DiskCachePath string `toml:"disk_cache_path" env:"BS3_READ_DISKCACHEPATH" env-description:"File or block device for the persistent cache of object blocks. Empty string disables the cache." env-default:""`
+		DiskCacheSize int64  `toml:"disk_cache_size" env:"BS3_READ_DISKCACHESIZE" env-description:"Size of the persistent cache of object blocks in GB." env-default:"16"`
 	} `toml:"read"`
 
+	Rbd struct {
+		Pollers    int `toml:"pollers" env:"BS3_RBD_POLLERS" env-description:"Number of goroutines polling the librbd submission ring." env-default:"2"`
+		PollSpinUs int `toml:"poll_spin" env:"BS3_RBD_POLLSPIN" env-description:"How long an idle poller spins before it sleeps on the doorbell. In us." env-default:"50"`
+	} `toml:"rbd"`
+
 	GC struct {
 		Step          int64   `toml:"step" env:"BS3_GC_STEP" env-description:"Step for traversing the extent map for living extents. In blocks." env-default:"1024"`
 		LiveData      float64 `toml:"live_data" env:"BS3_GC_LIVEDATA" env-description:"Live data ratio threshold for threshold GC. This is for the threshold GC which is triggered by the user or systemd timer." env-default:"0.3"`
-		IdleTimeoutMs int64   `toml:"idle_timeout" env:"BS3_GC_IDLETIMEOUT" env-description:"Idle timeout for running GC requests. In ms." env-default:"200"`
+		IdleTimeoutMs int64   `toml:"idle_timeout" env:"BS3_GC_IDLETIMEOUT" env-description:"Idle timeout for running GC requests. Backend requests waiting longer are served first. In ms." env-default:"200"`
 		Wait          int64   `toml:"wait" env:"BS3_GC_WAIT" env-description:"How many seconds wait before next dead GC round. This just for cleaning dead objects with minimal performance impact." env-default:"600"`
 	} `toml:"gc"`
 
+	Checkpoint struct {
+		Interval  int64 `toml:"interval" env:"BS3_CHECKPOINT_INTERVAL" env-description:"Seconds between background checkpoints when new objects were written. 0 disables background checkpoints." env-default:"60"`
+		MaxReplay int64 `toml:"max_replay" env:"BS3_CHECKPOINT_MAXREPLAY" env-description:"Checkpoint is taken when more objects would be replayed after a crash." env-default:"1024"`
+		MaxDeltas int   `toml:"max_deltas" env:"BS3_CHECKPOINT_MAXDELTAS" env-description:"Number of delta checkpoints after which the full checkpoint is taken." env-default:"16"`
+	} `toml:"checkpoint"`
+
+	Trace struct {
+		Enabled bool `toml:"enabled" env:"BS3_TRACE_ENABLED" env-description:"Trace phases of every librbd request. See rbd_trace_dump." env-default:"false"`
+	} `toml:"trace"`
+
 	Log struct {
 		Level  int  `toml:"level" env:"BS3_LOG_LEVEL" env-description:"Log level." env-default:"-1"`
 		Pretty bool `toml:"pretty" env:"BS3_LOG_PRETTY" env-description:"Pretty logging." env-default:"true"`
@@ -96,11 +135,24 @@ func parse() error {
 	Cfg.Write.ChunkSize *= 1024 * 1024
 	Cfg.Write.CollisionSize *= 1024 * 1024
 	Cfg.Read.BufSize *= 1024 * 1024
+	Cfg.Read.CacheSize *= 1024 * 1024
+	Cfg.Read.Readahead *= 1024 * 1024
+	Cfg.Read.MergeGap *= 1024
+	Cfg.Read.DiskCacheSize *= 1024 * 1024 * 1024
 
 	if Cfg.BlockSize != 512 {
 		Cfg.BlockSize = 4096
 	}
 
+	// The extent map addresses at most 2^20-1 blocks in one object.
+	if Cfg.Write.ChunkSize/Cfg.BlockSize >= 1<<20 {
+		return fmt.Errorf("chunk size %d MB is too large for block size %d", Cfg.Write.ChunkSize>>20, Cfg.BlockSize)
+	}
+
+	if Cfg.ExtentMap != "sector" && Cfg.ExtentMap != "tree" {
+		return fmt.Errorf("unknown extent map %q", Cfg.ExtentMap)
+	}
+
 	return nil
 }
 
@@ -35,6 +35,9 @@ import "C"
 import (
 	"fmt"
 	"os"
+	"sync"
+	"sync/atomic"
+	"syscall"
 	"time"
 	"unsafe"
 
@@ -78,35 +81,118 @@ func loggerSetup(pretty bool, level int) {
  * C-Go interface functions
  */
 
-var buseReadWriter *bs3.Bs3
+var (
+	// Backend shared by all volumes. It is created by the first bs3Open.
+	backend     *bs3.Backend
+	backendErr  error
+	backendOnce sync.Once
 
+	// Nonzero once the backend was created successfully. Statistics are
+	// read through it, so querying them never creates the backend.
+	backendReady uint32
+)
+
+// Volumes opened through librbd. Librbd refers to them by handles, which are
+// never reused, hence a request racing with close of its volume finds
+// nothing instead of a different volume.
+var volumes = struct {
+	sync.RWMutex
+	byHandle map[int64]*bs3.Bs3
+	byName   map[string]int64
+	last     int64
+}{
+	byHandle: make(map[int64]*bs3.Bs3),
+	byName:   make(map[string]int64),
+}
+
+// Returns volume with handle or nil if it is not open.
+func volume(handle int64) *bs3.Bs3 {
+	volumes.RLock()
+	defer volumes.RUnlock()
+
+	return volumes.byHandle[handle]
+}
+
+// Reads the configuration and creates the backend when called for the first
+// time. Returns error of the configuration or of the backend creation.
+func setupBackend() error {
+	backendOnce.Do(func() {
+		// Invalid configuration, e.g. too large chunks for the extent
+		// map, would corrupt the data.
+		if backendErr = config.Configure(); backendErr != nil {
+			return
+		}
+		loggerSetup(config.Cfg.Log.Pretty, config.Cfg.Log.Level)
+		log.Info().Str("remote", config.Cfg.S3.Remote).Str("bucket", config.Cfg.S3.Bucket).Msg("Connecting to the backend.")
+
+		backend, backendErr = bs3.NewBackend()
+		if backendErr == nil {
+			atomic.StoreUint32(&backendReady, 1)
+		}
+	})
+
+	return backendErr
+}
+
+// Opens the volume with name and returns its handle or negative errno. One
+// volume can be opened just once at a time.
+//
 //export bs3Open
-func bs3Open() int {
-	//read config
-	config.Configure()
-	loggerSetup(config.Cfg.Log.Pretty, config.Cfg.Log.Level)
-	fmt.Println("Connecting to ", config.Cfg.S3.Remote, " with accesss key ", config.Cfg.S3.AccessKey, " and secret ", config.Cfg.S3.SecretKey)
-	//use name as bucket
-	// config.Cfg.S3.Bucket = name
-
-	var err error
-	buseReadWriter, err = bs3.NewWithDefaults()
-	if err != nil {
-		fmt.Println("bs3Open failed: ", err)
-		return -1
+func bs3Open(name *C.char) int64 {
+	if err := setupBackend(); err != nil {
+		log.Error().Err(err).Msg("Setting up the backend failed.")
+		return -int64(syscall.EIO)
 	}
 
-	buseReadWriter.BusePreRun()
+	volumeName := ""
+	if name != nil {
+		volumeName = C.GoString(name)
+	}
 
-	return 0
+	// Reserve the name with invalid handle 0 so nobody else opens the
+	// volume while it is restored.
+	volumes.Lock()
+	if _, ok := volumes.byName[volumeName]; ok {
+		volumes.Unlock()
+		return -int64(syscall.EBUSY)
+	}
+	volumes.byName[volumeName] = 0
+	volumes.Unlock()
+
+	b := backend.Open(volumeName)
+	b.BusePreRun()
+
+	volumes.Lock()
+	volumes.last++
+	handle := volumes.last
+	volumes.byHandle[handle] = b
+	volumes.byName[volumeName] = handle
+	volumes.Unlock()
+
+	return handle
 }
 
+// Closes the volume with handle. Returns 0 or negative errno.
+//
 //export bs3Close
-func bs3Close() int {
-	if buseReadWriter != nil {
-		buseReadWriter.BusePostRemove()
-		buseReadWriter = nil
+func bs3Close(handle int64) int {
+	volumes.Lock()
+	b := volumes.byHandle[handle]
+	delete(volumes.byHandle, handle)
+	for name, h := range volumes.byName {
+		if h == handle {
+			delete(volumes.byName, name)
+		}
 	}
+	volumes.Unlock()
+
+	if b == nil {
+		return -int(syscall.EBADF)
+	}
+
+	b.BusePostRemove()
+	b.Close()
+
 	return 0
 }
 
@@ -122,32 +208,34 @@ func bs3Stat() (disk_size, block_size uint64) {
 	return
 }
 
-//export bs3Read
-func bs3Read(offset, length int64, buffer []byte, completion *C.AioCompletion) {
-	//convert offset to sector
-	block_size := int64(config.Cfg.BlockSize)
-	sector := offset / block_size
-	blocks := (length + (block_size - 1)) / block_size
+// Returns statistics of the block cache shared by all volumes. Sizes are in
+// bytes. All are zero before the first volume is opened.
+//
+//export bs3CacheStats
+func bs3CacheStats() (size, capacity, hits, misses, evictions uint64) {
+	if atomic.LoadUint32(&backendReady) == 0 {
+		return
+	}
 
-	go func() {
-		buseReadWriter.BuseRead(sector, blocks, buffer)
-		completion.return_value = C.long(length)
-		C.go_aio_read_complete(completion)
-	}()
+	st := backend.CacheStats()
+	blockSize := uint64(config.Cfg.BlockSize)
+
+	return uint64(st.Blocks) * blockSize, uint64(st.Capacity) * blockSize, st.Hits, st.Misses, st.Evictions
 }
 
-//export bs3Write
-func bs3Write(offset, length int64, buffer []byte, completion *C.AioCompletion) {
-	//convert offset to sector
-	block_size := int64(config.Cfg.BlockSize)
-	sector := offset / block_size
-	blocks := (length + (block_size - 1)) / block_size
+// Returns current limits and numbers of uploads and downloads in flight to the
+// backend shared by all volumes. All are zero before the first volume is
+// opened.
+//
+//export bs3Concurrency
+func bs3Concurrency() (uploadLimit, uploads, downloadLimit, downloads uint64) {
+	if atomic.LoadUint32(&backendReady) == 0 {
+		return
+	}
 
-	go func() {
-		buseReadWriter.WriteSingle(sector, blocks, buffer)
-		completion.return_value = C.long(length)
-		C.go_aio_write_complete(completion)
-	}()
+	up, down := backend.Concurrency()
+
+	return uint64(up.Limit), uint64(up.InFlight), uint64(down.Limit), uint64(down.InFlight)
 }
 
 /*
@@ -174,6 +262,7 @@ func bs3Async(completion *C.AioCompletion) {
 	go func() {
 		time.Sleep(time.Duration(1) * time.Second)
 		completion.return_value = 123
+		C.go_aio_read_complete(completion)
 	}()
 }
 
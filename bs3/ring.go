@@ -0,0 +1,412 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+package main
+
+//#include "../mylibrbd/librbd.h"
+//extern void go_aio_reap_completions(void);
+import "C"
+
+import (
+	"runtime"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+	"unsafe"
+
+	"github.com/rs/zerolog/log"
+
+	"github.com/asch/bs3/internal/bs3"
+	"github.com/asch/bs3/internal/config"
+)
+
+// Requests from librbd are passed through the submission ring in the C memory
+// instead of calling into Go for every request. Pollers take them from the
+// ring and hand them over to a fixed pool of workers. Workers push finished
+// requests to the completion ring and one reaper calls back to C once per
+// batch of them. The ring algorithm is the same as in librbd.c, hence both
+// sides can push and pop concurrently.
+
+// Clock id of CLOCK_MONOTONIC in linux.
+const clockMonotonic = 1
+
+// Rings shared with librbd.
+var rings *C.Rings
+
+// Whether requests are traced. Librbd keeps the trace, we just fill the
+// timestamps of the request phases in the completions.
+var tracing bool
+
+// Point in time corresponding to traceClock in CLOCK_MONOTONIC used by librbd.
+// Go monotonic clock runs at the same pace, so the offset is enough to convert
+// between them.
+var (
+	traceStart time.Time
+	traceClock uint64
+)
+
+// Wakes up the reaper. Buffered, so workers never wait for the reaper and
+// multiple wake ups are merged into one.
+var reapSignal = make(chan struct{}, 1)
+
+// Called once by librbd after the rings are initialized. Starts pollers,
+// workers and the reaper.
+//
+//export bs3SetupRings
+func bs3SetupRings(r *C.Rings) {
+	rings = r
+
+	if traceCompiled && config.Cfg.Trace.Enabled {
+		calibrateTraceClock()
+		tracing = true
+		r.trace = 1
+	}
+
+	requests := make(chan *C.AioCompletion, config.Cfg.QueueDepth)
+	for i := 0; i < config.Cfg.QueueDepth; i++ {
+		go serveRequests(requests)
+	}
+
+	pollers := config.Cfg.Rbd.Pollers
+	if pollers < 1 {
+		pollers = 1
+	}
+	for i := 0; i < pollers; i++ {
+		go pollSubmissions(requests)
+	}
+
+	go reapCompletions()
+}
+
+// Takes requests from the submission ring. When the ring is empty, the poller
+// spins for the configured time and then sleeps on the doorbell. Librbd rings
+// the doorbell only when some poller announced that it sleeps.
+func pollSubmissions(requests chan<- *C.AioCompletion) {
+	spin := time.Duration(config.Cfg.Rbd.PollSpinUs) * time.Microsecond
+	sleeping := (*int32)(unsafe.Pointer(&rings.sleeping))
+	var doorbell [8]byte
+
+	for {
+		if c := ringPop(&rings.submissions); c != nil {
+			traceDequeue(c)
+			requests <- c
+			continue
+		}
+
+		if c := spinPop(spin); c != nil {
+			traceDequeue(c)
+			requests <- c
+			continue
+		}
+
+		// Pairs with the fence in submitAio. Either we see the
+		// request pushed before the doorbell was checked, or librbd
+		// sees us sleeping.
+		atomic.AddInt32(sleeping, 1)
+		c := ringPop(&rings.submissions)
+		if c == nil {
+			_, err := syscall.Read(int(rings.doorbell), doorbell[:])
+			if err != nil && err != syscall.EINTR {
+				log.Error().Err(err).Msg("Reading the submission doorbell failed.")
+			}
+		}
+		atomic.AddInt32(sleeping, -1)
+
+		if c != nil {
+			traceDequeue(c)
+			requests <- c
+		}
+	}
+}
+
+// Polls the submission ring for at most spin time. Returns nil when nothing
+// arrived.
+func spinPop(spin time.Duration) *C.AioCompletion {
+	if spin <= 0 {
+		return nil
+	}
+
+	deadline := time.Now().Add(spin)
+	for time.Now().Before(deadline) {
+		runtime.Gosched()
+		if c := ringPop(&rings.submissions); c != nil {
+			return c
+		}
+	}
+
+	return nil
+}
+
+// Executes requests, pushes them to the completion ring and wakes up the
+// reaper. Requests chained by rbd_aio_submit_batch are served together.
+func serveRequests(requests <-chan *C.AioCompletion) {
+	for c := range requests {
+		if c.batch_next != nil {
+			serveBatch(c)
+			continue
+		}
+
+		traceStamp(&c.trace.backend_start)
+		serveRequest(volume(int64(c.handle)), c)
+		traceStamp(&c.trace.backend_end)
+		complete(c)
+	}
+}
+
+// Passes the finished request to librbd.
+func complete(c *C.AioCompletion) {
+	ringPush(&rings.completions, c)
+	select {
+	case reapSignal <- struct{}{}:
+	default:
+	}
+}
+
+// Executes the request described in the completion on volume b. The data are
+// never copied, Go works directly with the caller's buffers. Requests failed by
+// the backend are completed with -EIO.
+func serveRequest(b *bs3.Bs3, c *C.AioCompletion) {
+	if b == nil {
+		c.return_value = -C.long(syscall.EBADF)
+		return
+	}
+
+	sector, blocks := requestBlocks(c)
+
+	var err error
+	c.return_value = C.long(c.len)
+	switch c.op {
+	case C.RBD_AIO_OP_READ:
+		err = b.Readv(sector, blocks, requestSegments(c))
+	case C.RBD_AIO_OP_WRITE:
+		err = b.Writev(sector, blocks, requestSegments(c))
+	case C.RBD_AIO_OP_DISCARD:
+		// Only whole blocks inside the range are discarded. Partial
+		// blocks at the edges are kept, which is allowed for discard.
+		blockSize := uint64(config.Cfg.BlockSize)
+		first := (uint64(c.off) + blockSize - 1) / blockSize
+		end := (uint64(c.off) + uint64(c.len)) / blockSize
+		if end > first {
+			err = b.Discard(int64(first), int64(end-first))
+		}
+		c.return_value = 0
+	case C.RBD_AIO_OP_WRITE_ZEROES:
+		// Blocks are rounded like for writes.
+		err = b.WriteZeroes(sector, blocks)
+	case C.RBD_AIO_OP_FLUSH:
+		c.return_value = 0
+	}
+
+	if err != nil {
+		c.return_value = -C.long(syscall.EIO)
+	}
+}
+
+// Serves requests submitted by one rbd_aio_submit_batch call. Reads are
+// collected and executed by one ReadvBatch, everything else runs concurrently.
+// A flush waits for all requests preceding it in the batch.
+func serveBatch(first *C.AioCompletion) {
+	// The chain has to be walked before any request completes, since
+	// completed requests can be released by the caller.
+	var batch []*C.AioCompletion
+	for c := first; c != nil; c = c.batch_next {
+		batch = append(batch, c)
+	}
+
+	// All requests of one batch belong to one volume.
+	b := volume(int64(first.handle))
+
+	var wg sync.WaitGroup
+	var reads []bs3.VectoredRead
+	var readCompletions []*C.AioCompletion
+
+	startReads := func() {
+		if len(reads) == 0 {
+			return
+		}
+
+		r, rc := reads, readCompletions
+		reads, readCompletions = nil, nil
+
+		wg.Add(1)
+		go func() {
+			defer wg.Done()
+			start := traceNow()
+			err := b.ReadvBatch(r)
+			end := traceNow()
+			for _, c := range rc {
+				c.trace.backend_start = start
+				c.trace.backend_end = end
+				c.return_value = C.long(c.len)
+				if err != nil {
+					c.return_value = -C.long(syscall.EIO)
+				}
+				complete(c)
+			}
+		}()
+	}
+
+	for _, c := range batch {
+		switch c.op {
+		case C.RBD_AIO_OP_READ:
+			if b == nil {
+				serveRequest(b, c)
+				complete(c)
+				continue
+			}
+			sector, blocks := requestBlocks(c)
+			reads = append(reads, bs3.VectoredRead{Sector: sector, Length: blocks, Segments: requestSegments(c)})
+			readCompletions = append(readCompletions, c)
+
+		case C.RBD_AIO_OP_FLUSH:
+			startReads()
+			wg.Wait()
+			traceStamp(&c.trace.backend_start)
+			serveRequest(b, c)
+			traceStamp(&c.trace.backend_end)
+			complete(c)
+
+		default:
+			wg.Add(1)
+			go func(c *C.AioCompletion) {
+				defer wg.Done()
+				traceStamp(&c.trace.backend_start)
+				serveRequest(b, c)
+				traceStamp(&c.trace.backend_end)
+				complete(c)
+			}(c)
+		}
+	}
+
+	startReads()
+	wg.Wait()
+}
+
+// Returns first block and number of blocks touched by the request.
+func requestBlocks(c *C.AioCompletion) (sector, blocks int64) {
+	blockSize := int64(config.Cfg.BlockSize)
+	sector = int64(c.off) / blockSize
+	blocks = (int64(c.len) + (blockSize - 1)) / blockSize
+
+	return
+}
+
+// Returns the caller's buffers of the request as Go slices.
+func requestSegments(c *C.AioCompletion) [][]byte {
+	if c.iovcnt == 0 {
+		return [][]byte{unsafe.Slice((*byte)(unsafe.Pointer(c.data)), int64(c.len))}
+	}
+
+	iov := unsafe.Slice(c.iov, int(c.iovcnt))
+	segments := make([][]byte, len(iov))
+	for i := range iov {
+		segments[i] = unsafe.Slice((*byte)(iov[i].iov_base), int(iov[i].iov_len))
+	}
+
+	return segments
+}
+
+// Finds the offset between Go clock and CLOCK_MONOTONIC. The raw syscall is
+// slow, hence the Go time is taken as the middle of the call.
+func calibrateTraceClock() {
+	var ts syscall.Timespec
+
+	before := time.Now()
+	syscall.Syscall(syscall.SYS_CLOCK_GETTIME, clockMonotonic, uintptr(unsafe.Pointer(&ts)), 0)
+	after := time.Now()
+
+	traceStart = before.Add(after.Sub(before) / 2)
+	traceClock = uint64(ts.Nano())
+}
+
+// Returns current time in CLOCK_MONOTONIC ns of librbd when tracing, otherwise
+// zero.
+func traceNow() C.uint64_t {
+	if !tracing {
+		return 0
+	}
+
+	return C.uint64_t(traceClock + uint64(time.Since(traceStart)))
+}
+
+// Stores current time into the trace timestamp t when tracing.
+func traceStamp(t *C.uint64_t) {
+	if tracing {
+		*t = traceNow()
+	}
+}
+
+// Stamps dequeue time of the request and all requests chained with it in one
+// batch.
+func traceDequeue(first *C.AioCompletion) {
+	if !tracing {
+		return
+	}
+
+	now := traceNow()
+	for c := first; c != nil; c = c.batch_next {
+		c.trace.dequeue = now
+	}
+}
+
+// Calls librbd to complete everything in the completion ring. One call serves
+// all requests finished since the previous one.
+func reapCompletions() {
+	for range reapSignal {
+		C.go_aio_reap_completions()
+	}
+}
+
+// Returns pointer to the sequence number of the cell as a Go type suitable for
+// atomic operations.
+func cellSeq(cell *C.RingCell) *uint64 {
+	return (*uint64)(unsafe.Pointer(&cell.seq))
+}
+
+// Pops completion from the ring. Returns nil when the ring is empty. See
+// ringPop in librbd.c.
+func ringPop(r *C.Ring) *C.AioCompletion {
+	head := (*uint64)(unsafe.Pointer(&r.head))
+	pos := atomic.LoadUint64(head)
+
+	for {
+		cell := &r.cells[pos%C.RBD_RING_SIZE]
+		diff := int64(atomic.LoadUint64(cellSeq(cell)) - (pos + 1))
+
+		if diff == 0 {
+			if atomic.CompareAndSwapUint64(head, pos, pos+1) {
+				c := cell.completion
+				atomic.StoreUint64(cellSeq(cell), pos+C.RBD_RING_SIZE)
+				return c
+			}
+		} else if diff < 0 {
+			return nil
+		}
+
+		pos = atomic.LoadUint64(head)
+	}
+}
+
+// Pushes completion to the ring. When the ring is full, it yields until the
+// consumer makes space. See ringPush in librbd.c.
+func ringPush(r *C.Ring, c *C.AioCompletion) {
+	tail := (*uint64)(unsafe.Pointer(&r.tail))
+	pos := atomic.LoadUint64(tail)
+
+	for {
+		cell := &r.cells[pos%C.RBD_RING_SIZE]
+		diff := int64(atomic.LoadUint64(cellSeq(cell)) - pos)
+
+		if diff == 0 {
+			if atomic.CompareAndSwapUint64(tail, pos, pos+1) {
+				cell.completion = c
+				atomic.StoreUint64(cellSeq(cell), pos+1)
+				return
+			}
+		} else if diff < 0 {
+			runtime.Gosched()
+		}
+
+		pos = atomic.LoadUint64(tail)
+	}
+}
@@ -0,0 +1,9 @@
+// Copyright (C) 2021 Vojtech Aschenbrenner <v@asch.cz>
+
+//go:build !notrace
+// +build !notrace
+
+package main
+
+// Tracing of requests can be compiled out by the notrace build tag.
+const traceCompiled = true
@@ -9,7 +9,7 @@ checkDeps
 
 echo "Building bs3 static library"
 cd bs3
-go build -buildmode c-archive -o libbs3.a main.go
+go build -buildmode c-archive -o libbs3.a .
 cd ..
 
 echo "Building librbd.so"
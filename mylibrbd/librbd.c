@@ -3,11 +3,19 @@
 #include "librbd.h"
 #include "../bs3/libbs3.h"
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sched.h>
 #include <strings.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 void rbd_version(int *major, int *minor, int *extra) {
@@ -23,6 +31,181 @@ const int BLOCK_SIZE_ORDER = 12;
 // The size in bytes of the entire disk
 const size_t DISK_SIZE = 1024 * 1024 * 1024; // 1GB
 
+// Alignment of data written by different threads to avoid false sharing
+#define CACHE_LINE_SIZE 64
+
+static uint64_t nowNs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * Completion ring
+ *
+ * Bounded lock-free queue of completions. Every cell carries a sequence number
+ * telling whether it is free for the producer at given position or ready for
+ * the consumer at given position. Producers and consumers claim positions by
+ * CAS, hence it can be used by multiple producers and consumers. The same
+ * algorithm is implemented in Go in bs3/ring.go.
+ */
+
+static void ringInit(Ring *ring) {
+  ring->head = 0;
+  ring->tail = 0;
+  for (uint64_t i = 0; i < RBD_RING_SIZE; i++) {
+    ring->cells[i].seq = i;
+  }
+}
+
+// Push completion to the ring. When the ring is full, the producer yields
+// until the consumer makes space.
+static void ringPush(Ring *ring, AioCompletion *completion) {
+  uint64_t pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  RingCell *cell;
+  for (;;) {
+    cell = &ring->cells[pos % RBD_RING_SIZE];
+    int64_t diff = (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else {
+      if (diff < 0)
+        sched_yield();
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+  }
+  cell->completion = completion;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Pop completion from the ring. Returns NULL when the ring is empty.
+static AioCompletion *ringPop(Ring *ring) {
+  uint64_t pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  RingCell *cell;
+  for (;;) {
+    cell = &ring->cells[pos % RBD_RING_SIZE];
+    int64_t diff =
+        (int64_t)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+  }
+  AioCompletion *completion = cell->completion;
+  __atomic_store_n(&cell->seq, pos + RBD_RING_SIZE, __ATOMIC_RELEASE);
+  return completion;
+}
+
+// Private state of an opened image. rbd_image_t points to it.
+typedef struct {
+  // Handle of the volume in bs3
+  int64_t handle;
+
+  // Event driven completion mode. See rbd_set_image_notification.
+  struct {
+    // Descriptor signalled when completions are queued, -1 if disabled
+    int fd;
+    int type;
+    // Set when the descriptor was signalled and completions were not polled
+    // since then
+    int signalled;
+    // Completions not polled yet, linked by event_next. The queue is not
+    // bounded, so the reaper never waits for an image which is not polled.
+    pthread_mutex_t lock;
+    AioCompletion *head;
+    AioCompletion *tail;
+  } events;
+} Image;
+
+/*
+ * Submission and completion rings
+ *
+ * Requests are handed to Go by pushing their completions to the submission
+ * ring, without calling into Go. A few Go pollers take them from the ring and
+ * sleep on the doorbell eventfd only when the ring stays empty for a while.
+ * Go pushes finished requests to the completion ring and calls
+ * go_aio_reap_completions once for a whole batch of them.
+ */
+
+static Rings rings;
+static pthread_once_t ringsOnce = PTHREAD_ONCE_INIT;
+
+static void setupTrace(int enabled);
+
+static void setupRings(void) {
+  ringInit(&rings.submissions);
+  ringInit(&rings.completions);
+  rings.doorbell = eventfd(0, EFD_CLOEXEC);
+  rings.sleeping = 0;
+  rings.trace = 0;
+  bs3SetupRings(&rings);
+  setupTrace(rings.trace);
+}
+
+static void completeAio(AioCompletion *completion);
+static void putCompletion(AioCompletion *completion);
+
+// Submit request described in the completion to Go.
+static void submitAio(AioCompletion *completion) {
+  ringPush(&rings.submissions, completion);
+
+  // Pairs with the increment of sleeping pollers in Go, which check the
+  // ring again after they announce they are going to sleep.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&rings.sleeping, __ATOMIC_RELAXED) > 0) {
+    uint64_t one = 1;
+    ssize_t ret = write(rings.doorbell, &one, sizeof(one));
+    (void)ret; // eventfd counter cannot overflow with our increments
+  }
+}
+
+// Called from Go code when it has pushed finished requests to the completion
+// ring.
+void go_aio_reap_completions(void) {
+  AioCompletion *completion;
+  while ((completion = ringPop(&rings.completions)) != NULL) {
+    completeAio(completion);
+  }
+}
+
+// Fill the request descriptor in the completion. The iovec array is copied,
+// since the caller does not have to keep it after the submission. The request
+// holds a reference of the completion until it is completed.
+static void describeAio(AioCompletion *completion, rbd_image_t image, int op,
+                        uint64_t off, size_t len, const char *data,
+                        const struct iovec *iov, int iovcnt) {
+  __atomic_fetch_add(&completion->refs, 1, __ATOMIC_RELAXED);
+  completion->image = image;
+  completion->handle = ((Image *)image)->handle;
+  completion->op = op;
+  completion->off = off;
+  completion->len = len;
+  completion->data = (char *)data;
+  completion->iovcnt = iovcnt;
+  completion->batch_next = NULL;
+#ifndef RBD_NO_TRACE
+  completion->trace.submit = rings.trace ? nowNs() : 0;
+#endif
+  completion->iov = completion->iov_inline;
+  if (iovcnt > RBD_AIO_INLINE_IOVS) {
+    completion->iov = malloc(iovcnt * sizeof(struct iovec));
+  }
+  if (iovcnt > 0) {
+    memcpy(completion->iov, iov, iovcnt * sizeof(struct iovec));
+  }
+}
+
+/*
+ * Images
+ */
+
 // Always successfully create an image
 int rbd_create(rados_ioctx_t io, const char *name, uint64_t size, int *order) {
   *order = BLOCK_SIZE_ORDER;
@@ -37,16 +220,41 @@ int rbd_remove(rados_ioctx_t io, const char *name) {
 
 int rbd_open(rados_ioctx_t io, const char *name, rbd_image_t *image,
              const char *snap_name) {
-  int ret = bs3Open();
-  if (ret < 0)
-    return ret;
-  *image = (void *)0xCAFEBABE;
-  return ret;
+  Image *img = aligned_alloc(CACHE_LINE_SIZE, sizeof(Image));
+  if (img == NULL)
+    return -ENOMEM;
+  img->events.fd = -1;
+  img->events.signalled = 0;
+  pthread_mutex_init(&img->events.lock, NULL);
+  img->events.head = NULL;
+  img->events.tail = NULL;
+
+  // Every image is a separate volume in bs3 named by the image name
+  GoInt64 handle = bs3Open((char *)name);
+  if (handle < 0) {
+    free(img);
+    return handle;
+  }
+  img->handle = handle;
+  pthread_once(&ringsOnce, setupRings);
+  *image = img;
+  return 0;
 }
 
 int rbd_close(rbd_image_t image) {
   // Call bs3Close in go code
-  return bs3Close();
+  Image *img = image;
+  int ret = bs3Close(img->handle);
+  // Drop references of completions which were never polled
+  AioCompletion *completion = img->events.head;
+  while (completion != NULL) {
+    AioCompletion *next = completion->event_next;
+    putCompletion(completion);
+    completion = next;
+  }
+  pthread_mutex_destroy(&img->events.lock);
+  free(image);
+  return ret;
 }
 
 int rbd_stat(rbd_image_t image, rbd_image_info_t *info, size_t infosize) {
@@ -69,6 +277,23 @@ int rbd_get_size(rbd_image_t image, uint64_t *size) {
   return 0;
 }
 
+void rbd_cache_stats(rbd_cache_stats_t *stats) {
+  struct bs3CacheStats_return ret = bs3CacheStats();
+  stats->size = ret.r0;
+  stats->capacity = ret.r1;
+  stats->hits = ret.r2;
+  stats->misses = ret.r3;
+  stats->evictions = ret.r4;
+}
+
+void rbd_concurrency(rbd_concurrency_t *concurrency) {
+  struct bs3Concurrency_return ret = bs3Concurrency();
+  concurrency->upload_limit = ret.r0;
+  concurrency->uploads = ret.r1;
+  concurrency->download_limit = ret.r2;
+  concurrency->downloads = ret.r3;
+}
+
 int rbd_resize(rbd_image_t image, uint64_t size) {
   return -1; // Not supported
 }
@@ -77,40 +302,194 @@ int rbd_resize(rbd_image_t image, uint64_t size) {
  * Read/Write functions
  */
 
-// Copy data from buf to the scattered buffers in iov
-static void copyToIov(void *buf, const struct iovec *iov, int iovcnt) {
-  for (int i = 0; i < iovcnt; i++) {
-    memcpy(iov[i].iov_base, buf, iov[i].iov_len);
-    buf += iov[i].iov_len;
+/*
+ * Request tracing
+ *
+ * Binary ring of the latest requests. Writers claim slots by one atomic
+ * increment and never wait. Every slot is guarded by a sequence number, which
+ * is odd while the slot is written, so rbd_trace_dump skips records it copied
+ * while they were overwritten. Tracing can be compiled out by RBD_NO_TRACE and
+ * it is disabled at run time unless bs3 enables it.
+ */
+
+#ifndef RBD_NO_TRACE
+
+// Number of kept records, power of two
+#define TRACE_SIZE 16384
+
+typedef struct {
+  uint64_t seq;
+  rbd_trace_record_t record;
+} TraceSlot;
+
+static TraceSlot *traceSlots;
+static uint64_t tracePos __attribute__((aligned(CACHE_LINE_SIZE)));
+
+static void setupTrace(int enabled) {
+  if (enabled)
+    traceSlots = calloc(TRACE_SIZE, sizeof(TraceSlot));
+}
+
+// Record the finished request. Requests which were not submitted through the
+// submission ring are not traced.
+static void traceRequest(AioCompletion *completion) {
+  if (traceSlots == NULL || completion->trace.submit == 0)
+    return;
+
+  uint64_t pos = __atomic_fetch_add(&tracePos, 1, __ATOMIC_RELAXED);
+  TraceSlot *slot = &traceSlots[pos % TRACE_SIZE];
+
+  __atomic_store_n(&slot->seq, 2 * pos + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  rbd_trace_record_t *r = &slot->record;
+  r->op = completion->op;
+  r->volume = completion->handle;
+  r->off = completion->off;
+  r->len = completion->len;
+  r->ret = completion->return_value;
+  r->submit_ns = completion->trace.submit;
+  r->dequeue_ns = completion->trace.dequeue;
+  r->backend_start_ns = completion->trace.backend_start;
+  r->backend_end_ns = completion->trace.backend_end;
+  r->complete_ns = nowNs();
+
+  __atomic_store_n(&slot->seq, 2 * pos + 2, __ATOMIC_RELEASE);
+}
+
+int rbd_trace_dump(rbd_trace_record_t *records, int max) {
+  if (traceSlots == NULL || max <= 0)
+    return 0;
+
+  uint64_t end = __atomic_load_n(&tracePos, __ATOMIC_ACQUIRE);
+  uint64_t start = end > TRACE_SIZE ? end - TRACE_SIZE : 0;
+  if (end - start > (uint64_t)max)
+    start = end - max;
+
+  int n = 0;
+  for (uint64_t pos = start; pos < end; pos++) {
+    TraceSlot *slot = &traceSlots[pos % TRACE_SIZE];
+    if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != 2 * pos + 2)
+      continue;
+    records[n] = slot->record;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != 2 * pos + 2)
+      continue;
+    n++;
   }
+  return n;
 }
 
-// copy from the scattered buffers in iov into contiguous buffer buf
-static void copyFromIov(void *buf, const struct iovec *iov, int iovcnt) {
-  for (int i = 0; i < iovcnt; i++) {
-    memcpy(buf, iov[i].iov_base, iov[i].iov_len);
-    buf += iov[i].iov_len;
+#else
+
+static void setupTrace(int enabled) {}
+
+static void traceRequest(AioCompletion *completion) {}
+
+int rbd_trace_dump(rbd_trace_record_t *records, int max) { return -ENOSYS; }
+
+#endif
+
+/*
+ * Completion signalling
+ *
+ * The state of a completion is a futex word. Waiters announce themselves by
+ * moving it from PENDING to WAITING and sleep on it. The completing thread
+ * wakes them only when there is somebody sleeping.
+ */
+
+enum {
+  AIO_PENDING = 0,
+  AIO_WAITING = 1,
+  AIO_COMPLETE = 2,
+};
+
+static long futex(unsigned int *uaddr, int op, unsigned int val) {
+  return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+// Signal the notification descriptor of the image, unless it is already
+// signalled and not polled yet.
+static void signalImage(Image *img) {
+  if (__atomic_exchange_n(&img->events.signalled, 1, __ATOMIC_SEQ_CST))
+    return;
+
+  ssize_t ret;
+  if (img->events.type == EVENT_TYPE_EVENTFD) {
+    uint64_t one = 1;
+    ret = write(img->events.fd, &one, sizeof(one));
+  } else {
+    char one = 1;
+    ret = write(img->events.fd, &one, sizeof(one));
   }
+  (void)ret; // Full pipe is signalled anyway
+}
+
+// Append the completion to the events of the image. The queue holds a
+// reference until rbd_poll_io_events takes the completion.
+static void queueEvent(Image *img, AioCompletion *completion) {
+  __atomic_fetch_add(&completion->refs, 1, __ATOMIC_RELAXED);
+  completion->event_next = NULL;
+
+  pthread_mutex_lock(&img->events.lock);
+  if (img->events.tail != NULL)
+    img->events.tail->event_next = completion;
+  else
+    img->events.head = completion;
+  img->events.tail = completion;
+  pthread_mutex_unlock(&img->events.lock);
+}
+
+// Queue the completion for rbd_poll_io_events, call the user callback, mark
+// the request as complete and wake up waiters. return_value has to be set
+// before. The completion is queued and the callback runs before the completion
+// is published. The callback or a waiter may release it, the reference of the
+// request keeps it alive until the very end.
+static void completeAio(AioCompletion *completion) {
+  rbd_callback_t complete_cb = completion->complete_cb;
+  void *cb_arg = completion->cb_arg;
+  void *image = completion->image;
+  int internal = completion->internal;
+
+  traceRequest(completion);
+
+  free(completion->buf);
+  completion->buf = NULL;
+  if (completion->iov != completion->iov_inline)
+    free(completion->iov);
+  completion->iov = completion->iov_inline;
+
+  // With event notifications the completion is also queued for
+  // rbd_poll_io_events. Completions of synchronous calls are never queued.
+  Image *img = image;
+  if (img != NULL && !internal && img->events.fd >= 0) {
+    queueEvent(img, completion);
+    signalImage(img);
+  }
+
+  if (complete_cb != NULL)
+    complete_cb(completion, cb_arg);
+
+  if (__atomic_exchange_n(&completion->state, AIO_COMPLETE, __ATOMIC_RELEASE) ==
+      AIO_WAITING) {
+    futex(&completion->state, FUTEX_WAKE_PRIVATE, INT_MAX);
+  }
+
+  // Nothing may touch the completion after this.
+  putCompletion(completion);
 }
 
 void ignore_completion_callback(rbd_completion_t cb, void *arg) {}
 
 // Called from Go code when it has completed an async read operation.
 void go_aio_read_complete(AioCompletion *completion) {
-  printf("go_aio_read_complete\n");
-  if (completion->iovcnt > 0) {
-    // For readv, copy from temp buf to user provided iov buffers
-    copyToIov(completion->buf, completion->iov, completion->iovcnt);
-    free(completion->buf);
-  }
-  // Call user callback
-  completion->complete_cb(completion, completion->cb_arg);
-  // completion gets freed after user callback
+  completeAio(completion);
 }
 
 ssize_t rbd_read(rbd_image_t image, uint64_t ofs, size_t len, char *buf) {
   rbd_completion_t completion;
   rbd_aio_create_completion(NULL, ignore_completion_callback, &completion);
+  ((AioCompletion *)completion)->internal = 1;
 
   rbd_aio_read(image, ofs, len, buf, completion);
   rbd_aio_wait_for_complete(completion);
@@ -122,9 +501,8 @@ ssize_t rbd_read(rbd_image_t image, uint64_t ofs, size_t len, char *buf) {
 
 int rbd_aio_read(rbd_image_t image, uint64_t off, size_t len, char *buf,
                  rbd_completion_t c) {
-  AioCompletion *completion = (AioCompletion *)c;
-  GoSlice buffer = {.data = buf, .len = len, .cap = len};
-  bs3Read(off, len, buffer, completion);
+  describeAio(c, image, RBD_AIO_OP_READ, off, len, buf, NULL, 0);
+  submitAio(c);
   return 0;
 }
 
@@ -133,42 +511,28 @@ int rbd_aio_readv(rbd_image_t image, const struct iovec *iov, int iovcnt,
   if (iovcnt == 1) {
     return rbd_aio_read(image, off, iov[0].iov_len, iov[0].iov_base, c);
   }
-  // Go code only supports a single contiguous buffer but this function gives us
-  // scattered buffers in iov. We therefore read into a contiguous buffer and
-  // then copy into iov buffers in the callback.
+  // Go reads directly into the scattered buffers.
   size_t len = 0;
   for (int i = 0; i < iovcnt; i++) {
     len += iov[i].iov_len;
   }
-  void *buf = malloc(len);
-  // indicate in the completion that buf needs to be copied into iov in the
-  // callback
-  AioCompletion *completion = (AioCompletion *)c;
-  completion->iov = iov;
-  completion->iovcnt = iovcnt;
-  completion->buf = buf;
-
+  describeAio(c, image, RBD_AIO_OP_READ, off, len, NULL, iov, iovcnt);
+  submitAio(c);
   return 0;
 }
 
 // Called from Go code when it has completed an async write operation.
 void go_aio_write_complete(AioCompletion *completion) {
-  printf("go_aio_write_complete\n");
-  if (completion->iovcnt > 0) {
-    // For writev, release the temp buffer
-    free(completion->buf);
-  }
-  // Call user callback
-  printf("Calling user callback\n");
-  completion->complete_cb(completion, completion->cb_arg);
-  printf("calling user callback finished\n");
-  // completion gets freed after user callback
+  // Release the temporary buffer and call user
+  // callback
+  completeAio(completion);
 }
 
 ssize_t rbd_write(rbd_image_t image, uint64_t ofs, size_t len,
                   const char *buf) {
   rbd_completion_t completion;
   rbd_aio_create_completion(NULL, ignore_completion_callback, &completion);
+  ((AioCompletion *)completion)->internal = 1;
 
   rbd_aio_write(image, ofs, len, buf, completion);
   rbd_aio_wait_for_complete(completion);
@@ -180,9 +544,8 @@ ssize_t rbd_write(rbd_image_t image, uint64_t ofs, size_t len,
 
 int rbd_aio_write(rbd_image_t image, uint64_t off, size_t len, const char *buf,
                   rbd_completion_t c) {
-  AioCompletion *completion = (AioCompletion *)c;
-  GoSlice buffer = {.data = buf, .len = len, .cap = len};
-  bs3Write(off, len, buffer, completion);
+  describeAio(c, image, RBD_AIO_OP_WRITE, off, len, buf, NULL, 0);
+  submitAio(c);
   return 0;
 }
 
@@ -191,36 +554,29 @@ int rbd_aio_writev(rbd_image_t image, const struct iovec *iov, int iovcnt,
   if (iovcnt == 1) {
     return rbd_aio_write(image, off, iov[0].iov_len, iov[0].iov_base, c);
   }
+  // Go gathers the data directly from the scattered buffers.
   size_t len = 0;
   for (int i = 0; i < iovcnt; i++) {
     len += iov[i].iov_len;
   }
-  void *buf = malloc(len);
-  copyFromIov(buf, iov, iovcnt);
-  AioCompletion *completion = (AioCompletion *)c;
-  completion->iovcnt = iovcnt;
-  completion->buf = buf;
-  completion->iov = iov; // not used by write callback
+  describeAio(c, image, RBD_AIO_OP_WRITE, off, len, NULL, iov, iovcnt);
+  submitAio(c);
   return 0;
 }
 
 int rbd_aio_discard(rbd_image_t image, uint64_t off, uint64_t len,
                     rbd_completion_t c) {
-  AioCompletion *completion = (AioCompletion *)c;
-  completion->return_value = 1; // success
-  completion->complete_cb(c, completion->cb_arg);
+  describeAio(c, image, RBD_AIO_OP_DISCARD, off, len, NULL, NULL, 0);
+  submitAio(c);
   return 0;
 }
 int rbd_aio_write_zeroes(rbd_image_t image, uint64_t off, size_t len,
                          rbd_completion_t c, int zero_flags, int op_flags) {
-  AioCompletion *completion = (AioCompletion *)c;
-  void *zeros = malloc(len);
-  bzero(zeros, len);
-  // Force callback to free our buffer
-  completion->buf = zeros;
-  completion->iovcnt = 1;
-
-  return rbd_aio_write(image, off, len, zeros, c);
+  // Zeroing is just recorded in the extent map, no data are uploaded.
+  // Thick provisioning is meaningless for bs3, hence flags are ignored.
+  describeAio(c, image, RBD_AIO_OP_WRITE_ZEROES, off, len, NULL, NULL, 0);
+  submitAio(c);
+  return 0;
 }
 
 // Used by FIO in rbd.c function _fio_rbd_connect
@@ -231,17 +587,317 @@ int rbd_flush(rbd_image_t image) {
 }
 
 
+int rbd_aio_submit_batch(rbd_image_t image, rbd_aio_request_t *reqs, int n) {
+  for (int i = 0; i < n; i++) {
+    if (reqs[i].op < RBD_AIO_OP_READ || reqs[i].op > RBD_AIO_OP_WRITE_ZEROES ||
+        reqs[i].iovcnt < 0)
+      return -EINVAL;
+  }
+  if (n == 0)
+    return 0;
+
+  // Requests are chained and only the first one goes through the
+  // submission ring, hence the whole batch costs one push and at most one
+  // doorbell.
+  for (int i = n - 1; i >= 0; i--) {
+    rbd_aio_request_t *r = &reqs[i];
+    size_t len = r->len;
+    if (r->iovcnt > 0) {
+      len = 0;
+      for (int k = 0; k < r->iovcnt; k++) {
+        len += r->iov[k].iov_len;
+      }
+    }
+    describeAio(r->comp, image, r->op, r->off, len, r->buf, r->iov, r->iovcnt);
+    if (i + 1 < n)
+      ((AioCompletion *)r->comp)->batch_next = reqs[i + 1].comp;
+  }
+  submitAio(reqs[0].comp);
+  return 0;
+}
+
 /*
  * Cache operations
  */
 
 int rbd_aio_flush(rbd_image_t image, rbd_completion_t c) {
   AioCompletion *completion = (AioCompletion *)c;
-  completion->complete_cb(c, completion->cb_arg);
+  __atomic_fetch_add(&completion->refs, 1, __ATOMIC_RELAXED);
+  completion->image = image;
+  completion->handle = ((Image *)image)->handle;
+  completion->op = RBD_AIO_OP_FLUSH;
+  completion->off = 0;
+  completion->len = 0;
+  completion->return_value = 0;
+  // Completed right away without the submission ring, hence not traced.
+  completion->trace.submit = 0;
+  completeAio(completion);
   return 0;
 }
 int rbd_invalidate_cache(rbd_image_t image) { return 0; }
 
+/*
+ * Event driven completions
+ */
+
+int rbd_set_image_notification(rbd_image_t image, int fd, int type) {
+  Image *img = image;
+  if (type != EVENT_TYPE_PIPE && type != EVENT_TYPE_EVENTFD)
+    return -EINVAL;
+  img->events.type = type;
+  __atomic_store_n(&img->events.fd, fd, __ATOMIC_RELEASE);
+  return 0;
+}
+
+int rbd_poll_io_events(rbd_image_t image, rbd_completion_t *comps,
+                       int numcomp) {
+  Image *img = image;
+  int n = 0;
+
+  // Clear the flag first. Completions queued from now on signal again.
+  __atomic_store_n(&img->events.signalled, 0, __ATOMIC_SEQ_CST);
+
+  pthread_mutex_lock(&img->events.lock);
+  AioCompletion *completion = img->events.head;
+  while (n < numcomp && completion != NULL) {
+    AioCompletion *next = completion->event_next;
+    // Completions are queued before their callback runs. The reference of
+    // the request keeps them alive while it runs, hence the caller may
+    // release them without waiting. The reference of the queue is dropped.
+    if (!__atomic_load_n(&completion->released, __ATOMIC_ACQUIRE))
+      comps[n++] = completion;
+    putCompletion(completion);
+    completion = next;
+  }
+  img->events.head = completion;
+  if (completion == NULL)
+    img->events.tail = NULL;
+  pthread_mutex_unlock(&img->events.lock);
+
+  // The caller did not take everything. Signal again so it comes back.
+  if (completion != NULL)
+    signalImage(img);
+
+  return n;
+}
+
+/*
+ * AIO completion pool
+ *
+ * Completions are allocated in slabs and never returned to the system. Every
+ * thread keeps a small cache of free completions so that the common
+ * create/release pair does not touch any shared memory. Threads exchange free
+ * completions in batches through a lock-free stack shared by all threads.
+ */
+
+#define COMPLETIONS_PER_SLAB 256
+#define MAX_SLABS 4096
+#define THREAD_CACHE_SIZE 64
+
+// Index of a completion which was allocated outside of the slabs because all
+// slabs are used up. Such completion is freed on release.
+#define NOT_POOLED UINT32_MAX
+
+// Completion padded to its own cache line so that completions signalled by
+// different threads never share one.
+typedef struct {
+  AioCompletion completion;
+  // Position of the slot in the pool
+  uint32_t index;
+  // Next free slot in the shared free stack, offset by one. 0 is the end.
+  uint32_t next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) CompletionSlot;
+
+typedef struct {
+  CompletionSlot *slots[THREAD_CACHE_SIZE];
+  int count;
+  // Whether releaseThreadCache is registered for the thread
+  int registered;
+  // Allocations not yet added to the shared counters
+  uint64_t hits;
+  uint64_t misses;
+} CompletionCache;
+
+static struct {
+  // Slabs are published with release semantics and never freed, hence
+  // they can be read without any lock.
+  CompletionSlot *slabs[MAX_SLABS];
+  uint32_t nslabs;
+  // Serializes only slab allocation
+  pthread_mutex_t grow_lock;
+  // Top of the shared free stack. Upper 32 bits are ABA tag, lower 32 bits
+  // are index of the top slot offset by one.
+  uint64_t free_top __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint64_t hits __attribute__((aligned(CACHE_LINE_SIZE)));
+  uint64_t misses;
+  // Used only for returning the cache of exiting threads
+  pthread_key_t cache_key;
+  pthread_once_t cache_key_once;
+} pool = {
+    .grow_lock = PTHREAD_MUTEX_INITIALIZER,
+    .cache_key_once = PTHREAD_ONCE_INIT,
+};
+
+static __thread CompletionCache threadCache;
+
+static CompletionSlot *slotAt(uint32_t index) {
+  CompletionSlot *slab = __atomic_load_n(&pool.slabs[index / COMPLETIONS_PER_SLAB],
+                                         __ATOMIC_ACQUIRE);
+  return &slab[index % COMPLETIONS_PER_SLAB];
+}
+
+static void pushFree(CompletionSlot *slot) {
+  uint64_t top = __atomic_load_n(&pool.free_top, __ATOMIC_RELAXED);
+  uint64_t new_top;
+  do {
+    __atomic_store_n(&slot->next, (uint32_t)top, __ATOMIC_RELAXED);
+    new_top = ((top >> 32) + 1) << 32 | (slot->index + 1);
+  } while (!__atomic_compare_exchange_n(&pool.free_top, &top, new_top, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static CompletionSlot *popFree(void) {
+  uint64_t top = __atomic_load_n(&pool.free_top, __ATOMIC_ACQUIRE);
+  CompletionSlot *slot;
+  uint64_t new_top;
+  do {
+    if ((uint32_t)top == 0)
+      return NULL;
+    slot = slotAt((uint32_t)top - 1);
+    // Slot may be concurrently popped and pushed again by someone else.
+    // Then the tag differs and the CAS fails.
+    new_top = ((top >> 32) + 1) << 32 |
+              __atomic_load_n(&slot->next, __ATOMIC_RELAXED);
+  } while (!__atomic_compare_exchange_n(&pool.free_top, &top, new_top, 1,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+  return slot;
+}
+
+static void flushCacheCounters(CompletionCache *cache) {
+  __atomic_fetch_add(&pool.hits, cache->hits, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&pool.misses, cache->misses, __ATOMIC_RELAXED);
+  cache->hits = 0;
+  cache->misses = 0;
+}
+
+// Thread exit destructor returning the cached completions to the shared stack.
+static void releaseThreadCache(void *arg) {
+  CompletionCache *cache = arg;
+  while (cache->count > 0) {
+    pushFree(cache->slots[--cache->count]);
+  }
+  flushCacheCounters(cache);
+}
+
+static void createCacheKey(void) {
+  pthread_key_create(&pool.cache_key, releaseThreadCache);
+}
+
+// Returns cache of the calling thread. It is returned to the shared stack when
+// the thread exits, no matter whether the thread allocates or only frees.
+static CompletionCache *getThreadCache(void) {
+  CompletionCache *cache = &threadCache;
+  if (!cache->registered) {
+    pthread_once(&pool.cache_key_once, createCacheKey);
+    pthread_setspecific(pool.cache_key, cache);
+    cache->registered = 1;
+  }
+  return cache;
+}
+
+// Allocate a new slab, keep part of it in the thread cache and push the rest to
+// the shared stack. Returns 0 when the pool cannot grow anymore.
+static int growPool(CompletionCache *cache) {
+  pthread_mutex_lock(&pool.grow_lock);
+  uint32_t n = pool.nslabs;
+  if (n == MAX_SLABS) {
+    pthread_mutex_unlock(&pool.grow_lock);
+    return 0;
+  }
+  CompletionSlot *slab =
+      aligned_alloc(CACHE_LINE_SIZE, COMPLETIONS_PER_SLAB * sizeof(CompletionSlot));
+  if (slab == NULL) {
+    pthread_mutex_unlock(&pool.grow_lock);
+    return 0;
+  }
+  for (uint32_t i = 0; i < COMPLETIONS_PER_SLAB; i++) {
+    slab[i].index = n * COMPLETIONS_PER_SLAB + i;
+  }
+  __atomic_store_n(&pool.slabs[n], slab, __ATOMIC_RELEASE);
+  __atomic_store_n(&pool.nslabs, n + 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&pool.grow_lock);
+
+  int i = 0;
+  for (; i < THREAD_CACHE_SIZE / 2; i++) {
+    cache->slots[cache->count++] = &slab[i];
+  }
+  for (; i < COMPLETIONS_PER_SLAB; i++) {
+    pushFree(&slab[i]);
+  }
+  return 1;
+}
+
+static AioCompletion *allocCompletion(void) {
+  CompletionCache *cache = getThreadCache();
+
+  if (cache->count > 0) {
+    cache->hits++;
+  } else {
+    cache->misses++;
+    flushCacheCounters(cache);
+
+    CompletionSlot *slot;
+    while (cache->count < THREAD_CACHE_SIZE / 2 && (slot = popFree()) != NULL) {
+      cache->slots[cache->count++] = slot;
+    }
+    if (cache->count == 0 && !growPool(cache)) {
+      slot = aligned_alloc(CACHE_LINE_SIZE, sizeof(CompletionSlot));
+      if (slot == NULL)
+        return NULL;
+      slot->index = NOT_POOLED;
+      return &slot->completion;
+    }
+  }
+
+  return &cache->slots[--cache->count]->completion;
+}
+
+static void freeCompletion(AioCompletion *completion) {
+  CompletionSlot *slot = (CompletionSlot *)completion;
+
+  if (slot->index == NOT_POOLED) {
+    free(slot);
+    return;
+  }
+
+  CompletionCache *cache = getThreadCache();
+
+  if (cache->count == THREAD_CACHE_SIZE) {
+    // Give half of the cache to other threads. Completions are often
+    // created and released by different threads.
+    while (cache->count > THREAD_CACHE_SIZE / 2) {
+      pushFree(cache->slots[--cache->count]);
+    }
+    flushCacheCounters(cache);
+  }
+  cache->slots[cache->count++] = slot;
+}
+
+// Drops one reference of the completion and returns it to the pool when it was
+// the last one.
+static void putCompletion(AioCompletion *completion) {
+  if (__atomic_sub_fetch(&completion->refs, 1, __ATOMIC_ACQ_REL) == 0)
+    freeCompletion(completion);
+}
+
+void rbd_completion_pool_stats(rbd_completion_pool_stats_t *stats) {
+  flushCacheCounters(&threadCache);
+  stats->size = (uint64_t)__atomic_load_n(&pool.nslabs, __ATOMIC_ACQUIRE) *
+                COMPLETIONS_PER_SLAB;
+  stats->hits = __atomic_load_n(&pool.hits, __ATOMIC_RELAXED);
+  stats->misses = __atomic_load_n(&pool.misses, __ATOMIC_RELAXED);
+}
+
 /*
  * AIO completion functions
  */
@@ -249,19 +905,36 @@ int rbd_invalidate_cache(rbd_image_t image) { return 0; }
 int rbd_aio_create_completion(void *cb_arg, rbd_callback_t complete_cb,
                               rbd_completion_t *c) {
 
-  AioCompletion *completion = malloc(sizeof(AioCompletion));
+  AioCompletion *completion = allocCompletion();
+  if (completion == NULL)
+    return -ENOMEM;
   completion->cb_arg = cb_arg;
   completion->complete_cb = complete_cb;
+  completion->return_value = 0;
   completion->buf = NULL;
-  completion->iov = NULL;
+  completion->state = AIO_PENDING;
+  completion->refs = 1;
+  completion->released = 0;
+  completion->image = NULL;
+  completion->handle = 0;
+  completion->op = 0;
+  completion->off = 0;
+  completion->len = 0;
+  // Pooled completions keep the timestamps of their previous request.
+  memset(&completion->trace, 0, sizeof(completion->trace));
+  completion->internal = 0;
+  completion->iov = completion->iov_inline;
   completion->iovcnt = 0;
   *c = completion;
   return 0;
 }
 
+// The completion is returned to the pool once the request is completed too,
+// hence it can be released even from its callback.
 void rbd_aio_release(rbd_completion_t c) {
-  // Generally ensure that c is not used anymore, esp in Go code
-  free(c);
+  AioCompletion *completion = (AioCompletion *)c;
+  __atomic_store_n(&completion->released, 1, __ATOMIC_RELEASE);
+  putCompletion(completion);
 }
 
 ssize_t rbd_aio_get_return_value(rbd_completion_t c) {
@@ -276,18 +949,104 @@ void *rbd_aio_get_arg(rbd_completion_t c) {
 
 int rbd_aio_is_complete(rbd_completion_t c) {
   AioCompletion *completion = (AioCompletion *)c;
-  return completion->return_value != 0;
+  return __atomic_load_n(&completion->state, __ATOMIC_ACQUIRE) == AIO_COMPLETE;
+}
+
+/*
+ * Waiting for completion
+ *
+ * Waiters spin for a while before they go to sleep on the futex, since
+ * sleeping and waking up costs several microseconds. Every thread adapts its
+ * spin budget: it doubles when the request completes while spinning or soon
+ * after the thread went to sleep, and halves when the wait was long and
+ * spinning would be just wasted CPU time.
+ */
+
+#define MIN_SPIN 16
+#define MAX_SPIN 16384
+
+// Waits shorter than this would have been cheaper to spin through.
+#define SHORT_WAIT_NS 20000
+
+static __thread unsigned int spinBudget = MIN_SPIN;
+
+static struct {
+  uint64_t waits;
+  uint64_t spun;
+  uint64_t slept;
+  uint64_t total_ns;
+  uint64_t max_ns;
+} waitStats;
+
+static inline void cpuRelax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t recordWait(uint64_t start, int slept) {
+  uint64_t ns = nowNs() - start;
+  __atomic_fetch_add(&waitStats.waits, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(slept ? &waitStats.slept : &waitStats.spun, 1,
+                     __ATOMIC_RELAXED);
+  __atomic_fetch_add(&waitStats.total_ns, ns, __ATOMIC_RELAXED);
+
+  uint64_t max = __atomic_load_n(&waitStats.max_ns, __ATOMIC_RELAXED);
+  while (ns > max && !__atomic_compare_exchange_n(&waitStats.max_ns, &max, ns, 1,
+                                                  __ATOMIC_RELAXED,
+                                                  __ATOMIC_RELAXED))
+    ;
+  return ns;
 }
 
 int rbd_aio_wait_for_complete(rbd_completion_t c) {
-  // perform spin loop on a return_value
   AioCompletion *completion = (AioCompletion *)c;
-  while (completion->return_value == 0) {
-    usleep(5);
+  uint64_t start = nowNs();
+
+  // Spinning on a single CPU only delays the thread which completes us.
+  static long cpus;
+  if (cpus == 0)
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  unsigned int budget = cpus > 1 ? spinBudget : 0;
+
+  for (unsigned int i = 0; i < budget; i++) {
+    if (__atomic_load_n(&completion->state, __ATOMIC_ACQUIRE) == AIO_COMPLETE) {
+      if (spinBudget < MAX_SPIN)
+        spinBudget *= 2;
+      recordWait(start, 0);
+      return 0;
+    }
+    cpuRelax();
+  }
+
+  unsigned int state = AIO_PENDING;
+  __atomic_compare_exchange_n(&completion->state, &state, AIO_WAITING, 0,
+                              __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE);
+  // Either we announced ourselves or somebody else already did. Sleep until
+  // the state changes to complete. Spurious wake ups just loop.
+  while (__atomic_load_n(&completion->state, __ATOMIC_ACQUIRE) != AIO_COMPLETE) {
+    futex(&completion->state, FUTEX_WAIT_PRIVATE, AIO_WAITING);
+  }
+
+  if (recordWait(start, 1) < SHORT_WAIT_NS) {
+    if (spinBudget < MAX_SPIN)
+      spinBudget *= 2;
+  } else if (spinBudget > MIN_SPIN) {
+    spinBudget /= 2;
   }
   return 0;
 }
 
+void rbd_aio_wait_stats(rbd_aio_wait_stats_t *stats) {
+  stats->waits = __atomic_load_n(&waitStats.waits, __ATOMIC_RELAXED);
+  stats->spun = __atomic_load_n(&waitStats.spun, __ATOMIC_RELAXED);
+  stats->slept = __atomic_load_n(&waitStats.slept, __ATOMIC_RELAXED);
+  stats->total_ns = __atomic_load_n(&waitStats.total_ns, __ATOMIC_RELAXED);
+  stats->max_ns = __atomic_load_n(&waitStats.max_ns, __ATOMIC_RELAXED);
+}
+
 /*
  * Unsupported functions
  */
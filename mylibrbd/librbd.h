@@ -72,7 +72,19 @@ typedef void *rbd_image_t;
 typedef void *rbd_completion_t;
 typedef void (*rbd_callback_t)(rbd_completion_t cb, void *arg);
 
-typedef struct {
+/* operations of requests submitted to bs3 */
+enum {
+  RBD_AIO_OP_READ = 0,
+  RBD_AIO_OP_WRITE = 1,
+  RBD_AIO_OP_DISCARD = 2,
+  RBD_AIO_OP_FLUSH = 3,
+  RBD_AIO_OP_WRITE_ZEROES = 4,
+};
+
+/* number of iovecs stored directly in the completion */
+#define RBD_AIO_INLINE_IOVS 4
+
+typedef struct AioCompletion {
     //User supplied custom argument for the callback
     void *cb_arg;
     
@@ -84,18 +96,109 @@ typedef struct {
     //+ve values indicate successful completion
     ssize_t return_value;
 
-    //Following fields are only needed when we have to copy from buf to iov for readv function. This operation is only needed if iovcnt > 0
+    //Temporary buffer owned by the request. It is freed on completion.
     void* buf;
-    const struct iovec* iov;
+
+    //Futex word signalling completion to waiters. Pending, waiting or complete.
+    unsigned int state;
+
+    //References of the caller until rbd_aio_release, of the request in flight until it is completed and of the queue of rbd_poll_io_events until it is polled. The completion returns to the pool with the last one.
+    unsigned int refs;
+    //Set by rbd_aio_release, released completions are not returned by rbd_poll_io_events.
+    int released;
+
+    //Image the request was submitted to and handle of its volume in bs3
+    void* image;
+    int64_t handle;
+
+    //Completion of a synchronous call like rbd_read. It is never queued for rbd_poll_io_events.
+    int internal;
+
+    //Request descriptor. It is filled on submission and read by Go when it takes the request from the submission ring.
+    int op;
+    uint64_t off;
+    size_t len;
+    //Data buffer, unused when iovcnt > 0
+    char* data;
+    //Copy of the caller's iovec array. Short arrays are stored in iov_inline.
+    struct iovec* iov;
     int iovcnt;
+    struct iovec iov_inline[RBD_AIO_INLINE_IOVS];
+    //Next request of the same rbd_aio_submit_batch call, NULL for the last one
+    struct AioCompletion* batch_next;
+    //Next completion queued for rbd_poll_io_events
+    struct AioCompletion* event_next;
+
+    //Timestamps of the request phases in CLOCK_MONOTONIC ns. Filled only when tracing is enabled.
+    struct {
+      uint64_t submit;
+      uint64_t dequeue;
+      uint64_t backend_start;
+      uint64_t backend_end;
+    } trace;
   } AioCompletion;
 
+/* size of the lock-free rings shared by librbd and bs3, power of two */
+#define RBD_RING_SIZE 4096
+
+typedef struct {
+  uint64_t seq;
+  AioCompletion *completion;
+} RingCell;
+
+//Bounded lock-free queue of completions, see librbd.c and bs3/ring.go
+typedef struct {
+  uint64_t head __attribute__((aligned(64)));
+  uint64_t tail __attribute__((aligned(64)));
+  RingCell cells[RBD_RING_SIZE] __attribute__((aligned(64)));
+} Ring;
+
+//Rings for passing requests between librbd and bs3 without calling into Go for every request
+typedef struct {
+  //Requests submitted by librbd and taken by bs3 pollers
+  Ring submissions;
+  //Requests finished by bs3 and reaped by librbd
+  Ring completions;
+  //eventfd waking up pollers sleeping on empty submission ring
+  int doorbell;
+  //Set by bs3 when requests should be traced, see rbd_trace_dump
+  int trace;
+  //Number of pollers sleeping on the doorbell
+  int sleeping __attribute__((aligned(64)));
+} Rings;
+
 typedef struct {
   uint64_t id;
   uint64_t size;
   const char *name;
 } rbd_snap_info_t;
 
+/* one traced request, see rbd_trace_dump */
+typedef struct {
+  int op;                   /* RBD_AIO_OP_* */
+  int64_t volume;           /* handle of the volume in bs3 */
+  uint64_t off;
+  uint64_t len;
+  int64_t ret;              /* return value of the request */
+  /* CLOCK_MONOTONIC timestamps in ns */
+  uint64_t submit_ns;       /* submitted by librbd */
+  uint64_t dequeue_ns;      /* taken from the submission ring by bs3 */
+  uint64_t backend_start_ns;
+  uint64_t backend_end_ns;
+  uint64_t complete_ns;     /* completed by librbd */
+} rbd_trace_record_t;
+
+/* request descriptor for rbd_aio_submit_batch */
+typedef struct {
+  int op;                   /* RBD_AIO_OP_* */
+  uint64_t off;
+  size_t len;               /* ignored when iovcnt > 0 */
+  char *buf;                /* data buffer when iovcnt == 0 */
+  const struct iovec *iov;
+  int iovcnt;
+  rbd_completion_t comp;
+} rbd_aio_request_t;
+
 
 #define RBD_MAX_IMAGE_NAME_SIZE 96
 #define RBD_MAX_BLOCK_NAME_SIZE 24
@@ -134,6 +237,12 @@ enum {
   RBD_IMAGE_OPTION_MIRROR_IMAGE_MODE = 13,
 };
 
+/* image event notification types, see rbd_set_image_notification */
+enum {
+  EVENT_TYPE_PIPE = 1,
+  EVENT_TYPE_EVENTFD = 2
+};
+
 /* rbd_write_zeroes / rbd_aio_write_zeroes flags */
 enum {
   RBD_WRITE_ZEROES_FLAG_THICK_PROVISION = (1U<<0), /* fully allocated zeroed extent */
@@ -262,6 +371,23 @@ CEPH_RBD_API int rbd_aio_write_zeroes(rbd_image_t image, uint64_t off,
 // Used by FIO
 CEPH_RBD_API int rbd_flush(rbd_image_t image);
 
+/**
+ * Submit multiple requests at once. Not part of the upstream librbd API.
+ *
+ * All requests are handed to bs3 together, which looks up the data of all
+ * reads at once and merges downloads of adjacent object parts. Requests
+ * complete independently, except that a flush completes only after all
+ * requests preceding it in reqs completed.
+ *
+ * @param image the image to submit the requests to
+ * @param reqs array of request descriptors
+ * @param n number of requests in reqs
+ * @returns 0 on success, negative error code on failure, in which case
+ * none of the requests was submitted
+ */
+CEPH_RBD_API int rbd_aio_submit_batch(rbd_image_t image,
+                                      rbd_aio_request_t *reqs, int n);
+
 
 /**
  * Start a flush if caching is enabled. Get a callback when
@@ -290,6 +416,119 @@ CEPH_RBD_API ssize_t rbd_aio_get_return_value(rbd_completion_t c);
 CEPH_RBD_API void *rbd_aio_get_arg(rbd_completion_t c);
 CEPH_RBD_API void rbd_aio_release(rbd_completion_t c);
 
+/**
+ * Register a descriptor signalled when asynchronous requests of the image
+ * complete.
+ *
+ * Completed requests are queued and the descriptor is signalled once until
+ * the queue is polled with rbd_poll_io_events. The completion callback is
+ * still called, on the thread completing the request, when it is not NULL.
+ * Event driven users therefore usually pass NULL callback.
+ *
+ * @param image the image to be notified about
+ * @param fd eventfd or write end of a pipe
+ * @param type EVENT_TYPE_EVENTFD or EVENT_TYPE_PIPE
+ * @returns 0 on success, negative error code on failure
+ */
+CEPH_RBD_API int rbd_set_image_notification(rbd_image_t image, int fd, int type);
+
+/**
+ * Take completed requests of the image queued since the last call.
+ *
+ * Requests are queued before their callback is called, hence the callback may
+ * still be running. The return value is already set and the completion can be
+ * released right away. Completions released by their callback are skipped.
+ *
+ * @param image the image to poll
+ * @param comps array where completions are stored
+ * @param numcomp size of comps
+ * @returns number of completions stored in comps
+ */
+CEPH_RBD_API int rbd_poll_io_events(rbd_image_t image, rbd_completion_t *comps,
+                                    int numcomp);
+
+/**
+ * Copy the most recent traced requests. Not part of the upstream librbd API.
+ *
+ * Requests are traced only when tracing is enabled in the bs3 configuration
+ * and librbd is not compiled with RBD_NO_TRACE. The trace is a ring keeping
+ * just the latest requests, older ones are overwritten.
+ *
+ * @param records array where the records are stored, oldest first
+ * @param max size of records
+ * @returns number of stored records, -ENOSYS when tracing is compiled out
+ */
+CEPH_RBD_API int rbd_trace_dump(rbd_trace_record_t *records, int max);
+
+/**
+ * Statistics of the completion pool. Not part of the upstream librbd API.
+ *
+ * Allocations served from the per-thread cache are hits. Allocations which
+ * had to refill the cache from the shared free list or from a new slab are
+ * misses. Counters of other threads are aggregated in batches, hence they can
+ * lag behind by a few dozens of allocations per thread.
+ */
+typedef struct {
+  uint64_t size;   /* number of completions allocated in slabs */
+  uint64_t hits;   /* allocations served from the thread cache */
+  uint64_t misses; /* allocations refilling the thread cache */
+} rbd_completion_pool_stats_t;
+
+CEPH_RBD_API void rbd_completion_pool_stats(rbd_completion_pool_stats_t *stats);
+
+/**
+ * Statistics of rbd_aio_wait_for_complete. Not part of the upstream librbd
+ * API.
+ *
+ * Waiters spin for an adaptive number of iterations before they sleep on the
+ * completion. Waits finished while spinning are counted in spun, waits which
+ * had to sleep in slept.
+ */
+typedef struct {
+  uint64_t waits;    /* number of finished waits */
+  uint64_t spun;     /* waits finished while spinning */
+  uint64_t slept;    /* waits which had to sleep */
+  uint64_t total_ns; /* sum of all wait times */
+  uint64_t max_ns;   /* longest wait time */
+} rbd_aio_wait_stats_t;
+
+CEPH_RBD_API void rbd_aio_wait_stats(rbd_aio_wait_stats_t *stats);
+
+/**
+ * Statistics of the block cache in front of the backend. Not part of the
+ * upstream librbd API.
+ *
+ * The cache is shared by all images opened in the process. Lookups are
+ * counted per block, hence one read can count multiple hits and misses. All
+ * are zero until the first image is opened.
+ */
+typedef struct {
+  uint64_t size;      /* bytes of cached data */
+  uint64_t capacity;  /* maximal bytes of cached data */
+  uint64_t hits;      /* blocks served from the cache */
+  uint64_t misses;    /* blocks looked up but not found */
+  uint64_t evictions; /* blocks evicted from the cache */
+} rbd_cache_stats_t;
+
+CEPH_RBD_API void rbd_cache_stats(rbd_cache_stats_t *stats);
+
+/*
+ * Concurrency of requests to the backend. Not part of the upstream librbd
+ * API.
+ *
+ * Limits adapt to the latency and errors of the backend, see min_concurrency
+ * in the configuration. They are shared by all images opened in the process.
+ * All are zero until the first image is opened.
+ */
+typedef struct {
+  uint64_t upload_limit;   /* maximal uploads in flight */
+  uint64_t uploads;        /* uploads in flight */
+  uint64_t download_limit; /* maximal downloads in flight */
+  uint64_t downloads;      /* downloads in flight */
+} rbd_concurrency_t;
+
+CEPH_RBD_API void rbd_concurrency(rbd_concurrency_t *concurrency);
+
 
 #ifdef __cplusplus
 }